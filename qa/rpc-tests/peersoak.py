@@ -0,0 +1,227 @@
+#!/usr/bin/env python
+# Copyright (c) 2014 The Bitcoin developers
+# Distributed under the MIT/X11 software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+# Soak the socket handler with hundreds of loopback peers: each one does
+# the version handshake and then rounds of ping/pong, timed from here.
+# With all of them connected, the node also makes an outbound connection
+# to a second node through a SOCKS5 proxy run here.
+# Pass --peers above FD_SETSIZE (1024) to go past what select() handles,
+# after raising the open files limit of the shell (ulimit -n).
+
+import hashlib
+import random
+import select
+import socket
+import struct
+import threading
+import time
+
+from test_framework import BitcoinTestFramework
+from util import *
+
+MAGIC = "devr"
+PROTOCOL_VERSION = 70002
+
+def message(command, payload):
+    checksum = hashlib.sha256(hashlib.sha256(payload).digest()).digest()[:4]
+    return MAGIC + struct.pack("<12sI", command, len(payload)) + checksum + payload
+
+def netaddr(port):
+    return struct.pack("<Q", 1) + "\x00" * 10 + "\xff\xff" + socket.inet_aton("127.0.0.1") + struct.pack(">H", port)
+
+def version_message(port):
+    payload = struct.pack("<iQq", PROTOCOL_VERSION, 1, int(time.time()))
+    payload += netaddr(port) + netaddr(0)
+    payload += struct.pack("<Q", random.getrandbits(64))
+    payload += "\x0a/peersoak/" + struct.pack("<i?", 0, False)
+    return message("version", payload)
+
+class Peer(object):
+    def __init__(self, port):
+        self.sock = socket.create_connection(("127.0.0.1", port))
+        self.buf = ""
+
+    def send(self, data):
+        self.sock.sendall(data)
+
+    def receive(self):
+        """Read what arrived and return the complete messages in it."""
+        data = self.sock.recv(65536)
+        if not data:
+            raise AssertionError("peer disconnected")
+        self.buf += data
+        messages = []
+        while len(self.buf) >= 24:
+            command, length = struct.unpack("<12sI", self.buf[4:20])
+            if len(self.buf) < 24 + length:
+                break
+            messages.append((command.rstrip("\x00"), self.buf[24:24 + length]))
+            self.buf = self.buf[24 + length:]
+        return messages
+
+def wait_for(peers, wanted, timeout=60):
+    """Serve peers until wanted(peer, command, payload) was true once for
+    each of them, answering pings on the way. Returns the seconds each
+    peer waited."""
+    start = time.time()
+    waiting = dict((peer.sock.fileno(), peer) for peer in peers)
+    elapsed = {}
+    poller = select.poll()
+    for fd in waiting:
+        poller.register(fd, select.POLLIN)
+    while waiting:
+        if time.time() - start > timeout:
+            raise AssertionError("%d peers timed out" % len(waiting))
+        for fd, event in poller.poll(1000):
+            peer = waiting.get(fd)
+            if peer is None:
+                continue
+            for command, payload in peer.receive():
+                if command == "ping":
+                    peer.send(message("pong", payload))
+                if wanted(peer, command, payload):
+                    elapsed[peer] = time.time() - start
+                    poller.unregister(fd)
+                    del waiting[fd]
+                    break
+    return elapsed
+
+def recv_exactly(sock, n):
+    data = ""
+    while len(data) < n:
+        chunk = sock.recv(n - len(data))
+        if not chunk:
+            raise IOError("connection closed")
+        data += chunk
+    return data
+
+def relay(source, dest):
+    try:
+        while True:
+            data = source.recv(65536)
+            if not data:
+                break
+            dest.sendall(data)
+    except socket.error:
+        pass
+    for sock in (source, dest):
+        try:
+            sock.shutdown(socket.SHUT_RDWR)
+        except socket.error:
+            pass
+
+class Socks5Proxy(object):
+    """SOCKS5 proxy without authentication that only does CONNECT, to
+    domain names as the node sends them, and relays on two threads."""
+
+    def __init__(self):
+        self.listener = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        self.listener.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        self.listener.bind(("127.0.0.1", 0))
+        self.listener.listen(5)
+        self.port = self.listener.getsockname()[1]
+        self.destinations = []
+        self.start(self.serve)
+
+    def start(self, target, *args):
+        thread = threading.Thread(target=target, args=args)
+        thread.daemon = True
+        thread.start()
+
+    def serve(self):
+        while True:
+            client, addr = self.listener.accept()
+            self.start(self.handle, client)
+
+    def handle(self, client):
+        try:
+            version, nmethods = struct.unpack("BB", recv_exactly(client, 2))
+            recv_exactly(client, nmethods)
+            client.sendall("\x05\x00")
+            version, command, reserved, atyp = struct.unpack("BBBB", recv_exactly(client, 4))
+            assert command == 1 and atyp == 3
+            host = recv_exactly(client, ord(recv_exactly(client, 1)))
+            port, = struct.unpack(">H", recv_exactly(client, 2))
+            self.destinations.append((host, port))
+            remote = socket.create_connection((host, port))
+            client.sendall("\x05\x00\x00\x01" + socket.inet_aton("0.0.0.0") + struct.pack(">H", 0))
+        except (IOError, socket.error, AssertionError):
+            client.close()
+            return
+        self.start(relay, client, remote)
+        relay(remote, client)
+
+def wait_for_connections(node, count, timeout=30):
+    start = time.time()
+    while node.getconnectioncount() != count:
+        if time.time() - start > timeout:
+            raise AssertionError("%d connections instead of %d" % (node.getconnectioncount(), count))
+        time.sleep(0.1)
+
+class PeerSoakTest(BitcoinTestFramework):
+
+    def add_options(self, parser):
+        parser.add_option("--peers", dest="peers", default=500, type="int",
+                          help="Number of loopback peers (default: %default)")
+        parser.add_option("--rounds", dest="rounds", default=20, type="int",
+                          help="Ping rounds per peer (default: %default)")
+
+    def setup_network(self):
+        self.proxy = Socks5Proxy()
+        self.nodes = start_nodes(2, self.options.tmpdir,
+                                 [["-maxconnections=%d" % (self.options.peers + 100),
+                                   "-proxy=127.0.0.1:%d" % self.proxy.port], []])
+        self.is_network_split = False
+
+    def run_test(self):
+        port = p2p_port(0)
+        npeers = self.options.peers
+
+        start = time.time()
+        peers = [Peer(port) for i in range(npeers)]
+        for peer in peers:
+            peer.send(version_message(port))
+        wait_for(peers, lambda peer, command, payload: command == "verack")
+        for peer in peers:
+            peer.send(message("verack", ""))
+        print("%d peers connected in %.2fs" % (npeers, time.time() - start))
+        wait_for_connections(self.nodes[0], npeers)
+
+        # An outbound connection, made once the loopback peers hold the
+        # lower socket numbers: the waits while connecting to the proxy and
+        # reading its replies take any socket number
+        self.nodes[0].addnode("127.0.0.1:%d" % p2p_port(1), "onetry")
+        wait_for_connections(self.nodes[0], npeers + 1)
+        assert_equal(self.proxy.destinations, [("127.0.0.1", p2p_port(1))])
+        outbound = [peer for peer in self.nodes[0].getpeerinfo() if not peer["inbound"]]
+        assert_equal(len(outbound), 1)
+        wait_for_connections(self.nodes[1], 1)
+
+        latencies = []
+        start = time.time()
+        for i in range(self.options.rounds):
+            nonce = struct.pack("<Q", random.getrandbits(64))
+            for peer in peers:
+                peer.send(message("ping", nonce))
+            elapsed = wait_for(peers, lambda peer, command, payload: command == "pong" and payload == nonce)
+            latencies.extend(elapsed.values())
+        latencies.sort()
+        print("%d pings in %.2fs, median %.1fms, 99th percentile %.1fms" %
+              (len(latencies), time.time() - start,
+               1000 * latencies[len(latencies) / 2], 1000 * latencies[len(latencies) * 99 / 100]))
+
+        # Hanging up half of them leaves the rest served
+        for peer in peers[:npeers / 2]:
+            peer.sock.close()
+        peers = peers[npeers / 2:]
+        wait_for_connections(self.nodes[0], len(peers) + 1)
+        nonce = struct.pack("<Q", 0)
+        for peer in peers:
+            peer.send(message("ping", nonce))
+        wait_for(peers, lambda peer, command, payload: command == "pong" and payload == nonce)
+        assert_equal(len(self.nodes[0].getpeerinfo()), len(peers) + 1)
+
+if __name__ == '__main__':
+    PeerSoakTest().main()
@@ -0,0 +1,90 @@
+#!/usr/bin/env python
+# Copyright (c) 2014 The Bitcoin Core developers
+# Distributed under the MIT/X11 software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+# Test reindexing a block file that holds blocks out of order.
+# The blocks of node0 are written to the block files of nodes 1 and 2
+# with two of them swapped, so a child comes before its parent. Node 1
+# reindexes with the block checks on the loading thread (-par=1), node 2
+# with check threads (-par=4). Both must end up with the chain of node0,
+# and node 1 must load the index again without reading auxpows back from
+# its block files.
+
+from test_framework import BitcoinTestFramework
+from util import *
+import os
+import shutil
+import struct
+import time
+
+def read_blocks(path):
+    """ The raw blocks in a block file, in file order """
+    blocks = []
+    with open(path, 'rb') as f:
+        data = f.read()
+    magic = data[0:4]
+    pos = 0
+    # The rest of the file is preallocated zeroes
+    while pos + 8 <= len(data) and data[pos:pos+4] == magic:
+        size = struct.unpack("<I", data[pos+4:pos+8])[0]
+        blocks.append(data[pos+8:pos+8+size])
+        pos += 8 + size
+    return (magic, blocks)
+
+def write_blocks(path, magic, blocks):
+    with open(path, 'wb') as f:
+        for block in blocks:
+            f.write(magic + struct.pack("<I", len(block)) + block)
+
+def wait_for_height(node, height, timeout=60):
+    deadline = time.time() + timeout
+    while node.getblockcount() < height and time.time() < deadline:
+        time.sleep(0.5)
+    assert_equal(node.getblockcount(), height)
+
+class ReindexTest(BitcoinTestFramework):
+
+    def setup_network(self):
+        self.nodes = start_nodes(1, self.options.tmpdir)
+        self.is_network_split = False
+
+    def run_test(self):
+        node0 = self.nodes[0]
+        height = node0.getblockcount()
+        hashes = [ node0.getblockhash(h) for h in range(height + 1) ]
+        block = node0.getblock(hashes[101])
+        stop_nodes(self.nodes)
+        wait_bitcoinds()
+
+        blkfile = os.path.join(self.options.tmpdir, "node0", "regtest", "blocks", "blk00000.dat")
+        (magic, blocks) = read_blocks(blkfile)
+        assert_equal(len(blocks), height + 1)
+        # The blocks were stored in chain order, put 101 before its parent
+        blocks[100], blocks[101] = blocks[101], blocks[100]
+
+        for i in [1, 2]:
+            datadir = os.path.join(self.options.tmpdir, "node"+str(i), "regtest")
+            shutil.rmtree(os.path.join(datadir, "blocks"))
+            shutil.rmtree(os.path.join(datadir, "chainstate"))
+            os.makedirs(os.path.join(datadir, "blocks"))
+            write_blocks(os.path.join(datadir, "blocks", "blk00000.dat"), magic, blocks)
+
+        self.nodes = [ start_node(1, self.options.tmpdir, ["-reindex", "-par=1"]),
+                       start_node(2, self.options.tmpdir, ["-reindex", "-par=4"]) ]
+        for node in self.nodes:
+            wait_for_height(node, height)
+            assert_equal(node.getbestblockhash(), hashes[height])
+            assert_equal([ node.getblockhash(h) for h in range(height + 1) ], hashes)
+            assert_equal(node.getblock(hashes[101]), block)
+        assert_equal(self.nodes[0].getchaintips(), self.nodes[1].getchaintips())
+
+        # Loading the index again checks the auxpow rows above the last
+        # checkpoint from the index alone, no auxpow is read from a block file
+        stop_node(self.nodes[0], 1)
+        self.nodes[0] = start_node(1, self.options.tmpdir)
+        assert_equal(self.nodes[0].getbestblockhash(), hashes[height])
+        assert_equal(self.nodes[0].getinfo()["auxpowcache"]["blockfilereads"], 0)
+
+if __name__ == '__main__':
+    ReindexTest().main()
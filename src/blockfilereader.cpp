@@ -0,0 +1,137 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockfilereader.h"
+
+#include "chain.h"
+#include "main.h"
+#include "util.h"
+
+#include <algorithm>
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Read ahead this far past each block while a sequential scan runs
+static const size_t nSequentialReadAhead = 8 << 20;
+
+CBlockFileReader blockFileReader(DEFAULT_MAPPED_BLOCK_FILES);
+
+CMappedBlockFile::~CMappedBlockFile()
+{
+#ifndef WIN32
+    munmap((void*)pbegin, nSize);
+#endif
+}
+
+CBlockFileReader::CBlockFileReader(unsigned int nMaxFiles) : cache(nMaxFiles), nSequential(0), nWriteFile(0), nReads(0), nMaps(0)
+{
+}
+
+void CBlockFileReader::SetMaxFiles(unsigned int nMaxFiles)
+{
+    LOCK(cs);
+    cache.max_size(nMaxFiles);
+}
+
+boost::shared_ptr<const CMappedBlockFile> CBlockFileReader::Map(int nFile)
+{
+    boost::shared_ptr<const CMappedBlockFile> mapping;
+#ifndef WIN32
+    boost::filesystem::path path = GetBlockPosFilename(CDiskBlockPos(nFile, 0), "blk");
+    int fd = open(path.string().c_str(), O_RDONLY);
+    if (fd == -1)
+        return mapping;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0 && (uint64_t)st.st_size <= (size_t)-1) {
+        void* p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (p != MAP_FAILED) {
+            if (nSequential > 0)
+                madvise(p, st.st_size, MADV_SEQUENTIAL);
+            mapping.reset(new CMappedBlockFile((const char*)p, st.st_size));
+            nMaps++;
+        } else {
+            LogPrintf("%s : mmap of %s failed\n", __func__, path.string());
+        }
+    }
+    close(fd);
+#endif
+    return mapping;
+}
+
+bool CBlockFileReader::GetBlockData(const CDiskBlockPos& pos, boost::shared_ptr<const CMappedBlockFile>& mapping, const char*& pbegin, const char*& pend)
+{
+    // Blocks are preceded by the message start and their size
+    if (pos.IsNull() || pos.nPos < 8)
+        return false;
+
+    size_t nReadAhead = 0;
+    uint64_t nEnd = 0;
+    {
+        LOCK(cs);
+        if (cache.max_size() == 0 || pos.nFile >= nWriteFile)
+            return false;
+        nReads++;
+        if (!cache.get(pos.nFile, mapping)) {
+            mapping = Map(pos.nFile);
+            if (!mapping)
+                return false;
+            cache.insert(pos.nFile, mapping);
+        }
+        if (pos.nPos > mapping->nSize)
+            return false;
+        unsigned int nSize;
+        memcpy(&nSize, mapping->pbegin + pos.nPos - 4, sizeof(nSize));
+        nEnd = (uint64_t)pos.nPos + nSize;
+        if (nEnd > mapping->nSize)
+            return false;
+        if (nSequential > 0)
+            nReadAhead = nSequentialReadAhead;
+    }
+
+    pbegin = mapping->pbegin + pos.nPos;
+    pend = mapping->pbegin + nEnd;
+#ifndef WIN32
+    // One hint to page in the whole block, rather than a fault per page
+    static const size_t nPageSize = sysconf(_SC_PAGESIZE);
+    size_t nAdviseBegin = pos.nPos - pos.nPos % nPageSize;
+    size_t nAdviseEnd = (size_t)std::min(nEnd + nReadAhead, (uint64_t)mapping->nSize);
+    madvise((void*)(mapping->pbegin + nAdviseBegin), nAdviseEnd - nAdviseBegin, MADV_WILLNEED);
+#endif
+    return true;
+}
+
+void CBlockFileReader::SetWriteFile(int nFile)
+{
+    LOCK(cs);
+    // Reindexing can go back to earlier files
+    for (int n = nFile; n < nWriteFile; n++)
+        cache.erase(n);
+    nWriteFile = nFile;
+}
+
+void CBlockFileReader::BeginSequential()
+{
+    LOCK(cs);
+    nSequential++;
+}
+
+void CBlockFileReader::EndSequential()
+{
+    LOCK(cs);
+    nSequential--;
+}
+
+void CBlockFileReader::GetStats(uint64_t& nReadsOut, uint64_t& nMapsOut, unsigned int& nMappedOut, unsigned int& nMaxMappedOut) const
+{
+    LOCK(cs);
+    nReadsOut = nReads;
+    nMapsOut = nMaps;
+    nMappedOut = cache.size();
+    nMaxMappedOut = cache.max_size();
+}
@@ -0,0 +1,107 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKFILEREADER_H
+#define BITCOIN_BLOCKFILEREADER_H
+
+#include "lrucache.h"
+#include "serialize.h"
+#include "sync.h"
+#include "version.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <boost/shared_ptr.hpp>
+
+struct CDiskBlockPos;
+
+// -mapblockfiles default, block files kept mapped at once
+static const unsigned int DEFAULT_MAPPED_BLOCK_FILES = 64;
+
+/** Read-only memory map of one blk?????.dat file, unmapped when the last
+ *  reader holding it lets go. */
+class CMappedBlockFile
+{
+private:
+    CMappedBlockFile(const CMappedBlockFile&);
+    CMappedBlockFile& operator=(const CMappedBlockFile&);
+
+public:
+    const char* pbegin;
+    size_t nSize;
+
+    CMappedBlockFile(const char* pbeginIn, size_t nSizeIn) : pbegin(pbeginIn), nSize(nSizeIn) {}
+    ~CMappedBlockFile();
+};
+
+/**
+ * Reads blocks straight out of memory mapped block files, instead of
+ * opening, seeking and reading the file through stdio for every block.
+ * The most recently used files stay mapped. Before a block is unserialized
+ * the kernel is asked to read its whole range ahead, and further ahead
+ * while a sequential scan is running.
+ *
+ * Only finished files are mapped, they are never written again. The file
+ * blocks are appended to is preallocated and truncated when it is left,
+ * and a read through a mapping past the new end would fault with SIGBUS
+ * instead of failing, so its blocks are left to the stdio reader.
+ */
+class CBlockFileReader
+{
+private:
+    mutable CCriticalSection cs;
+    lrucache<int, boost::shared_ptr<const CMappedBlockFile> > cache;
+    int nSequential;
+    int nWriteFile;
+    uint64_t nReads;
+    uint64_t nMaps;
+
+    boost::shared_ptr<const CMappedBlockFile> Map(int nFile);
+
+    /** Find the serialized block at pos, keeping its file mapped in mapping. */
+    bool GetBlockData(const CDiskBlockPos& pos, boost::shared_ptr<const CMappedBlockFile>& mapping, const char*& pbegin, const char*& pend);
+
+public:
+    CBlockFileReader(unsigned int nMaxFiles);
+
+    void SetMaxFiles(unsigned int nMaxFiles);
+
+    /** Unserialize what is stored at pos (a block or its header) from the
+     *  mapping of its file. Returns false if the file is still written to or
+     *  cannot be mapped, the caller then reads it the usual way. Throws on unserialize errors. */
+    template <typename T>
+    bool Read(const CDiskBlockPos& pos, T& obj)
+    {
+        boost::shared_ptr<const CMappedBlockFile> mapping;
+        const char* pbegin;
+        const char* pend;
+        if (!GetBlockData(pos, mapping, pbegin, pend))
+            return false;
+        CSpanStream ss(pbegin, pend, SER_DISK, CLIENT_VERSION);
+        ss >> obj;
+        return true;
+    }
+
+    /** Blocks are appended to nFile, so it and the files after it are not
+     *  mapped. Nothing is mapped until this is called. */
+    void SetWriteFile(int nFile);
+
+    void BeginSequential();
+    void EndSequential();
+
+    void GetStats(uint64_t& nReadsOut, uint64_t& nMapsOut, unsigned int& nMappedOut, unsigned int& nMaxMappedOut) const;
+};
+
+extern CBlockFileReader blockFileReader;
+
+/** Tell the block file reader that blocks are read in chain order while in scope. */
+class CSequentialBlockReads
+{
+public:
+    CSequentialBlockReads() { blockFileReader.BeginSequential(); }
+    ~CSequentialBlockReads() { blockFileReader.EndSequential(); }
+};
+
+#endif // BITCOIN_BLOCKFILEREADER_H
@@ -211,6 +211,8 @@ public:
     }
 
     CBlockHeader GetBlockHeader() const;
+    //! The header as kept in memory, without reading the auxpow of auxpow blocks
+    CBlockHeader GetBlockHeaderWithoutAuxPow() const;
 
     uint256 GetBlockHash() const
     {
@@ -291,21 +293,37 @@ public:
 };
 
 /** Used to marshal pointers into hashes for db storage. */
+/** Version bit of block index rows that store the auxpow in the compact
+ *  encoding. Rows written before it carry the full CAuxPow. */
+static const int DISKINDEX_AUXPOW_COMPACT = 0x40000000;
+
 class CDiskBlockIndex : public CBlockIndex
 {
 public:
+    //! Where a row keeps the auxpow of an auxpow block
+    enum {
+        AUXPOW_LEGACY = -1,        //!< full CAuxPow, memory only marker for old rows
+        AUXPOW_NONE = 0,
+        AUXPOW_INLINE = 1,         //!< CCompactAuxPow in the row, the block is not stored yet or above the last checkpoint
+        AUXPOW_IN_BLOCK_FILE = 2,  //!< only nFile/nDataPos, the header in the block file has it
+    };
+
     uint256 hashPrev;
 	// if this is an aux work block
     boost::shared_ptr<CAuxPow> auxpow;
+    //! Memory only, how the row that was read stores the auxpow
+    int nAuxPowFormat;
 
     CDiskBlockIndex() {
         hashPrev = 0;
 		auxpow.reset();
+        nAuxPowFormat = AUXPOW_NONE;
     }
 
     explicit CDiskBlockIndex(CBlockIndex* pindex, boost::shared_ptr<CAuxPow> auxpow) : CBlockIndex(*pindex) {
         hashPrev = (pprev ? pprev->GetBlockHash() : 0);
         this->auxpow = auxpow;
+        nAuxPowFormat = AUXPOW_NONE;
     }
 
     ADD_SERIALIZE_METHODS;
@@ -314,8 +332,11 @@ public:
 	inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion){
 	    /* immutable stuff goes here, mutable stuff
          * has SERIALIZE functions in CDiskBlockIndex */	
-		if (!(nType & SER_GETHASH))
-			READWRITE(VARINT(nVersion));
+		if (!(nType & SER_GETHASH)) {
+			int nRowVersion = nVersion | DISKINDEX_AUXPOW_COMPACT;
+			READWRITE(VARINT(nRowVersion));
+			nVersion = nRowVersion;
+		}
 
 		READWRITE(VARINT(nHeight));
 		READWRITE(VARINT(nTx));
@@ -327,9 +348,45 @@ public:
 		READWRITE(nTime);
 		READWRITE(nBits);
 		READWRITE(nNonce);
-		ReadWriteAuxPow(s, auxpow, nType, this->nVersion, ser_action);
+		if (nVersion & DISKINDEX_AUXPOW_COMPACT)
+			ReadWriteCompactAuxPow(s, ser_action, nType, nVersion);
+		else if (ser_action.ForRead()) {
+			nAuxPowFormat = (this->nVersion & BLOCK_VERSION_AUXPOW) ? AUXPOW_LEGACY : AUXPOW_NONE;
+			// SER_BLOCKHEADERONLY stops before the auxpow, which is stored last
+			if (!(nType & SER_BLOCKHEADERONLY))
+				ReadWriteAuxPow(s, auxpow, nType, this->nVersion, ser_action);
+		}
 	}
 
+    /** Blocks already in a block file that are written without their auxpow
+     *  only record the position, the auxpow is read back from the block
+     *  header there. SER_BLOCKHEADERONLY skips an inline auxpow. */
+    template <typename Stream, typename Operation>
+    inline void ReadWriteCompactAuxPow(Stream& s, Operation ser_action, int nType, int nVersion) {
+        if (!(this->nVersion & BLOCK_VERSION_AUXPOW)) {
+            nAuxPowFormat = AUXPOW_NONE;
+            return;
+        }
+        if (!ser_action.ForRead()) {
+            if (auxpow)
+                nAuxPowFormat = AUXPOW_INLINE;
+            else
+                nAuxPowFormat = (nStatus & BLOCK_HAVE_DATA) ? AUXPOW_IN_BLOCK_FILE : AUXPOW_NONE;
+        }
+        unsigned char nFormat = nAuxPowFormat;
+        READWRITE(nFormat);
+        nAuxPowFormat = nFormat;
+
+        if (nAuxPowFormat == AUXPOW_IN_BLOCK_FILE) {
+            READWRITE(VARINT(nFile));
+            READWRITE(VARINT(nDataPos));
+        } else if (nAuxPowFormat == AUXPOW_INLINE && !(nType & SER_BLOCKHEADERONLY)) {
+            if (ser_action.ForRead())
+                auxpow.reset(new CAuxPow());
+            READWRITE(REF(CCompactAuxPow(*auxpow)));
+        }
+    }
+
     uint256 CalcBlockHash() const
     {
         CBlockHeader block;
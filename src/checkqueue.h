@@ -12,6 +12,7 @@
 #include <boost/thread/condition_variable.hpp>
 #include <boost/thread/locks.hpp>
 #include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
 
 template <typename T>
 class CCheckQueueControl;
@@ -204,4 +205,18 @@ public:
     }
 };
 
+/** Interrupt and join a group of worker threads when leaving scope. */
+class CThreadGroupJoiner
+{
+private:
+    boost::thread_group &threads;
+
+public:
+    CThreadGroupJoiner(boost::thread_group &threadsIn) : threads(threadsIn) {}
+    ~CThreadGroupJoiner() {
+        threads.interrupt_all();
+        threads.join_all();
+    }
+};
+
 #endif // CHECKQUEUE_H
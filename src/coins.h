@@ -6,7 +6,10 @@
 #ifndef BITCOIN_COINS_H
 #define BITCOIN_COINS_H
 
+#include "checkqueue.h"
 #include "core.h"
+#include "flatmap.h"
+#include "memusage.h"
 #include "serialize.h"
 #include "uint256.h"
 
@@ -14,7 +17,6 @@
 #include <stdint.h>
 
 #include <boost/foreach.hpp>
-#include <boost/unordered_map.hpp>
 
 /** pruned version of CTransaction: only retains metadata and unspent transaction outputs
  *
@@ -254,6 +256,16 @@ public:
                 return false;
         return true;
     }
+
+    // heap memory owned by this entry: the vout array and the scripts in it
+    size_t DynamicMemoryUsage() const {
+        size_t ret = memusage::DynamicUsage(vout);
+        BOOST_FOREACH(const CTxOut &out, vout) {
+            const std::vector<unsigned char> &script = out.scriptPubKey;
+            ret += memusage::DynamicUsage(script);
+        }
+        return ret;
+    }
 };
 
 class CCoinsKeyHasher
@@ -263,9 +275,7 @@ private:
 
 public:
     CCoinsKeyHasher();
-    // This *must* return size_t. With Boost 1.46 on 32-bit systems the
-    // unordered_map will behave unpredictably if the custom hasher returns a
-    // uint64_t, resulting in failures when syncing the chain (#4634).
+    // This returns size_t, the full width CCoinsMap keeps in its slots.
     size_t operator()(const uint256& key) const {
         return key.GetHash(salt);
     }
@@ -284,7 +294,7 @@ struct CCoinsCacheEntry
     CCoinsCacheEntry() : coins(), flags(0) {}
 };
 
-typedef boost::unordered_map<uint256, CCoinsCacheEntry, CCoinsKeyHasher> CCoinsMap;
+typedef flatmap<uint256, CCoinsCacheEntry, CCoinsKeyHasher> CCoinsMap;
 
 struct CCoinsStats
 {
@@ -343,6 +353,38 @@ public:
 };
 
 
+/** Read of one txid from a CCoinsView, for a CCheckQueue. The view must
+ *  allow concurrent GetCoins calls, and the result must outlive the check. */
+class CCoinsReadCheck
+{
+public:
+    struct Result
+    {
+        uint256 txid;
+        CCoins coins;
+        bool fFound;
+
+        Result(const uint256 &txidIn) : txid(txidIn), fFound(false) {}
+    };
+
+private:
+    const CCoinsView* pview;
+    Result* presult;
+
+public:
+    CCoinsReadCheck() : pview(NULL), presult(NULL) {}
+    CCoinsReadCheck(const CCoinsView &view, Result &result) : pview(&view), presult(&result) {}
+
+    bool operator()();
+
+    void swap(CCoinsReadCheck& check)
+    {
+        std::swap(pview, check.pview);
+        std::swap(presult, check.presult);
+    }
+};
+
+
 class CCoinsViewCache;
 
 /** A reference to a mutable cache entry. Encapsulating it allows us to run
@@ -353,7 +395,8 @@ class CCoinsModifier
 private:
     CCoinsViewCache& cache;
     CCoinsMap::iterator it;
-    CCoinsModifier(CCoinsViewCache& cache_, CCoinsMap::iterator it_);
+    size_t cachedCoinUsage; // Cached memory usage of the CCoins object before modification
+    CCoinsModifier(CCoinsViewCache& cache_, CCoinsMap::iterator it_, size_t usage);
 
 public:
     CCoins* operator->() { return &it->second.coins; }
@@ -374,6 +417,9 @@ protected:
     mutable uint256 hashBlock;
     mutable CCoinsMap cacheCoins;
 
+    /* Cached dynamic memory usage for the inner CCoins objects. */
+    mutable size_t cachedCoinsUsage;
+
 public:
     CCoinsViewCache(CCoinsView *baseIn);
     ~CCoinsViewCache();
@@ -395,6 +441,15 @@ public:
     // allowed.
     CCoinsModifier ModifyCoins(const uint256 &txid);
 
+    // Check whether a txid is in this cache, without reading from the base.
+    bool HaveCoinsInCache(const uint256 &txid) const;
+
+    // Read the given distinct txids that are not cached yet from the base,
+    // spread over the threads serving pqueue (or on the calling thread if it
+    // is NULL), and add them to the cache. The base must allow concurrent
+    // GetCoins calls. Returns the number of entries read.
+    unsigned int Prefetch(const std::vector<uint256> &vTxid, CCheckQueue<CCoinsReadCheck>* pqueue);
+
     // Push the modifications applied to this cache to its base.
     // Failure to call this method before destruction will cause the changes to be forgotten.
     // If false is returned, the state of this cache (and its backing view) will be undefined.
@@ -403,6 +458,9 @@ public:
     // Calculate the size of the cache (in number of transactions)
     unsigned int GetCacheSize() const;
 
+    // Calculate the heap memory held by the cache, in bytes
+    size_t DynamicMemoryUsage() const;
+
     /** Amount of bitcoins coming in to a transaction
         Note that lightweight clients may not know anything besides the hash of previous transactions,
         so may not be able to calculate this.
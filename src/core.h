@@ -696,6 +696,47 @@ public:
         return parentBlockHeader.GetHash();
     }
 };
+
+/** Block index encoding of a CAuxPow. The merkle indexes are VARINTs, and
+ *  hashBlock, which merged mining software sets to the parent block hash,
+ *  is only written out when it is neither that nor null. The branch hashes
+ *  themselves do not compress. */
+class CCompactAuxPow
+{
+private:
+    CAuxPow& auxpow;
+
+public:
+    CCompactAuxPow(CAuxPow& auxpowIn) : auxpow(auxpowIn) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(*(CTransaction*)&auxpow);
+        READWRITE(auxpow.vMerkleBranch);
+        uint32_t nIndex = auxpow.nIndex;
+        READWRITE(VARINT(nIndex));
+        auxpow.nIndex = nIndex;
+        READWRITE(auxpow.vChainMerkleBranch);
+        READWRITE(VARINT(auxpow.nChainIndex));
+        READWRITE(auxpow.parentBlockHeader);
+
+        // 0: the parent block hash, 1: null, 2: follows
+        unsigned char nHashBlock = 2;
+        if (!ser_action.ForRead()) {
+            if (auxpow.hashBlock == auxpow.GetParentBlockHash())
+                nHashBlock = 0;
+            else if (auxpow.hashBlock == 0)
+                nHashBlock = 1;
+        }
+        READWRITE(nHashBlock);
+        if (nHashBlock == 2)
+            READWRITE(auxpow.hashBlock);
+        else if (ser_action.ForRead())
+            auxpow.hashBlock = (nHashBlock == 0 ? auxpow.GetParentBlockHash() : uint256(0));
+    }
+};
 template <typename Stream>
 void ReadWriteAuxPow(Stream& s, const boost::shared_ptr<CAuxPow>& auxpow, int nType, int nVersion, CSerActionSerialize ser_action)
 {
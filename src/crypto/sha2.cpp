@@ -8,6 +8,32 @@
 
 #include <string.h>
 
+#if defined(__x86_64__) || defined(__amd64__) || defined(__i386__)
+#if defined(ENABLE_SSE41) || defined(ENABLE_AVX2) || defined(ENABLE_SHANI)
+#include <cpuid.h>
+#define USE_SHA256_DISPATCH
+#endif
+#endif
+
+#ifdef ENABLE_SSE41
+namespace sha256d64_sse41
+{
+void Transform_4way(unsigned char* out, const unsigned char* in);
+}
+#endif
+#ifdef ENABLE_AVX2
+namespace sha256d64_avx2
+{
+void Transform_8way(unsigned char* out, const unsigned char* in);
+}
+#endif
+#ifdef ENABLE_SHANI
+namespace sha256_shani
+{
+void Transform(uint32_t* s, const unsigned char* chunk);
+}
+#endif
+
 // Internal implementation code.
 namespace
 {
@@ -264,8 +290,93 @@ void Transform(uint64_t* s, const unsigned char* chunk)
 
 } // namespace sha512
 
+typedef void (*TransformType)(uint32_t*, const unsigned char*);
+typedef void (*TransformD64Type)(unsigned char*, const unsigned char*);
+
+// Chosen by SHA256AutoDetect, the portable code until then.
+TransformType Transform = sha256::Transform;
+TransformD64Type TransformD64_4way = NULL;
+TransformD64Type TransformD64_8way = NULL;
+
+/** Double-SHA-256 of one 64-byte blob. */
+void TransformD64(unsigned char* out, const unsigned char* in)
+{
+    unsigned char buf[64];
+    uint32_t s[8];
+
+    sha256::Initialize(s);
+    Transform(s, in);
+    // Padding of a 64-byte message
+    memset(buf, 0, sizeof(buf));
+    buf[0] = 0x80;
+    buf[62] = 0x02;
+    Transform(s, buf);
+
+    // Hash the 32-byte result with its padding
+    for (int i = 0; i < 8; i++)
+        WriteBE32(buf + 4 * i, s[i]);
+    memset(buf + 32, 0, 32);
+    buf[32] = 0x80;
+    buf[62] = 0x01;
+    sha256::Initialize(s);
+    Transform(s, buf);
+    for (int i = 0; i < 8; i++)
+        WriteBE32(out + 4 * i, s[i]);
+}
+
+#ifdef USE_SHA256_DISPATCH
+/** Whether the OS saves the AVX registers on context switches. */
+bool AVXEnabled()
+{
+    uint32_t a, d;
+    __asm__("xgetbv" : "=a"(a), "=d"(d) : "c"(0));
+    return (a & 6) == 6;
+}
+#endif
+
 } // namespace
 
+std::string SHA256AutoDetect()
+{
+    std::string ret = "standard";
+#ifdef USE_SHA256_DISPATCH
+    uint32_t eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+        return ret;
+    bool fSSE41 = (ecx >> 19) & 1;
+    bool fAVX = ((ecx >> 27) & 1) && ((ecx >> 28) & 1) && AVXEnabled();
+    uint32_t nFeatures7 = 0;
+    if (__get_cpuid_max(0, NULL) >= 7) {
+        __cpuid_count(7, 0, eax, ebx, ecx, edx);
+        nFeatures7 = ebx;
+    }
+
+    // SHA-NI hashes a single lane faster than SSE4.1 does four
+    bool fSHANI = false;
+#ifdef ENABLE_SHANI
+    if (fSSE41 && ((nFeatures7 >> 29) & 1)) {
+        Transform = sha256_shani::Transform;
+        fSHANI = true;
+        ret = "shani(1way)";
+    }
+#endif
+#ifdef ENABLE_SSE41
+    if (fSSE41 && !fSHANI) {
+        TransformD64_4way = sha256d64_sse41::Transform_4way;
+        ret += ",sse41(4way)";
+    }
+#endif
+#ifdef ENABLE_AVX2
+    if (fAVX && ((nFeatures7 >> 5) & 1)) {
+        TransformD64_8way = sha256d64_avx2::Transform_8way;
+        ret += ",avx2(8way)";
+    }
+#endif
+    (void)fAVX;
+    (void)nFeatures7;
+#endif
+    return ret;
+}
 
 ////// SHA-256
 
@@ -283,12 +394,12 @@ CSHA256& CSHA256::Write(const unsigned char* data, size_t len)
         memcpy(buf + bufsize, data, 64 - bufsize);
         bytes += 64 - bufsize;
         data += 64 - bufsize;
-        sha256::Transform(s, buf);
+        Transform(s, buf);
         bufsize = 0;
     }
     while (end >= data + 64) {
         // Process full chunks directly from the source.
-        sha256::Transform(s, data);
+        Transform(s, data);
         bytes += 64;
         data += 64;
     }
@@ -324,6 +435,32 @@ CSHA256& CSHA256::Reset()
     return *this;
 }
 
+void SHA256D64(unsigned char* out, const unsigned char* in, size_t blocks)
+{
+    if (TransformD64_8way) {
+        while (blocks >= 8) {
+            TransformD64_8way(out, in);
+            out += 256;
+            in += 512;
+            blocks -= 8;
+        }
+    }
+    if (TransformD64_4way) {
+        while (blocks >= 4) {
+            TransformD64_4way(out, in);
+            out += 128;
+            in += 256;
+            blocks -= 4;
+        }
+    }
+    while (blocks) {
+        TransformD64(out, in);
+        out += 32;
+        in += 64;
+        --blocks;
+    }
+}
+
 ////// SHA-512
 
 CSHA512::CSHA512() : bytes(0)
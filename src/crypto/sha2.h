@@ -7,6 +7,7 @@
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <string>
 
 /** A hasher class for SHA-256. */
 class CSHA256
@@ -25,6 +26,15 @@ public:
     CSHA256& Reset();
 };
 
+/** Select the fastest SHA-256 code the CPU supports, and return its description.
+ *  Until it is called only the portable code is used. */
+std::string SHA256AutoDetect();
+
+/** Compute the double-SHA-256 of each of blocks 64-byte blobs at in, as
+ *  merkle tree nodes are hashed, writing blocks 32-byte hashes to out.
+ *  Uses several lanes at once where SHA256AutoDetect found them. */
+void SHA256D64(unsigned char* out, const unsigned char* in, size_t blocks);
+
 /** A hasher class for SHA-512. */
 class CSHA512
 {
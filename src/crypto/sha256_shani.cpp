@@ -0,0 +1,130 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// This file is built with -msse4 -msha, its code only runs after CPUID says so.
+// Based on the public domain SHA extensions sample code by Intel.
+
+#include "crypto/common.h"
+
+#ifdef ENABLE_SHANI
+
+#include <immintrin.h>
+
+namespace sha256_shani
+{
+namespace
+{
+const uint32_t K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+/** Four rounds, on message words m of round 4*i. */
+void inline QuadRound(__m128i& s0, __m128i& s1, __m128i m, int i)
+{
+    const __m128i msg = _mm_add_epi32(m, _mm_loadu_si128((const __m128i*)&K[4 * i]));
+    s1 = _mm_sha256rnds2_epu32(s1, s0, msg);
+    s0 = _mm_sha256rnds2_epu32(s0, s1, _mm_shuffle_epi32(msg, 0x0e));
+}
+
+void inline ShiftMessageA(__m128i& m0, __m128i m1)
+{
+    m0 = _mm_sha256msg1_epu32(m0, m1);
+}
+
+void inline ShiftMessageC(__m128i& m0, __m128i m1, __m128i& m2)
+{
+    m2 = _mm_sha256msg2_epu32(_mm_add_epi32(m2, _mm_alignr_epi8(m1, m0, 4)), m1);
+}
+
+void inline ShiftMessageB(__m128i& m0, __m128i m1, __m128i& m2)
+{
+    ShiftMessageC(m0, m1, m2);
+    ShiftMessageA(m0, m1);
+}
+
+/** Convert the state between its natural order and the ABEF/CDGH order of the instructions. */
+void inline Shuffle(__m128i& s0, __m128i& s1)
+{
+    const __m128i t1 = _mm_shuffle_epi32(s0, 0xB1);
+    const __m128i t2 = _mm_shuffle_epi32(s1, 0x1B);
+    s0 = _mm_alignr_epi8(t1, t2, 0x08);
+    s1 = _mm_blend_epi16(t2, t1, 0xF0);
+}
+
+void inline Unshuffle(__m128i& s0, __m128i& s1)
+{
+    const __m128i t1 = _mm_shuffle_epi32(s0, 0x1B);
+    const __m128i t2 = _mm_shuffle_epi32(s1, 0xB1);
+    s0 = _mm_blend_epi16(t1, t2, 0xF0);
+    s1 = _mm_alignr_epi8(t2, t1, 0x08);
+}
+
+__m128i inline Load(const unsigned char* in)
+{
+    return _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)in), _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3));
+}
+
+} // namespace
+
+void Transform(uint32_t* s, const unsigned char* chunk)
+{
+    __m128i m0, m1, m2, m3, s0, s1, so0, so1;
+
+    s0 = _mm_loadu_si128((const __m128i*)s);
+    s1 = _mm_loadu_si128((const __m128i*)(s + 4));
+    Shuffle(s0, s1);
+    so0 = s0;
+    so1 = s1;
+
+    m0 = Load(chunk);
+    QuadRound(s0, s1, m0, 0);
+    m1 = Load(chunk + 16);
+    QuadRound(s0, s1, m1, 1);
+    ShiftMessageA(m0, m1);
+    m2 = Load(chunk + 32);
+    QuadRound(s0, s1, m2, 2);
+    ShiftMessageA(m1, m2);
+    m3 = Load(chunk + 48);
+    QuadRound(s0, s1, m3, 3);
+    ShiftMessageB(m2, m3, m0);
+    QuadRound(s0, s1, m0, 4);
+    ShiftMessageB(m3, m0, m1);
+    QuadRound(s0, s1, m1, 5);
+    ShiftMessageB(m0, m1, m2);
+    QuadRound(s0, s1, m2, 6);
+    ShiftMessageB(m1, m2, m3);
+    QuadRound(s0, s1, m3, 7);
+    ShiftMessageB(m2, m3, m0);
+    QuadRound(s0, s1, m0, 8);
+    ShiftMessageB(m3, m0, m1);
+    QuadRound(s0, s1, m1, 9);
+    ShiftMessageB(m0, m1, m2);
+    QuadRound(s0, s1, m2, 10);
+    ShiftMessageB(m1, m2, m3);
+    QuadRound(s0, s1, m3, 11);
+    ShiftMessageB(m2, m3, m0);
+    QuadRound(s0, s1, m0, 12);
+    ShiftMessageB(m3, m0, m1);
+    QuadRound(s0, s1, m1, 13);
+    ShiftMessageC(m0, m1, m2);
+    QuadRound(s0, s1, m2, 14);
+    ShiftMessageC(m1, m2, m3);
+    QuadRound(s0, s1, m3, 15);
+
+    s0 = _mm_add_epi32(s0, so0);
+    s1 = _mm_add_epi32(s1, so1);
+    Unshuffle(s0, s1);
+    _mm_storeu_si128((__m128i*)s, s0);
+    _mm_storeu_si128((__m128i*)(s + 4), s1);
+}
+
+} // namespace sha256_shani
+
+#endif // ENABLE_SHANI
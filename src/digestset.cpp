@@ -0,0 +1,105 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Copyright (c) 2009-2014 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "digestset.h"
+
+#include "random.h"
+
+#include <string.h>
+
+CDigestSet::CDigestSet(size_t nMaxEntries) : nHits(0), nMisses(0), nEntries(0)
+{
+    uint32_t nBuckets = 1;
+    while (nBuckets < 0x1000000 && (size_t)nBuckets * nBucketSize < nMaxEntries)
+        nBuckets <<= 1;
+    if (nMaxEntries > 0)
+        vTable.resize((size_t)nBuckets * nBucketSize * nWords, 0);
+    nBucketMask = nBuckets - 1;
+
+    // A whole block of salt, the copies start with it already hashed
+    unsigned char salt[64];
+    GetRandBytes(salt, sizeof(salt));
+    hasherSalted.Write(salt, sizeof(salt));
+}
+
+void CDigestSet::Finalize(CSHA256& hasher, uint32_t* digest) const
+{
+    unsigned char buf[CSHA256::OUTPUT_SIZE];
+    hasher.Finalize(buf);
+    memcpy(digest, buf, sizeof(buf));
+
+    // All zero marks an unused entry
+    if ((digest[0] | digest[1] | digest[2] | digest[3] | digest[4] | digest[5] | digest[6] | digest[7]) == 0)
+        digest[0] = 1;
+}
+
+bool CDigestSet::Find(const uint32_t* digest) const
+{
+    if (vTable.empty())
+        return false;
+
+    uint32_t nBuckets[2] = {digest[0] & nBucketMask, digest[1] & nBucketMask};
+    for (int b = 0; b < 2; b++) {
+        for (int i = 0; i < nBucketSize; i++) {
+            const uint32_t* entry = Entry(nBuckets[b], i);
+            int j = 0;
+            while (j < nWords && __atomic_load_n(&entry[j], __ATOMIC_RELAXED) == digest[j])
+                j++;
+            if (j == nWords)
+                return true;
+        }
+    }
+    return false;
+}
+
+bool CDigestSet::Contains(CSHA256 hasher)
+{
+    uint32_t digest[nWords];
+    Finalize(hasher, digest);
+    bool fFound = Find(digest);
+    __atomic_fetch_add(fFound ? &nHits : &nMisses, 1, __ATOMIC_RELAXED);
+    return fFound;
+}
+
+void CDigestSet::Insert(CSHA256 hasher)
+{
+    uint32_t digest[nWords];
+    Finalize(hasher, digest);
+
+    boost::unique_lock<boost::mutex> lock(mutexInsert);
+    if (vTable.empty() || Find(digest))
+        return;
+
+    // An unused entry of either bucket, or else a random one
+    uint32_t nBuckets[2] = {digest[0] & nBucketMask, digest[1] & nBucketMask};
+    uint32_t* entry = NULL;
+    for (int b = 0; b < 2 && !entry; b++) {
+        for (int i = 0; i < nBucketSize && !entry; i++) {
+            uint32_t* candidate = Entry(nBuckets[b], i);
+            uint32_t nBits = 0;
+            for (int j = 0; j < nWords; j++)
+                nBits |= candidate[j];
+            if (nBits == 0)
+                entry = candidate;
+        }
+    }
+    if (entry)
+        __atomic_fetch_add(&nEntries, 1, __ATOMIC_RELAXED);
+    else {
+        int nSlot = insecure_rand() % (2 * nBucketSize);
+        entry = Entry(nBuckets[nSlot / nBucketSize], nSlot % nBucketSize);
+    }
+
+    for (int j = 0; j < nWords; j++)
+        __atomic_store_n(&entry[j], digest[j], __ATOMIC_RELAXED);
+}
+
+void CDigestSet::GetStats(uint64_t& nHitsOut, uint64_t& nMissesOut, uint64_t& nEntriesOut, uint64_t& nMaxEntriesOut) const
+{
+    nHitsOut = __atomic_load_n(&nHits, __ATOMIC_RELAXED);
+    nMissesOut = __atomic_load_n(&nMisses, __ATOMIC_RELAXED);
+    nEntriesOut = __atomic_load_n(&nEntries, __ATOMIC_RELAXED);
+    nMaxEntriesOut = vTable.size() / nWords;
+}
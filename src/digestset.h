@@ -0,0 +1,69 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Copyright (c) 2009-2014 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_DIGESTSET_H
+#define BITCOIN_DIGESTSET_H
+
+#include "crypto/sha2.h"
+
+#include <stdint.h>
+#include <vector>
+
+#include <boost/thread/mutex.hpp>
+
+/**
+ * A set of entries by their salted SHA-256, for caches of expensive checks.
+ *
+ * A fixed size table of 32-byte digests, in buckets of four entries. Each
+ * digest may live in one of two buckets, and when both are full a random
+ * entry of them is replaced, which foils attackers trying to push out a set
+ * of entries just larger than the table.
+ *
+ * Lookups take no lock and compare the table word by word. A lookup racing
+ * an insert may read a mix of the old and the new digest of an entry, which
+ * matches a digest that is neither when it shares some words with one and
+ * the rest with the other, 7 of its 8 words with one and the last word with
+ * the other for instance. Such a false match takes all 256 bits of the mix,
+ * at least 128 of them from one salted digest that cannot be predicted
+ * without the secret salt: as unlikely as a SHA-256 collision. Inserts are
+ * serialized by a mutex.
+ */
+class CDigestSet
+{
+private:
+    static const int nBucketSize = 4;
+    static const int nWords = 8;
+
+    //! nBuckets * nBucketSize digests, all zero when unused
+    std::vector<uint32_t> vTable;
+    uint32_t nBucketMask;
+    //! Hasher with the salt written, copied for every digest
+    CSHA256 hasherSalted;
+    boost::mutex mutexInsert;
+
+    uint64_t nHits;
+    uint64_t nMisses;
+    uint64_t nEntries;
+
+    void Finalize(CSHA256& hasher, uint32_t* digest) const;
+    bool Find(const uint32_t* digest) const;
+    uint32_t* Entry(uint32_t nBucket, int nSlot) { return &vTable[((size_t)nBucket * nBucketSize + nSlot) * nWords]; }
+    const uint32_t* Entry(uint32_t nBucket, int nSlot) const { return &vTable[((size_t)nBucket * nBucketSize + nSlot) * nWords]; }
+
+public:
+    /** A set of at least nMaxEntries entries, rounded up to a power of two. 0 disables it. */
+    CDigestSet(size_t nMaxEntries);
+
+    /** A hasher with the salt written, to write an entry to for Contains or Insert. */
+    CSHA256 Hasher() const { return hasherSalted; }
+
+    bool Contains(CSHA256 hasher);
+    void Insert(CSHA256 hasher);
+
+    /** Lookups that found an entry or not, the number of stored entries and the table size. */
+    void GetStats(uint64_t& nHitsOut, uint64_t& nMissesOut, uint64_t& nEntriesOut, uint64_t& nMaxEntriesOut) const;
+};
+
+#endif // BITCOIN_DIGESTSET_H
@@ -0,0 +1,282 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_FLATMAP_H
+#define BITCOIN_FLATMAP_H
+
+#include "memusage.h"
+
+#include <assert.h>
+#include <stddef.h>
+
+#include <new>
+#include <utility>
+#include <vector>
+
+/** STL-like unordered map with open addressing and linear probing.
+ *
+ *  The table is one flat array of (hash, pointer) slots, so a lookup
+ *  touches a single cache line until the key compare. Elements live in
+ *  chunks of a node pool that is only returned to the heap by clear(), and
+ *  never move: references stay valid until the element is erased, even
+ *  while the table grows. Iterators are invalidated by insertions, but
+ *  erase() accepts an iterator taken before one, and erasing never
+ *  invalidates iterators to other elements, so a map can be drained while
+ *  walking it. Not thread safe, callers hold their own lock. */
+template <typename K, typename V, typename H>
+class flatmap
+{
+public:
+    typedef K key_type;
+    typedef V mapped_type;
+    typedef std::pair<const K, V> value_type;
+    typedef size_t size_type;
+
+private:
+    struct slot {
+        size_t hash;
+        //! NULL when the slot is free; hash is then 0 if it was never used
+        value_type* p;
+        slot() : hash(0), p(NULL) {}
+    };
+
+    //! Nodes per pool chunk, doubling from the first to the last
+    static const size_t nFirstChunk = 16;
+    static const size_t nLastChunk = 4096;
+
+    std::vector<slot> vSlots;
+    size_type nSize;
+    size_type nDeleted;
+    H hasher;
+
+    std::vector<void*> vChunks;
+    size_t nChunkUsage;
+    //! Unused nodes at the end of the last chunk
+    char* pChunkNext;
+    char* pChunkEnd;
+    //! Released nodes, each one holding a pointer to the next
+    void* pFree;
+
+    static size_t NodeSize()
+    {
+        return sizeof(value_type) > sizeof(void*) ? sizeof(value_type) : sizeof(void*);
+    }
+
+    value_type* Allocate(const value_type& v)
+    {
+        void* pNode;
+        if (pFree) {
+            pNode = pFree;
+            pFree = *(void**)pFree;
+        } else {
+            if (pChunkNext == pChunkEnd) {
+                size_t nNodes = nLastChunk;
+                if (vChunks.size() < 8)
+                    nNodes = nFirstChunk << vChunks.size();
+                pChunkNext = (char*)::operator new(nNodes * NodeSize());
+                pChunkEnd = pChunkNext + nNodes * NodeSize();
+                vChunks.push_back(pChunkNext);
+                nChunkUsage += memusage::MallocUsage(nNodes * NodeSize());
+            }
+            pNode = pChunkNext;
+            pChunkNext += NodeSize();
+        }
+        try {
+            return new (pNode) value_type(v);
+        } catch (...) {
+            Release(pNode);
+            throw;
+        }
+    }
+
+    void Release(void* pNode)
+    {
+        *(void**)pNode = pFree;
+        pFree = pNode;
+    }
+
+    void Destroy(value_type* p)
+    {
+        p->~value_type();
+        Release(p);
+    }
+
+    //! Position of key in the table, or the table size if it is missing
+    size_t Lookup(const key_type& k, size_t hash) const
+    {
+        if (vSlots.empty())
+            return 0;
+        size_t nMask = vSlots.size() - 1;
+        for (size_t pos = hash & nMask; ; pos = (pos + 1) & nMask) {
+            const slot& s = vSlots[pos];
+            if (s.p == NULL && s.hash == 0)
+                return vSlots.size();
+            if (s.p != NULL && s.hash == hash && s.p->first == k)
+                return pos;
+        }
+    }
+
+    //! Rebuild the table at a size that keeps it at most half full
+    void Rehash(size_type nElements)
+    {
+        size_t nCapacity = nFirstChunk;
+        while (nElements * 2 > nCapacity)
+            nCapacity *= 2;
+        std::vector<slot> vOld(nCapacity);
+        vOld.swap(vSlots);
+        size_t nMask = nCapacity - 1;
+        for (size_t i = 0; i < vOld.size(); i++) {
+            if (vOld[i].p == NULL)
+                continue;
+            size_t pos = vOld[i].hash & nMask;
+            while (vSlots[pos].p != NULL)
+                pos = (pos + 1) & nMask;
+            vSlots[pos] = vOld[i];
+        }
+        nDeleted = 0;
+    }
+
+    flatmap(const flatmap&);
+    flatmap& operator=(const flatmap&);
+
+public:
+    template <typename T>
+    class iterator_base
+    {
+    private:
+        template <typename U> friend class iterator_base;
+        friend class flatmap;
+
+        const flatmap* map;
+        size_t pos;
+        T* p;
+
+        iterator_base(const flatmap* mapIn, size_t posIn) : map(mapIn), pos(posIn), p(NULL)
+        {
+            while (pos < map->vSlots.size() && map->vSlots[pos].p == NULL)
+                pos++;
+            if (pos < map->vSlots.size())
+                p = map->vSlots[pos].p;
+        }
+
+    public:
+        iterator_base() : map(NULL), pos(0), p(NULL) {}
+        template <typename U>
+        iterator_base(const iterator_base<U>& it) : map(it.map), pos(it.pos), p(it.p) {}
+
+        T& operator*() const { return *p; }
+        T* operator->() const { return p; }
+        iterator_base& operator++()
+        {
+            *this = iterator_base(map, pos + 1);
+            return *this;
+        }
+        iterator_base operator++(int)
+        {
+            iterator_base ret = *this;
+            ++*this;
+            return ret;
+        }
+        bool operator==(const iterator_base& it) const { return p == it.p; }
+        bool operator!=(const iterator_base& it) const { return p != it.p; }
+    };
+    typedef iterator_base<value_type> iterator;
+    typedef iterator_base<const value_type> const_iterator;
+
+    flatmap() : nSize(0), nDeleted(0), nChunkUsage(0), pChunkNext(NULL), pChunkEnd(NULL), pFree(NULL) {}
+    ~flatmap() { clear(); }
+
+    size_type size() const { return nSize; }
+    bool empty() const { return nSize == 0; }
+
+    iterator begin() { return iterator(this, 0); }
+    iterator end() { return iterator(); }
+    const_iterator begin() const { return const_iterator(this, 0); }
+    const_iterator end() const { return const_iterator(); }
+
+    iterator find(const key_type& k)
+    {
+        size_t pos = Lookup(k, hasher(k));
+        return pos < vSlots.size() ? iterator(this, pos) : end();
+    }
+    const_iterator find(const key_type& k) const
+    {
+        size_t pos = Lookup(k, hasher(k));
+        return pos < vSlots.size() ? const_iterator(this, pos) : end();
+    }
+    size_type count(const key_type& k) const { return Lookup(k, hasher(k)) < vSlots.size(); }
+
+    std::pair<iterator, bool> insert(const value_type& v)
+    {
+        size_t hash = hasher(v.first);
+        size_t pos = Lookup(v.first, hash);
+        if (pos < vSlots.size())
+            return std::make_pair(iterator(this, pos), false);
+        if ((nSize + nDeleted + 1) * 4 > vSlots.size() * 3)
+            Rehash(nSize + 1);
+        size_t nMask = vSlots.size() - 1;
+        for (pos = hash & nMask; vSlots[pos].p != NULL; pos = (pos + 1) & nMask);
+        if (vSlots[pos].hash != 0)
+            nDeleted--;
+        vSlots[pos].p = Allocate(v);
+        vSlots[pos].hash = hash;
+        nSize++;
+        return std::make_pair(iterator(this, pos), true);
+    }
+
+    mapped_type& operator[](const key_type& k)
+    {
+        return insert(value_type(k, mapped_type())).first->second;
+    }
+
+    void erase(iterator it)
+    {
+        size_t pos = it.pos;
+        if (pos >= vSlots.size() || vSlots[pos].p != it.p) {
+            // The table was rebuilt since the iterator was taken
+            pos = Lookup(it->first, hasher(it->first));
+            assert(pos < vSlots.size());
+        }
+        Destroy(vSlots[pos].p);
+        vSlots[pos].p = NULL;
+        vSlots[pos].hash = 1;
+        nSize--;
+        nDeleted++;
+    }
+
+    size_type erase(const key_type& k)
+    {
+        iterator it = find(k);
+        if (it == end())
+            return 0;
+        erase(it);
+        return 1;
+    }
+
+    /** Destroy all elements and give the table and node pool back to the heap. */
+    void clear()
+    {
+        for (size_t i = 0; i < vSlots.size(); i++)
+            if (vSlots[i].p != NULL)
+                vSlots[i].p->~value_type();
+        std::vector<slot>().swap(vSlots);
+        for (size_t i = 0; i < vChunks.size(); i++)
+            ::operator delete(vChunks[i]);
+        std::vector<void*>().swap(vChunks);
+        nSize = 0;
+        nDeleted = 0;
+        nChunkUsage = 0;
+        pChunkNext = pChunkEnd = NULL;
+        pFree = NULL;
+    }
+
+    /** Heap memory held by the table and the node pool, not counting what
+     *  the elements themselves own. */
+    size_t DynamicMemoryUsage() const
+    {
+        return memusage::MallocUsage(vSlots.capacity() * sizeof(slot)) + memusage::MallocUsage(vChunks.capacity() * sizeof(void*)) + nChunkUsage;
+    }
+};
+
+#endif // BITCOIN_FLATMAP_H
@@ -10,13 +10,17 @@
 #include "init.h"
 
 #include "addrman.h"
+#include "blockfilereader.h"
 #include "checkpoints.h"
 #include "compat/sanity.h"
+#include "crypto/sha2.h"
 #include "key.h"
 #include "main.h"
 #include "miner.h"
 #include "net.h"
+#include "receiverschedule.h"
 #include "rpcserver.h"
+#include "script/sigcache.h"
 #include "txdb.h"
 #include "ui_interface.h"
 #include "util.h"
@@ -110,7 +114,6 @@ bool ShutdownRequested()
     return fRequestShutdown;
 }
 
-static CCoinsViewDB *pcoinsdbview = NULL;
 
 void Shutdown()
 {
@@ -157,6 +160,8 @@ void Shutdown()
             pblocktree->Flush();
         if (pcoinsTip)
             pcoinsTip->Flush();
+        if (pcoinsdbview)
+            pcoinsdbview->StopFlusher();
         delete pcoinsTip;
         pcoinsTip = NULL;
         delete pcoinsdbview;
@@ -222,6 +227,8 @@ std::string HelpMessage(HelpMessageMode mode)
     string strUsage = _("Options:") + "\n";
     strUsage += "  -?                     " + _("This help message") + "\n";
     strUsage += "  -alertnotify=<cmd>     " + _("Execute command when a relevant alert is received or we see a really long fork (%s in cmd is replaced by message)") + "\n";
+    strUsage += "  -auxblocknotify=<cmd>  " + _("Execute command when the best block changes and new getauxblock work is ready (%s in cmd is replaced by the block hash to merge mine, %t by its target)") + "\n";
+    strUsage += "  -auxpowcache=<n>       " + strprintf(_("Keep the auxpow of <n> recent merged mined headers in memory for serving headers (default: %u, 0 = off)"), nDefaultAuxPowCache) + "\n";
     strUsage += "  -blocknotify=<cmd>     " + _("Execute command when the best block changes (%s in cmd is replaced by block hash)") + "\n";
     strUsage += "  -checkblocks=<n>       " + strprintf(_("How many blocks to check at startup (default: %u, 0 = all)"), 288) + "\n";
     strUsage += "  -checklevel=<n>        " + strprintf(_("How thorough the block verification of -checkblocks is (0-4, default: %u)"), 3) + "\n";
@@ -234,7 +241,14 @@ std::string HelpMessage(HelpMessageMode mode)
     }
     strUsage += "  -datadir=<dir>         " + _("Specify data directory") + "\n";
     strUsage += "  -dbcache=<n>           " + strprintf(_("Set database cache size in megabytes (%d to %d, default: %d)"), nMinDbCache, nMaxDbCache, nDefaultDbCache) + "\n";
+    strUsage += "  -<db>.<option>=<n>     " + _("Tune the chainstate or blockindex database, also accepted in a [chainstate] or [blockindex] section of the configuration file:") + "\n";
+    strUsage += "    .maxopenfiles=<n>    " + strprintf(_("Keep at most <n> table files open (default: %u)"), 64) + "\n";
+    strUsage += "    .blockcachepercent=<n> " + strprintf(_("Share of its -dbcache to use for the block cache, the rest buffers writes (10 to 90, default: %u)"), 50) + "\n";
+    strUsage += "    .blocksize=<n>       " + strprintf(_("Size of the table blocks in KiB (1 to 1024, default: %u)"), 4) + "\n";
+    strUsage += "    .compression         " + strprintf(_("Compress tables with Snappy if built with --with-snappy (default: %u)"), 0) + "\n";
+    strUsage += "    .verifychecksums     " + strprintf(_("Verify the checksum of every block read (default: %u)"), 1) + "\n";
     strUsage += "  -loadblock=<file>      " + _("Imports blocks from external blk000??.dat file") + " " + _("on startup") + "\n";
+    strUsage += "  -mapblockfiles=<n>     " + strprintf(_("Keep up to <n> block files memory mapped to read blocks from (default: %u, 0 = read them with stdio)"), DEFAULT_MAPPED_BLOCK_FILES) + "\n";
     strUsage += "  -maxorphanblocks=<n>   " + strprintf(_("Keep at most <n> unconnectable blocks in memory (default: %u)"), DEFAULT_MAX_ORPHAN_BLOCKS) + "\n";
     strUsage += "  -maxorphantx=<n>       " + strprintf(_("Keep at most <n> unconnectable transactions in memory (default: %u)"), DEFAULT_MAX_ORPHAN_TRANSACTIONS) + "\n";
     strUsage += "  -par=<n>               " + strprintf(_("Set the number of script verification threads (%u to %d, 0 = auto, <0 = leave that many cores free, default: %d)"), -(int)boost::thread::hardware_concurrency(), MAX_SCRIPTCHECK_THREADS, DEFAULT_SCRIPTCHECK_THREADS) + "\n";
@@ -262,6 +276,7 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += "  -maxconnections=<n>    " + strprintf(_("Maintain at most <n> connections to peers (default: %u)"), 125) + "\n";
     strUsage += "  -maxreceivebuffer=<n>  " + strprintf(_("Maximum per-connection receive buffer, <n>*1000 bytes (default: %u)"), 5000) + "\n";
     strUsage += "  -maxsendbuffer=<n>     " + strprintf(_("Maximum per-connection send buffer, <n>*1000 bytes (default: %u)"), 1000) + "\n";
+    strUsage += "  -msgthreads=<n>        " + strprintf(_("Number of threads processing peer messages (1 to %d, default: %d)"), MAX_MSGPROC_THREADS, DEFAULT_MSGPROC_THREADS) + "\n";
     strUsage += "  -onion=<ip:port>       " + strprintf(_("Use separate SOCKS5 proxy to reach peers via Tor hidden services (default: %s)"), "-proxy") + "\n";
     strUsage += "  -onlynet=<net>         " + _("Only connect to nodes in network <net> (ipv4, ipv6 or onion)") + "\n";
     strUsage += "  -permitbaremultisig    " + strprintf(_("Relay non-P2SH multisig (default: %u)"), 1) + "\n";
@@ -327,7 +342,7 @@ std::string HelpMessage(HelpMessageMode mode)
     if (GetBoolArg("-help-debug", false))
     {
         strUsage += "  -limitfreerelay=<n>    " + strprintf(_("Continuously rate-limit free transactions to <n>*1000 bytes per minute (default:%u)"), 15) + "\n";
-        strUsage += "  -maxsigcachesize=<n>   " + strprintf(_("Limit size of signature cache to <n> entries (default: %u)"), 50000) + "\n";
+        strUsage += "  -maxsigcachesize=<n>   " + strprintf(_("Limit size of signature cache to <n> entries (default: %u)"), DEFAULT_MAX_SIG_CACHE_SIZE) + "\n";
     }
     strUsage += "  -minrelaytxfee=<amt>   " + strprintf(_("Fees (in BTC/Kb) smaller than this are considered zero fee for relaying (default: %s)"), FormatMoney(::minRelayTxFee.GetFeePerK())) + "\n";
     strUsage += "  -printtoconsole        " + _("Send trace/debug info to console instead of debug.log file") + "\n";
@@ -597,9 +612,13 @@ bool AppInit2(boost::thread_group& threadGroup)
     }
 
     // Make sure enough file descriptors are available
-    int nBind = std::max((int)mapArgs.count("-bind") + (int)mapArgs.count("-whitebind"), 1);
     nMaxConnections = GetArg("-maxconnections", 125);
-    nMaxConnections = std::max(std::min(nMaxConnections, (int)(FD_SETSIZE - nBind - MIN_CORE_FILEDESCRIPTORS)), 0);
+#ifndef HAVE_SYS_EPOLL_H
+    int nBind = std::max((int)mapArgs.count("-bind") + (int)mapArgs.count("-whitebind"), 1);
+    // select() cannot watch more sockets than that
+    nMaxConnections = std::min(nMaxConnections, (int)(FD_SETSIZE - nBind - MIN_CORE_FILEDESCRIPTORS));
+#endif
+    nMaxConnections = std::max(nMaxConnections, 0);
     int nFD = RaiseFileDescriptorLimit(nMaxConnections + MIN_CORE_FILEDESCRIPTORS);
     if (nFD < MIN_CORE_FILEDESCRIPTORS)
         return InitError(_("Not enough file descriptors available."));
@@ -731,6 +750,7 @@ bool AppInit2(boost::thread_group& threadGroup)
     LogPrintf("\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n");
     LogPrintf("Bitcoin version %s (%s)\n", FormatFullVersion(), CLIENT_DATE);
     LogPrintf("Using OpenSSL version %s\n", SSLeay_version(SSLEAY_VERSION));
+    LogPrintf("Using the '%s' SHA256 implementation\n", SHA256AutoDetect());
 #ifdef ENABLE_WALLET
     LogPrintf("Using BerkeleyDB version %s\n", DbEnv::version(0, 0, 0));
 #endif
@@ -746,6 +766,10 @@ bool AppInit2(boost::thread_group& threadGroup)
         LogPrintf("Using %u threads for script verification\n", nScriptCheckThreads);
         for (int i=0; i<nScriptCheckThreads-1; i++)
             threadGroup.create_thread(&ThreadScriptCheck);
+        for (int i=0; i<nScriptCheckThreads-1; i++)
+            threadGroup.create_thread(&ThreadHeaderCheck);
+        for (int i=0; i<nScriptCheckThreads-1; i++)
+            threadGroup.create_thread(&ThreadCoinsRead);
     }
 
     int64_t nStart;
@@ -944,7 +968,13 @@ bool AppInit2(boost::thread_group& threadGroup)
     nTotalCache -= nBlockTreeDBCache;
     size_t nCoinDBCache = nTotalCache / 2; // use half of the remaining cache for coindb cache
     nTotalCache -= nCoinDBCache;
-    nCoinCacheSize = nTotalCache / 300; // coins in memory require around 300 bytes
+    nCoinCacheUsage = nTotalCache; // the rest is the budget of the in-memory coin cache, in bytes
+
+    // Block files are up to 128 MiB each, a 32-bit address space only fits a few
+    unsigned int nMappedBlockFiles = std::max(0, (int)GetArg("-mapblockfiles", DEFAULT_MAPPED_BLOCK_FILES));
+    if (sizeof(void*) == 4)
+        nMappedBlockFiles = std::min(nMappedBlockFiles, 4U);
+    blockFileReader.SetMaxFiles(nMappedBlockFiles);
 
     bool fLoaded = false;
     while (!fLoaded) {
@@ -962,7 +992,9 @@ bool AppInit2(boost::thread_group& threadGroup)
                 delete pblocktree;
 
                 pblocktree = new CBlockTreeDB(nBlockTreeDBCache, false, fReindex);
+                pblocktree->SetAuxPowCacheSize(std::max(0, (int)GetArg("-auxpowcache", nDefaultAuxPowCache)));
                 pcoinsdbview = new CCoinsViewDB(nCoinDBCache, false, fReindex);
+                pcoinsdbview->StartFlusher(nScriptCheckThreads);
                 pcoinsTip = new CCoinsViewCache(pcoinsdbview);
 
                 if (fReindex)
@@ -1211,6 +1243,19 @@ bool AppInit2(boost::thread_group& threadGroup)
     if (mapArgs.count("-blocknotify"))
         uiInterface.NotifyBlockTip.connect(BlockNotifyCallback);
 
+    // Validation only reads receiver files already on disk, make sure the ones
+    // needed to connect the stored blocks are there before doing so.
+    {
+        int nReceiverHeight;
+        {
+            LOCK(cs_main);
+            nReceiverHeight = std::max(chainActive.Height() + 1, pindexBestHeader ? pindexBestHeader->nHeight : 0);
+        }
+        uiInterface.InitMessage(_("Loading receiver files..."));
+        receiverSchedule.Prefetch(nReceiverHeight);
+    }
+    threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "receiver", &ThreadReceiverPrefetch));
+
     // scan for better chains in the block chain database, that are not yet connected in the active best chain
     CValidationState state;
     if (!ActivateBestChain(state))
@@ -2,10 +2,16 @@
 // Distributed under the MIT/X11 software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#if defined(HAVE_CONFIG_H)
+#include "config/bitcoin-config.h"
+#endif
+
 #include "leveldbwrapper.h"
 
 #include "util.h"
 
+#include <algorithm>
+
 #include <boost/filesystem.hpp>
 #include <leveldb/cache.h>
 #include <leveldb/env.h>
@@ -26,14 +32,38 @@ void HandleError(const leveldb::Status& status) throw(leveldb_error)
     throw leveldb_error("Unknown database error");
 }
 
-static leveldb::Options GetOptions(size_t nCacheSize)
+CLevelDBProfile::CLevelDBProfile(const std::string& strNameIn) : strName(strNameIn), nMaxOpenFiles(64), nBlockCachePercent(50), nBlockSize(4096), fCompression(false), fVerifyChecksums(true)
+{
+}
+
+CLevelDBProfile CLevelDBProfile::FromArgs(const std::string& strName)
+{
+    CLevelDBProfile profile(strName);
+    std::string strPrefix = "-" + strName + ".";
+    profile.nMaxOpenFiles = std::max((int64_t)1, GetArg(strPrefix + "maxopenfiles", profile.nMaxOpenFiles));
+    profile.nBlockCachePercent = std::min((int64_t)90, std::max((int64_t)10, GetArg(strPrefix + "blockcachepercent", profile.nBlockCachePercent)));
+    profile.nBlockSize = std::min((int64_t)1024, std::max((int64_t)1, GetArg(strPrefix + "blocksize", profile.nBlockSize >> 10))) << 10;
+    profile.fCompression = GetBoolArg(strPrefix + "compression", profile.fCompression);
+    profile.fVerifyChecksums = GetBoolArg(strPrefix + "verifychecksums", profile.fVerifyChecksums);
+    return profile;
+}
+
+static leveldb::Options GetOptions(size_t nCacheSize, const CLevelDBProfile& profile)
 {
     leveldb::Options options;
-    options.block_cache = leveldb::NewLRUCache(nCacheSize / 2);
-    options.write_buffer_size = nCacheSize / 4; // up to two write buffers may be held in memory simultaneously
+    options.block_cache = leveldb::NewLRUCache(nCacheSize / 100 * profile.nBlockCachePercent);
+    options.write_buffer_size = nCacheSize / 200 * (100 - profile.nBlockCachePercent); // up to two write buffers may be held in memory simultaneously
+    options.block_size = profile.nBlockSize;
     options.filter_policy = leveldb::NewBloomFilterPolicy(10);
     options.compression = leveldb::kNoCompression;
-    options.max_open_files = 64;
+    if (profile.fCompression) {
+#ifdef USE_SNAPPY
+        options.compression = leveldb::kSnappyCompression;
+#else
+        LogPrintf("LevelDB was built without Snappy, not compressing %s\n", profile.strName);
+#endif
+    }
+    options.max_open_files = profile.nMaxOpenFiles;
     if (leveldb::kMajorVersion > 1 || (leveldb::kMajorVersion == 1 && leveldb::kMinorVersion >= 16)) {
         // LevelDB versions before 1.16 consider short writes to be corruption. Only trigger error
         // on corruption in later versions.
@@ -42,14 +72,14 @@ static leveldb::Options GetOptions(size_t nCacheSize)
     return options;
 }
 
-CLevelDBWrapper::CLevelDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory, bool fWipe)
+CLevelDBWrapper::CLevelDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory, bool fWipe, const CLevelDBProfile& profileIn) : profile(profileIn)
 {
     penv = NULL;
-    readoptions.verify_checksums = true;
+    readoptions.verify_checksums = profile.fVerifyChecksums;
     iteroptions.verify_checksums = true;
     iteroptions.fill_cache = false;
     syncoptions.sync = true;
-    options = GetOptions(nCacheSize);
+    options = GetOptions(nCacheSize, profile);
     options.create_if_missing = true;
     if (fMemory) {
         penv = leveldb::NewMemEnv(leveldb::Env::Default());
@@ -61,6 +91,10 @@ CLevelDBWrapper::CLevelDBWrapper(const boost::filesystem::path& path, size_t nCa
         }
         TryCreateDirectory(path);
         LogPrintf("Opening LevelDB in %s\n", path.string());
+        LogPrintf("Using the %s profile: %d open files, %.1fMiB block cache, %.1fMiB write buffer, %uKiB blocks, compression %s, read checksums %s\n",
+                  profile.strName.empty() ? "default" : profile.strName, profile.nMaxOpenFiles, nCacheSize / 100 * profile.nBlockCachePercent * (1.0 / (1 << 20)),
+                  options.write_buffer_size * (1.0 / (1 << 20)), (unsigned int)(profile.nBlockSize >> 10),
+                  options.compression == leveldb::kSnappyCompression ? "on" : "off", profile.fVerifyChecksums ? "on" : "off");
     }
     leveldb::Status status = leveldb::DB::Open(options, path.string(), &pdb);
     HandleError(status);
@@ -79,6 +113,21 @@ CLevelDBWrapper::~CLevelDBWrapper()
     options.env = NULL;
 }
 
+bool CLevelDBWrapper::GetProperty(const std::string& strProperty, std::string& strValue) const
+{
+    return pdb->GetProperty(strProperty, &strValue);
+}
+
+uint64_t CLevelDBWrapper::GetApproximateSize(char chPrefix) const
+{
+    std::string strStart(1, chPrefix);
+    std::string strLimit(1, (char)(chPrefix + 1));
+    leveldb::Range range(strStart, strLimit);
+    uint64_t nSize = 0;
+    pdb->GetApproximateSizes(&range, 1, &nSize);
+    return nSize;
+}
+
 bool CLevelDBWrapper::WriteBatch(CLevelDBBatch& batch, bool fSync) throw(leveldb_error)
 {
     leveldb::Status status = pdb->Write(fSync ? syncoptions : writeoptions, &batch.batch);
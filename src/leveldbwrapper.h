@@ -22,6 +22,28 @@ public:
 
 void HandleError(const leveldb::Status& status) throw(leveldb_error);
 
+/** Tunables of one LevelDB database. Each can be set with -<name>.<option>,
+ *  or as <option> in a [<name>] section of the configuration file. */
+struct CLevelDBProfile
+{
+    std::string strName;
+    // table files LevelDB keeps open (it raises anything below 74)
+    int nMaxOpenFiles;
+    // percentage of the cache used as block cache, the rest goes to the write buffers
+    int nBlockCachePercent;
+    // approximate size of the data blocks in the table files, in bytes
+    size_t nBlockSize;
+    // compress data blocks with Snappy, when LevelDB was built with it
+    bool fCompression;
+    // verify the checksums of the blocks read by lookups (iteration always does)
+    bool fVerifyChecksums;
+
+    CLevelDBProfile(const std::string& strNameIn = "");
+
+    // the profile of the named database, with its command line and configuration options applied
+    static CLevelDBProfile FromArgs(const std::string& strName);
+};
+
 // Batch of changes queued to be written to a CLevelDBWrapper
 class CLevelDBBatch
 {
@@ -30,6 +52,18 @@ class CLevelDBBatch
 private:
     leveldb::WriteBatch batch;
 
+    // Replays the updates of one batch into another
+    class Appender : public leveldb::WriteBatch::Handler
+    {
+    private:
+        leveldb::WriteBatch& batch;
+
+    public:
+        Appender(leveldb::WriteBatch& batchIn) : batch(batchIn) {}
+        void Put(const leveldb::Slice& key, const leveldb::Slice& value) { batch.Put(key, value); }
+        void Delete(const leveldb::Slice& key) { batch.Delete(key); }
+    };
+
 public:
     template <typename K, typename V>
     void Write(const K& key, const V& value)
@@ -57,6 +91,18 @@ public:
 
         batch.Delete(slKey);
     }
+
+    void Clear()
+    {
+        batch.Clear();
+    }
+
+    // Add the updates of another batch after the ones of this batch
+    void Append(const CLevelDBBatch& other)
+    {
+        Appender appender(batch);
+        other.batch.Iterate(&appender);
+    }
 };
 
 class CLevelDBWrapper
@@ -68,6 +114,9 @@ private:
     // database options used
     leveldb::Options options;
 
+    // tunables the database was opened with
+    CLevelDBProfile profile;
+
     // options used when reading from the database
     leveldb::ReadOptions readoptions;
 
@@ -84,7 +133,7 @@ private:
     leveldb::DB* pdb;
 
 public:
-    CLevelDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+    CLevelDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory = false, bool fWipe = false, const CLevelDBProfile& profileIn = CLevelDBProfile());
     ~CLevelDBWrapper();
 
     template <typename K, typename V>
@@ -104,7 +153,7 @@ public:
             HandleError(status);
         }
         try {
-            CDataStream ssValue(strValue.data(), strValue.data() + strValue.size(), SER_DISK, CLIENT_VERSION);
+            CSpanStream ssValue(strValue.data(), strValue.data() + strValue.size(), SER_DISK, CLIENT_VERSION);
             ssValue >> value;
         } catch (const std::exception&) {
             return false;
@@ -166,6 +215,17 @@ public:
     {
         return pdb->NewIterator(iteroptions);
     }
+
+    const CLevelDBProfile& GetProfile() const
+    {
+        return profile;
+    }
+
+    // read a LevelDB property such as "leveldb.stats", false if there is none by that name
+    bool GetProperty(const std::string& strProperty, std::string& strValue) const;
+
+    // approximate number of bytes on disk used by the keys that start with chPrefix
+    uint64_t GetApproximateSize(char chPrefix) const;
 };
 
 #endif // BITCOIN_LEVELDBWRAPPER_H
@@ -0,0 +1,88 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_LRUCACHE_H
+#define BITCOIN_LRUCACHE_H
+
+#include <list>
+#include <map>
+#include <utility>
+
+/** STL-like map container that only keeps the N most recently used elements.
+ *  Not thread safe, callers hold their own lock. */
+template <typename K, typename V>
+class lrucache
+{
+public:
+    typedef K key_type;
+    typedef V mapped_type;
+    typedef std::pair<K, V> value_type;
+    typedef typename std::list<value_type>::size_type size_type;
+
+protected:
+    typedef typename std::list<value_type>::iterator list_iterator;
+    //! Most recently used first
+    std::list<value_type> list;
+    std::map<K, list_iterator> map;
+    size_type nMaxSize;
+
+public:
+    lrucache(size_type nMaxSizeIn = 0) { nMaxSize = nMaxSizeIn; }
+    size_type size() const { return map.size(); }
+    bool empty() const { return map.empty(); }
+    size_type count(const key_type& k) const { return map.count(k); }
+    void clear()
+    {
+        map.clear();
+        list.clear();
+    }
+    /** Copy the value of k to v and mark it as most recently used. */
+    bool get(const key_type& k, mapped_type& v)
+    {
+        typename std::map<K, list_iterator>::iterator it = map.find(k);
+        if (it == map.end())
+            return false;
+        list.splice(list.begin(), list, it->second);
+        v = it->second->second;
+        return true;
+    }
+    /** Insert or replace the value of k, evicting the least recently used element when full. */
+    void insert(const key_type& k, const mapped_type& v)
+    {
+        if (nMaxSize == 0)
+            return;
+        typename std::map<K, list_iterator>::iterator it = map.find(k);
+        if (it != map.end()) {
+            it->second->second = v;
+            list.splice(list.begin(), list, it->second);
+            return;
+        }
+        if (map.size() == nMaxSize) {
+            map.erase(list.back().first);
+            list.pop_back();
+        }
+        list.push_front(std::make_pair(k, v));
+        map.insert(std::make_pair(k, list.begin()));
+    }
+    void erase(const key_type& k)
+    {
+        typename std::map<K, list_iterator>::iterator it = map.find(k);
+        if (it == map.end())
+            return;
+        list.erase(it->second);
+        map.erase(it);
+    }
+    size_type max_size() const { return nMaxSize; }
+    size_type max_size(size_type s)
+    {
+        while (map.size() > s) {
+            map.erase(list.back().first);
+            list.pop_back();
+        }
+        nMaxSize = s;
+        return nMaxSize;
+    }
+};
+
+#endif // BITCOIN_LRUCACHE_H
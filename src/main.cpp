@@ -7,12 +7,15 @@
 
 #include "addrman.h"
 #include "alert.h"
+#include "blockfilereader.h"
 #include "chainparams.h"
 #include "checkpoints.h"
 #include "checkqueue.h"
 #include "init.h"
+#include "lrucache.h"
 #include "net.h"
 #include "pow.h"
+#include "receiverschedule.h"
 #include "txdb.h"
 #include "txmempool.h"
 #include "ui_interface.h"
@@ -50,7 +53,7 @@ bool fImporting = false;
 bool fReindex = false;
 bool fTxIndex = false;
 bool fIsBareMultisigStd = true;
-unsigned int nCoinCacheSize = 5000;
+size_t nCoinCacheUsage = 5000 * 300;
 
 
 /** Fees smaller than this (in satoshi) are considered zero fee (for relaying and mining) */
@@ -128,6 +131,18 @@ namespace {
     };
     map<uint256, pair<NodeId, list<QueuedBlock>::iterator> > mapBlocksInFlight;
 
+    // Blocks served lately, unserialized and serialized for the network, so
+    // the peers asking for a new tip within seconds of each other are not
+    // each served from disk, only the first one.
+    struct CServedBlock {
+        boost::shared_ptr<const CBlock> block;
+        CNetPayloadRef payload;
+    };
+    CCriticalSection cs_servedBlocks;
+    lrucache<uint256, CServedBlock> servedBlocks(SERVED_BLOCK_CACHE_SIZE);
+    uint64_t nServedBlockHits = 0;
+    uint64_t nServedBlockMisses = 0;
+
 } // anon namespace
 
 //////////////////////////////////////////////////////////////////////////////
@@ -482,6 +497,7 @@ CBlockIndex* FindForkInGlobalIndex(const CChain& chain, const CBlockLocator& loc
     return chain.Genesis();
 }
 
+CCoinsViewDB *pcoinsdbview = NULL;
 CCoinsViewCache *pcoinsTip = NULL;
 CBlockTreeDB *pblocktree = NULL;
 
@@ -1132,14 +1148,14 @@ bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos)
 {
     block.SetNull();
 
-    // Open history file to read
-    CAutoFile filein(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
-    if (filein.IsNull())
-        return error("ReadBlockFromDisk : OpenBlockFile failed");
-
-    // Read block
     try {
-        filein >> block;
+        // Unserialize from the mapped block file, or else read it from disk
+        if (!blockFileReader.Read(pos, block)) {
+            CAutoFile filein(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
+            if (filein.IsNull())
+                return error("ReadBlockFromDisk : OpenBlockFile failed");
+            filein >> block;
+        }
     }
     catch (std::exception &e) {
         return error("%s : Deserialize or I/O error - %s", __func__, e.what());
@@ -1161,6 +1177,36 @@ bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex)
     return true;
 }
 
+static CServedBlock CacheServedBlock(const boost::shared_ptr<const CBlock>& pblock)
+{
+    CServedBlock served;
+    served.block = pblock;
+    served.payload = MakeNetPayload(*pblock);
+    LOCK(cs_servedBlocks);
+    servedBlocks.insert(pblock->GetHash(), served);
+    return served;
+}
+
+static bool GetServedBlock(const uint256& hash, CServedBlock& served)
+{
+    LOCK(cs_servedBlocks);
+    if (servedBlocks.get(hash, served)) {
+        nServedBlockHits++;
+        return true;
+    }
+    nServedBlockMisses++;
+    return false;
+}
+
+void GetServedBlockCacheStats(uint64_t& nHits, uint64_t& nMisses, unsigned int& nEntries, unsigned int& nMaxEntries)
+{
+    LOCK(cs_servedBlocks);
+    nHits = nServedBlockHits;
+    nMisses = nServedBlockMisses;
+    nEntries = servedBlocks.size();
+    nMaxEntries = servedBlocks.max_size();
+}
+
 CAmount GetBlockValue(int nHeight, const CAmount& nFees)
 {
     int64_t nSubsidy = initialSubsidy;
@@ -1267,6 +1313,9 @@ void Misbehaving(NodeId pnode, int howmuch)
     if (howmuch == 0)
         return;
 
+    // Message threads call this while processing messages that don't need
+    // cs_main otherwise
+    LOCK(cs_main);
     CNodeState *state = State(pnode);
     if (state == NULL)
         return;
@@ -1567,8 +1616,47 @@ void ThreadScriptCheck() {
     scriptcheckqueue.Thread();
 }
 
+static CCheckQueue<CHeaderPoWCheck> headercheckqueue(16);
+// One headers message at a time uses the header check queue
+static CCriticalSection cs_headercheckqueue;
+
+void ThreadHeaderCheck() {
+    RenameThread("bitcoin-headerch");
+    headercheckqueue.Thread();
+}
+
+static CCheckQueue<CCoinsReadCheck> coinsreadqueue(8);
+
+void ThreadCoinsRead() {
+    RenameThread("bitcoin-coinsrd");
+    coinsreadqueue.Thread();
+}
+
+// Warm pcoinsTip with everything ConnectBlock is going to look up: the
+// prevouts of the block and, for the BIP30 check, its own txids. What is not
+// cached yet is read from the coins database by the reader threads, rather
+// than one LevelDB read at a time in the serial pass.
+static unsigned int PrefetchBlockInputs(const CBlock& block)
+{
+    AssertLockHeld(cs_main);
+    std::set<uint256> setTxid;
+    BOOST_FOREACH(const CTransaction& tx, block.vtx) {
+        setTxid.insert(tx.GetHash());
+        if (tx.IsCoinBase())
+            continue;
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+            setTxid.insert(txin.prevout.hash);
+    }
+    std::vector<uint256> vTxid(setTxid.begin(), setTxid.end());
+    return pcoinsTip->Prefetch(vTxid, &coinsreadqueue);
+}
+
 static int64_t nTimeVerify = 0;
 static int64_t nTimeConnect = 0;
+static int64_t nTimeFetchInputs = 0;
+static int64_t nTimeQueueChecks = 0;
+static int64_t nTimeUpdateCoins = 0;
+static int64_t nTimeVerifyWait = 0;
 static int64_t nTimeIndex = 0;
 static int64_t nTimeCallbacks = 0;
 static int64_t nTimeTotal = 0;
@@ -1630,7 +1718,11 @@ bool ConnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, C
 
     CCheckQueueControl<CScriptCheck> control(fScriptChecks && nScriptCheckThreads ? &scriptcheckqueue : NULL);
 
+    // Script checks of each transaction are queued as soon as its inputs are
+    // known, so the check threads verify them while this thread goes on with
+    // the inputs of the next transactions.
     int64_t nTimeStart = GetTimeMicros();
+    int64_t nTimeBlockFetch = 0, nTimeBlockQueue = 0, nTimeBlockUpdate = 0;
     CAmount nFees = 0;
     int nInputs = 0;
     unsigned int nSigOps = 0;
@@ -1648,6 +1740,7 @@ bool ConnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, C
             return state.DoS(100, error("ConnectBlock() : too many sigops"),
                              REJECT_INVALID, "bad-blk-sigops");
 
+        int64_t nTimeTx = GetTimeMicros();
         if (!tx.IsCoinBase())
         {
             if (!view.HaveInputs(tx))
@@ -1666,11 +1759,14 @@ bool ConnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, C
             }
 
             nFees += view.GetValueIn(tx)-tx.GetValueOut();
+            int64_t nTimeTxInputs = GetTimeMicros(); nTimeBlockFetch += nTimeTxInputs - nTimeTx;
 
             std::vector<CScriptCheck> vChecks;
             if (!CheckInputs(tx, state, view, fScriptChecks, flags, false, nScriptCheckThreads ? &vChecks : NULL))
                 return false;
-            control.Add(vChecks);
+            if (!vChecks.empty())
+                control.Add(vChecks);
+            nTimeTx = GetTimeMicros(); nTimeBlockQueue += nTimeTx - nTimeTxInputs;
         }
 
         CTxUndo undoDummy;
@@ -1678,12 +1774,19 @@ bool ConnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, C
             blockundo.vtxundo.push_back(CTxUndo());
         }
         UpdateCoins(tx, state, view, i == 0 ? undoDummy : blockundo.vtxundo.back(), pindex->nHeight);
+        nTimeBlockUpdate += GetTimeMicros() - nTimeTx;
 
         vPos.push_back(std::make_pair(tx.GetHash(), pos));
         pos.nTxOffset += ::GetSerializeSize(tx, SER_DISK, CLIENT_VERSION);
     }
     int64_t nTime1 = GetTimeMicros(); nTimeConnect += nTime1 - nTimeStart;
     LogPrint("bench", "      - Connect %u transactions: %.2fms (%.3fms/tx, %.3fms/txin) [%.2fs]\n", (unsigned)block.vtx.size(), 0.001 * (nTime1 - nTimeStart), 0.001 * (nTime1 - nTimeStart) / block.vtx.size(), nInputs <= 1 ? 0 : 0.001 * (nTime1 - nTimeStart) / (nInputs-1), nTimeConnect * 0.000001);
+    nTimeFetchInputs += nTimeBlockFetch;
+    nTimeQueueChecks += nTimeBlockQueue;
+    nTimeUpdateCoins += nTimeBlockUpdate;
+    LogPrint("bench", "        - Fetch inputs: %.2fms [%.2fs]\n", 0.001 * nTimeBlockFetch, nTimeFetchInputs * 0.000001);
+    LogPrint("bench", "        - Check inputs and queue scripts: %.2fms [%.2fs]\n", 0.001 * nTimeBlockQueue, nTimeQueueChecks * 0.000001);
+    LogPrint("bench", "        - Update coins and undo: %.2fms [%.2fs]\n", 0.001 * nTimeBlockUpdate, nTimeUpdateCoins * 0.000001);
 
     if (block.vtx[0].GetValueOut() > GetBlockValue(pindex->nHeight, nFees))
         return state.DoS(100,
@@ -1695,31 +1798,17 @@ bool ConnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, C
     //
     if (block.vtx[0].GetValueOut() > (GetBlockValue(pindex->nHeight, nFees) - fallbackReduction))
     {
-     	std::vector<std::string> addressStrings;
-        std::vector<int64_t> amounts;
-
-        for (unsigned int i = 1; i < block.vtx[0].vout.size(); i++)
-        {
-			CTxDestination txaddress;
-			if (ExtractDestination(block.vtx[0].vout[i].scriptPubKey, txaddress))
-			{
-				
-				CBitcoinAddress addr(txaddress);
-				if (addr.IsValid())
-				{
-					addressStrings.push_back(addr.ToString());
-					amounts.push_back(block.vtx[0].vout[i].nValue);
-				}
-			}
-        }
-	if (!getIsSufficientAmount(addressStrings, amounts, GetDataDir().string(), receiverCSV, (int)pindex->nHeight, share, step))
+        if (!receiverSchedule.IsSufficientAmount(block.vtx[0], pindex->nHeight, share))
             return error("ConnectBlock() : Share to beneficiary is insufficient");
     }
 
 	// END DEVCOIN
+    int64_t nTimeWait = GetTimeMicros();
     if (!control.Wait())
         return state.DoS(100, false);
     int64_t nTime2 = GetTimeMicros(); nTimeVerify += nTime2 - nTimeStart;
+    nTimeVerifyWait += nTime2 - nTimeWait;
+    LogPrint("bench", "      - Wait for script checks: %.2fms [%.2fs]\n", 0.001 * (nTime2 - nTimeWait), nTimeVerifyWait * 0.000001);
     LogPrint("bench", "    - Verify %u txins: %.2fms (%.3fms/txin) [%.2fs]\n", nInputs - 1, 0.001 * (nTime2 - nTimeStart), nInputs <= 1 ? 0 : 0.001 * (nTime2 - nTimeStart) / (nInputs-1), nTimeVerify * 0.000001);
 
     if (fJustCheck)
@@ -1771,7 +1860,10 @@ bool ConnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, C
 // Update the on-disk chain state.
 bool static WriteChainState(CValidationState &state) {
     static int64_t nLastWrite = 0;
-    if (pcoinsTip->GetCacheSize() > nCoinCacheSize || (!IsInitialBlockDownload() && GetTimeMicros() > nLastWrite + 600*1000000)) {
+    // Entries still being committed by the coin database flusher count
+    // against the budget too
+    size_t nCoinsUsage = pcoinsTip->DynamicMemoryUsage() + pcoinsdbview->FlushingMemoryUsage();
+    if (nCoinsUsage > nCoinCacheUsage || (!IsInitialBlockDownload() && GetTimeMicros() > nLastWrite + 600*1000000)) {
         // Typical CCoins structures on disk are around 100 bytes in size.
         // Pushing a new one to the database can cause it to be written
         // twice (once in the log, and once in the tables). This is already
@@ -1796,10 +1888,10 @@ void static UpdateTip(CBlockIndex *pindexNew) {
     nTimeBestReceived = GetTime();
     mempool.AddTransactionsUpdated(1);
 
-    LogPrintf("UpdateTip: new best=%s  height=%d  log2_work=%.8g  tx=%lu  date=%s progress=%f  cache=%u\n",
+    LogPrintf("UpdateTip: new best=%s  height=%d  log2_work=%.8g  tx=%lu  date=%s progress=%f  cache=%.1fMiB(%utx)\n",
       chainActive.Tip()->GetBlockHash().ToString(), chainActive.Height(), log(chainActive.Tip()->nChainWork.getdouble())/log(2.0), (unsigned long)chainActive.Tip()->nChainTx,
       DateTimeStrFormat("%Y-%m-%d %H:%M:%S", chainActive.Tip()->GetBlockTime()),
-      Checkpoints::GuessVerificationProgress(chainActive.Tip()), (unsigned int)pcoinsTip->GetCacheSize());
+      Checkpoints::GuessVerificationProgress(chainActive.Tip()), pcoinsTip->DynamicMemoryUsage() * (1.0 / (1<<20)), (unsigned int)pcoinsTip->GetCacheSize());
 
     cvBlockChange.notify_all();
 
@@ -1871,6 +1963,7 @@ bool static DisconnectTip(CValidationState &state) {
 }
 
 static int64_t nTimeReadFromDisk = 0;
+static int64_t nTimePrefetch = 0;
 static int64_t nTimeConnectTotal = 0;
 static int64_t nTimeFlush = 0;
 static int64_t nTimeChainState = 0;
@@ -1893,6 +1986,12 @@ bool static ConnectTip(CValidationState &state, CBlockIndex *pindexNew, CBlock *
     int64_t nTime2 = GetTimeMicros(); nTimeReadFromDisk += nTime2 - nTime1;
     int64_t nTime3;
     LogPrint("bench", "  - Load block from disk: %.2fms [%.2fs]\n", (nTime2 - nTime1) * 0.001, nTimeReadFromDisk * 0.000001);
+    if (nScriptCheckThreads) {
+        unsigned int nRead = PrefetchBlockInputs(*pblock);
+        int64_t nTimePrefetched = GetTimeMicros(); nTimePrefetch += nTimePrefetched - nTime2;
+        LogPrint("bench", "  - Prefetch %u coins: %.2fms [%.2fs]\n", nRead, (nTimePrefetched - nTime2) * 0.001, nTimePrefetch * 0.000001);
+        nTime2 = nTimePrefetched;
+    }
     {
         CCoinsViewCache view(pcoinsTip);
         CInv inv(MSG_BLOCK, pindexNew->GetBlockHash());
@@ -2215,6 +2314,7 @@ bool FindBlockPos(CValidationState &state, CDiskBlockPos &pos, unsigned int nAdd
     }
 
     nLastBlockFile = nFile;
+    blockFileReader.SetWriteFile(nLastBlockFile);
     vinfoBlockFile[nFile].nSize += nAddSize;
     vinfoBlockFile[nFile].AddBlock(nHeight, nTime);
 
@@ -2540,10 +2640,10 @@ void CBlockIndex::BuildSkip()
         pskip = pprev->GetAncestor(GetSkipHeight(nHeight));
 }
 
-bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBlockPos *dbp)
+bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBlockPos *dbp, bool fChecked)
 {
-    // Preliminary checks
-    bool checked = CheckBlock(*pblock, state, INT_MAX);
+    // Preliminary checks, unless the caller ran them already
+    bool checked = fChecked || CheckBlock(*pblock, state, INT_MAX);
 
     {
         LOCK(cs_main);
@@ -2849,6 +2949,7 @@ bool static LoadBlockIndexDB()
 
     // Load block file info
     pblocktree->ReadLastBlockFile(nLastBlockFile);
+    blockFileReader.SetWriteFile(nLastBlockFile);
     vinfoBlockFile.resize(nLastBlockFile + 1);
     LogPrintf("%s: last block file = %i\n", __func__, nLastBlockFile);
     for (int nFile = 0; nFile <= nLastBlockFile; nFile++) {
@@ -2955,7 +3056,7 @@ bool CVerifyDB::VerifyDB(CCoinsView *coinsview, int nCheckLevel, int nCheckDepth
             }
         }
         // check level 3: check for inconsistencies during memory-only disconnect of tip blocks
-        if (nCheckLevel >= 3 && pindex == pindexState && (coins.GetCacheSize() + pcoinsTip->GetCacheSize()) <= nCoinCacheSize) {
+        if (nCheckLevel >= 3 && pindex == pindexState && (coins.DynamicMemoryUsage() + pcoinsTip->DynamicMemoryUsage()) <= nCoinCacheUsage) {
             bool fClean = true;
             if (!DisconnectBlock(block, state, pindex, coins, &fClean))
                 return error("VerifyDB() : *** irrecoverable inconsistency in block data at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
@@ -3114,20 +3215,150 @@ void PrintBlockTree()
     }
 }
 
-bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
+namespace {
+
+/** A block found in an external block file. The raw bytes are read by the
+ *  scanning thread, the block is unserialized and checked on the -par
+ *  threads, and connected in file order after that. */
+struct CExternalBlock
 {
-    // Map of disk positions for blocks with unknown parent (only used for reindex)
-    static std::multimap<uint256, CDiskBlockPos> mapBlocksUnknownParent;
-    int64_t nStart = GetTimeMillis();
+    std::vector<char> vchData;
+    CDiskBlockPos pos;
+    CBlock block;
+    uint256 hash;
+    bool fParsed;
+    //! Whether the context free CheckBlock passed
+    bool fChecked;
+    std::string strError;
+    //! Microseconds spent unserializing and checking it
+    int64_t nCheckTime;
+
+    CExternalBlock() : fParsed(false), fChecked(false), nCheckTime(0) {}
+};
 
-    int nLoaded = 0;
+typedef std::vector<CExternalBlock> CExternalBlockBatch;
+
+/** Unserialize one external block, hash it and run the checks that need no
+ *  context (merkle root, proof of work and auxpow). */
+class CExternalBlockCheck
+{
+private:
+    CExternalBlock *pblock;
+
+public:
+    CExternalBlockCheck() : pblock(NULL) {}
+    CExternalBlockCheck(CExternalBlock *pblockIn) : pblock(pblockIn) {}
+
+    bool operator()() {
+        int64_t nStart = GetTimeMicros();
+        try {
+            CSpanStream ss(&pblock->vchData[0], &pblock->vchData[0] + pblock->vchData.size(), SER_DISK, CLIENT_VERSION);
+            ss >> pblock->block;
+            pblock->fParsed = true;
+            pblock->hash = pblock->block.GetHash();
+            CValidationState state;
+            pblock->fChecked = CheckBlock(pblock->block, state, INT_MAX);
+        } catch (const std::exception &e) {
+            pblock->strError = e.what();
+        }
+        std::vector<char>().swap(pblock->vchData);
+        pblock->nCheckTime = GetTimeMicros() - nStart;
+        return true;
+    }
+
+    void swap(CExternalBlockCheck &check) {
+        std::swap(pblock, check.pblock);
+    }
+};
+
+/** Scans an external block file for blocks on its own thread, and hands
+ *  them over in batches. At most two batches wait to be picked up. */
+class CExternalBlockReader
+{
+private:
+    static const unsigned int nBatchBlocks = 128;
+    static const size_t nBatchBytes = 16 << 20;
+    static const size_t nMaxQueued = 2;
+
+    FILE *fileIn;
+    int nFile;
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    std::deque<boost::shared_ptr<CExternalBlockBatch> > queue;
+    bool fDone;
+    bool fStop;
+    std::string strError;
+    boost::thread thread;
+
+    bool Push(const boost::shared_ptr<CExternalBlockBatch> &batch) {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (queue.size() >= nMaxQueued && !fStop)
+            cond.wait(lock);
+        if (fStop)
+            return false;
+        queue.push_back(batch);
+        cond.notify_all();
+        return true;
+    }
+
+    void Thread();
+
+public:
+    //! Microseconds spent scanning, not counting waits for the other stages
+    int64_t nReadTime;
+    uint64_t nReadBytes;
+
+    CExternalBlockReader(FILE *fileInIn, const CDiskBlockPos *dbp) : fileIn(fileInIn), nFile(dbp ? dbp->nFile : -1), fDone(false), fStop(false), nReadTime(0), nReadBytes(0) {}
+
+    ~CExternalBlockReader() {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fStop = true;
+            cond.notify_all();
+        }
+        if (thread.joinable())
+            thread.join();
+        else if (fileIn)
+            fclose(fileIn);
+    }
+
+    void Start() {
+        thread = boost::thread(boost::bind(&CExternalBlockReader::Thread, this));
+    }
+
+    /** Next batch in file order, or NULL once the whole file is scanned. */
+    boost::shared_ptr<CExternalBlockBatch> Pop() {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (queue.empty() && !fDone)
+            cond.wait(lock);
+        boost::shared_ptr<CExternalBlockBatch> batch;
+        if (!queue.empty()) {
+            batch = queue.front();
+            queue.pop_front();
+            cond.notify_all();
+        }
+        return batch;
+    }
+
+    std::string GetError() {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        return strError;
+    }
+};
+
+void CExternalBlockReader::Thread()
+{
+    RenameThread("bitcoin-loadblk-read");
     try {
         // This takes over fileIn and calls fclose() on it in the CBufferedFile destructor
         CBufferedFile blkdat(fileIn, 2*MAX_BLOCK_SIZE, MAX_BLOCK_SIZE+8, SER_DISK, CLIENT_VERSION);
+        fileIn = NULL;
+        boost::shared_ptr<CExternalBlockBatch> batch(new CExternalBlockBatch());
+        batch->reserve(nBatchBlocks);
+        size_t nBytes = 0;
+        int64_t nStart = GetTimeMicros();
         uint64_t nRewind = blkdat.GetPos();
         while (!blkdat.eof()) {
-            boost::this_thread::interruption_point();
-
             blkdat.SetPos(nRewind);
             nRewind++; // start one byte further next time, in case of failure
             blkdat.SetLimit(); // remove former limit
@@ -3149,68 +3380,176 @@ bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
                 break;
             }
             try {
-                // read block
+                // read the raw block, it is unserialized on the check threads
                 uint64_t nBlockPos = blkdat.GetPos();
-                if (dbp)
-                    dbp->nPos = nBlockPos;
                 blkdat.SetLimit(nBlockPos + nSize);
-                blkdat.SetPos(nBlockPos);
-                CBlock block;
-                blkdat >> block;
+                CExternalBlock blk;
+                blk.pos = CDiskBlockPos(nFile, nBlockPos);
+                blk.vchData.resize(nSize);
+                blkdat.read(&blk.vchData[0], nSize);
                 nRewind = blkdat.GetPos();
+                batch->push_back(CExternalBlock());
+                batch->back().pos = blk.pos;
+                batch->back().vchData.swap(blk.vchData);
+                nBytes += nSize;
+                nReadBytes += nSize;
+            } catch (std::exception &e) {
+                LogPrintf("%s : I/O error - %s\n", __func__, e.what());
+                continue;
+            }
+            if (batch->size() == nBatchBlocks || nBytes >= nBatchBytes) {
+                nReadTime += GetTimeMicros() - nStart;
+                if (!Push(batch))
+                    return;
+                nStart = GetTimeMicros();
+                batch.reset(new CExternalBlockBatch());
+                batch->reserve(nBatchBlocks);
+                nBytes = 0;
+            }
+        }
+        nReadTime += GetTimeMicros() - nStart;
+        if (!batch->empty() && !Push(batch))
+            return;
+    } catch (const std::exception &e) {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        strError = e.what();
+    }
+    boost::unique_lock<boost::mutex> lock(mutex);
+    fDone = true;
+    cond.notify_all();
+}
 
-                // detect out of order blocks, and store them for later
-                uint256 hash = block.GetHash();
-                if (hash != Params().HashGenesisBlock() && mapBlockIndex.find(block.hashPrevBlock) == mapBlockIndex.end()) {
-                    LogPrint("reindex", "%s: Out of order block %s, parent %s not known\n", __func__, hash.ToString(),
-                            block.hashPrevBlock.ToString());
-                    if (dbp)
-                        mapBlocksUnknownParent.insert(std::make_pair(block.hashPrevBlock, *dbp));
-                    continue;
-                }
+} // anon namespace
 
-                // process in case the block isn't known yet
-                if (mapBlockIndex.count(hash) == 0) {
-                    CValidationState state;
-                    if (ProcessBlock(state, NULL, &block, dbp))
-                        nLoaded++;
-                    if (state.IsError())
-                        break;
-                }
+// Connect a checked batch of external blocks in file order. Returns false if
+// processing hit a node error and loading should stop.
+static bool ConnectExternalBlocks(CExternalBlockBatch &batch, bool fHavePos, std::multimap<uint256, CDiskBlockPos> &mapBlocksUnknownParent, int &nLoaded)
+{
+    for (unsigned int i = 0; i < batch.size(); i++) {
+        boost::this_thread::interruption_point();
+        CExternalBlock &blk = batch[i];
+        if (!blk.fParsed) {
+            LogPrintf("%s : Deserialize or I/O error - %s\n", __func__, blk.strError);
+            continue;
+        }
+        try {
+            CDiskBlockPos *dbp = fHavePos ? &blk.pos : NULL;
+            const uint256 &hash = blk.hash;
+
+            // detect out of order blocks, and store them for later
+            if (hash != Params().HashGenesisBlock() && mapBlockIndex.find(blk.block.hashPrevBlock) == mapBlockIndex.end()) {
+                LogPrint("reindex", "%s: Out of order block %s, parent %s not known\n", __func__, hash.ToString(),
+                        blk.block.hashPrevBlock.ToString());
+                if (dbp)
+                    mapBlocksUnknownParent.insert(std::make_pair(blk.block.hashPrevBlock, *dbp));
+                continue;
+            }
+
+            // process in case the block isn't known yet
+            if (mapBlockIndex.count(hash) == 0) {
+                CValidationState state;
+                if (!blk.fChecked)
+                    error("%s : CheckBlock FAILED for %s", __func__, hash.ToString());
+                else if (ProcessBlock(state, NULL, &blk.block, dbp, true))
+                    nLoaded++;
+                if (state.IsError())
+                    return false;
+            }
 
-                // Recursively process earlier encountered successors of this block
-                deque<uint256> queue;
-                queue.push_back(hash);
-                while (!queue.empty()) {
-                    uint256 head = queue.front();
-                    queue.pop_front();
-                    std::pair<std::multimap<uint256, CDiskBlockPos>::iterator, std::multimap<uint256, CDiskBlockPos>::iterator> range = mapBlocksUnknownParent.equal_range(head);
-                    while (range.first != range.second) {
-                        std::multimap<uint256, CDiskBlockPos>::iterator it = range.first;
-                        if (ReadBlockFromDisk(block, it->second))
+            // Recursively process earlier encountered successors of this block
+            deque<uint256> queue;
+            queue.push_back(hash);
+            while (!queue.empty()) {
+                uint256 head = queue.front();
+                queue.pop_front();
+                std::pair<std::multimap<uint256, CDiskBlockPos>::iterator, std::multimap<uint256, CDiskBlockPos>::iterator> range = mapBlocksUnknownParent.equal_range(head);
+                while (range.first != range.second) {
+                    std::multimap<uint256, CDiskBlockPos>::iterator it = range.first;
+                    CBlock block;
+                    if (ReadBlockFromDisk(block, it->second))
+                    {
+                        LogPrintf("%s: Processing out of order child %s of %s\n", __func__, block.GetHash().ToString(),
+                                head.ToString());
+                        CValidationState dummy;
+                        if (ProcessBlock(dummy, NULL, &block, &it->second))
                         {
-                            LogPrintf("%s: Processing out of order child %s of %s\n", __func__, block.GetHash().ToString(),
-                                    head.ToString());
-                            CValidationState dummy;
-                            if (ProcessBlock(dummy, NULL, &block, &it->second))
-                            {
-                                nLoaded++;
-                                queue.push_back(block.GetHash());
-                            }
+                            nLoaded++;
+                            queue.push_back(block.GetHash());
                         }
-                        range.first++;
-                        mapBlocksUnknownParent.erase(it);
                     }
+                    range.first++;
+                    mapBlocksUnknownParent.erase(it);
                 }
-            } catch (std::exception &e) {
-                LogPrintf("%s : Deserialize or I/O error - %s", __func__, e.what());
             }
+        } catch (std::exception &e) {
+            LogPrintf("%s : Deserialize or I/O error - %s\n", __func__, e.what());
+        }
+    }
+    return true;
+}
+
+bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
+{
+    // Map of disk positions for blocks with unknown parent (only used for reindex)
+    static std::multimap<uint256, CDiskBlockPos> mapBlocksUnknownParent;
+    int64_t nStart = GetTimeMillis();
+
+    // Blocks are scanned for on one thread, unserialized and checked on the
+    // -par threads, and connected in file order on this one. A batch is
+    // connected while the next one is being checked.
+    int nLoaded = 0;
+    unsigned int nBlocks = 0;
+    int64_t nCheckTime = 0, nConnectTime = 0, nWaitReadTime = 0, nWaitCheckTime = 0;
+    boost::shared_ptr<CExternalBlockBatch> batchChecked, batchNext;
+    CExternalBlockReader reader(fileIn, dbp);
+    CCheckQueue<CExternalBlockCheck> queue(1);
+    boost::thread_group threads;
+    CThreadGroupJoiner joiner(threads);
+    for (int i = 0; i < nScriptCheckThreads - 1; i++)
+        threads.create_thread(boost::bind(&CCheckQueue<CExternalBlockCheck>::Thread, &queue));
+    reader.Start();
+
+    try {
+        while (true) {
+            boost::this_thread::interruption_point();
+            int64_t nTime = GetTimeMicros();
+            batchNext = reader.Pop();
+            nWaitReadTime += GetTimeMicros() - nTime;
+            if (batchNext) {
+                std::vector<CExternalBlockCheck> vChecks;
+                vChecks.reserve(batchNext->size());
+                for (unsigned int i = 0; i < batchNext->size(); i++)
+                    vChecks.push_back(CExternalBlockCheck(&(*batchNext)[i]));
+                queue.Add(vChecks);
+                nBlocks += batchNext->size();
+            }
+            bool fContinue = true;
+            if (batchChecked) {
+                nTime = GetTimeMicros();
+                fContinue = ConnectExternalBlocks(*batchChecked, dbp != NULL, mapBlocksUnknownParent, nLoaded);
+                nConnectTime += GetTimeMicros() - nTime;
+            }
+            nTime = GetTimeMicros();
+            queue.Wait();
+            nWaitCheckTime += GetTimeMicros() - nTime;
+            if (batchNext)
+                for (unsigned int i = 0; i < batchNext->size(); i++)
+                    nCheckTime += (*batchNext)[i].nCheckTime;
+            batchChecked = batchNext;
+            if (!batchChecked || !fContinue)
+                break;
         }
+        std::string strError = reader.GetError();
+        if (!strError.empty())
+            throw std::runtime_error(strError);
     } catch(std::runtime_error &e) {
         AbortNode(std::string("System error: ") + e.what());
     }
     if (nLoaded > 0)
         LogPrintf("Loaded %i blocks from external file in %dms\n", nLoaded, GetTimeMillis() - nStart);
+    LogPrintf("%s: %u blocks, read %.1fMiB in %.2fms, checked in %.2fms on %d threads, connected in %.2fms, waited %.2fms for reads and %.2fms for checks\n",
+             __func__, nBlocks, reader.nReadBytes / 1048576.0, reader.nReadTime * 0.001, nCheckTime * 0.001, std::max(nScriptCheckThreads, 1),
+             nConnectTime * 0.001, nWaitReadTime * 0.001, nWaitCheckTime * 0.001);
     return nLoaded > 0;
 }
 
@@ -3302,15 +3641,14 @@ bool static AlreadyHave(const CInv& inv)
     return true;
 }
 
-
 void static ProcessGetData(CNode* pfrom)
 {
     std::deque<CInv>::iterator it = pfrom->vRecvGetData.begin();
 
     vector<CInv> vNotFound;
 
-    LOCK(cs_main);
-
+    // cs_main is only held to look blocks up, so validation is not held
+    // up while a block is read and pushed to a slow peer
     while (it != pfrom->vRecvGetData.end()) {
         // Don't bother if send buffer is too full to respond anyway
         if (pfrom->nSendSize >= SendBufferSize())
@@ -3324,32 +3662,49 @@ void static ProcessGetData(CNode* pfrom)
             if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
             {
                 bool send = false;
-                BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
-                if (mi != mapBlockIndex.end())
+                CDiskBlockPos pos;
+                uint256 hashTip;
                 {
-                    // If the requested block is at a height below our last
-                    // checkpoint, only serve it if it's in the checkpointed chain
-                    int nHeight = mi->second->nHeight;
-                    CBlockIndex* pcheckpoint = Checkpoints::GetLastCheckpoint();
-                    if (pcheckpoint && nHeight < pcheckpoint->nHeight) {
-                        if (!chainActive.Contains(mi->second))
-                        {
-                            LogPrintf("ProcessGetData(): ignoring request for old block that isn't in the main chain\n");
+                    LOCK(cs_main);
+                    BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
+                    if (mi != mapBlockIndex.end())
+                    {
+                        // If the requested block is at a height below our last
+                        // checkpoint, only serve it if it's in the checkpointed chain
+                        int nHeight = mi->second->nHeight;
+                        CBlockIndex* pcheckpoint = Checkpoints::GetLastCheckpoint();
+                        if (pcheckpoint && nHeight < pcheckpoint->nHeight) {
+                            if (!chainActive.Contains(mi->second))
+                            {
+                                LogPrintf("ProcessGetData(): ignoring request for old block that isn't in the main chain\n");
+                            } else {
+                                send = true;
+                            }
                         } else {
                             send = true;
                         }
-                    } else {
-                        send = true;
+                    }
+                    if (send)
+                    {
+                        pos = mi->second->GetBlockPos();
+                        hashTip = chainActive.Tip()->GetBlockHash();
                     }
                 }
                 if (send)
                 {
-                    // Send block from disk
-                    CBlock block;
-                    if (!ReadBlockFromDisk(block, (*mi).second))
-                        assert(!"cannot load block from disk");
+                    // Send block from memory if it was served lately, or
+                    // else from disk
+                    CServedBlock served;
+                    if (!GetServedBlock(inv.hash, served))
+                    {
+                        boost::shared_ptr<CBlock> pblock(new CBlock());
+                        if (!ReadBlockFromDisk(*pblock, pos) || pblock->GetHash() != inv.hash)
+                            assert(!"cannot load block from disk");
+                        served = CacheServedBlock(pblock);
+                    }
+                    const CBlock& block = *served.block;
                     if (inv.type == MSG_BLOCK)
-                        pfrom->PushMessage("block", block);
+                        pfrom->PushMessage("block", served.payload);
                     else // MSG_FILTERED_BLOCK)
                     {
                         LOCK(pfrom->cs_filter);
@@ -3365,8 +3720,15 @@ void static ProcessGetData(CNode* pfrom)
                             // however we MUST always provide at least what the remote peer needs
                             typedef std::pair<unsigned int, uint256> PairType;
                             BOOST_FOREACH(PairType& pair, merkleBlock.vMatchedTxn)
-                                if (!pfrom->setInventoryKnown.count(CInv(MSG_TX, pair.second)))
+                            {
+                                bool fKnown;
+                                {
+                                    LOCK(pfrom->cs_inventory);
+                                    fKnown = pfrom->setInventoryKnown.count(CInv(MSG_TX, pair.second));
+                                }
+                                if (!fKnown)
                                     pfrom->PushMessage("tx", block.vtx[pair.first]);
+                            }
                         }
                         // else
                             // no response
@@ -3379,7 +3741,7 @@ void static ProcessGetData(CNode* pfrom)
                         // and we want it right after the last block so they don't
                         // wait for other stuff first.
                         vector<CInv> vInv;
-                        vInv.push_back(CInv(MSG_BLOCK, chainActive.Tip()->GetBlockHash()));
+                        vInv.push_back(CInv(MSG_BLOCK, hashTip));
                         pfrom->PushMessage("inv", vInv);
                         pfrom->hashContinue = 0;
                     }
@@ -3391,7 +3753,7 @@ void static ProcessGetData(CNode* pfrom)
                 bool pushed = false;
                 {
                     LOCK(cs_mapRelay);
-                    map<CInv, CDataStream>::iterator mi = mapRelay.find(inv);
+                    map<CInv, CNetPayloadRef>::iterator mi = mapRelay.find(inv);
                     if (mi != mapRelay.end()) {
                         pfrom->PushMessage(inv.GetCommand(), (*mi).second);
                         pushed = true;
@@ -3400,10 +3762,7 @@ void static ProcessGetData(CNode* pfrom)
                 if (!pushed && inv.type == MSG_TX) {
                     CTransaction tx;
                     if (mempool.lookup(inv.hash, tx)) {
-                        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-                        ss.reserve(1000);
-                        ss << tx;
-                        pfrom->PushMessage("tx", ss);
+                        pfrom->PushMessage("tx", MakeNetPayload(tx));
                         pushed = true;
                     }
                 }
@@ -3789,12 +4148,22 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         vector<CBlock> vHeaders;
         int nLimit = MAX_HEADERS_RESULTS;
         LogPrint("net", "getheaders %d to %s from peer=%d\n", (pindex ? pindex->nHeight : -1), hashStop.ToString(), pfrom->id);
+        vector<uint256> vAuxPowHashes;
         for (; pindex; pindex = chainActive.Next(pindex))
         {
-            vHeaders.push_back(pindex->GetBlockHeader());
+            vHeaders.push_back(pindex->GetBlockHeaderWithoutAuxPow());
+            if (pindex->nVersion & BLOCK_VERSION_AUXPOW)
+                vAuxPowHashes.push_back(pindex->GetBlockHash());
             if (--nLimit <= 0 || pindex->GetBlockHash() == hashStop)
                 break;
         }
+
+        // Fetch the auxpows of the whole reply at once rather than per header
+        vector<boost::shared_ptr<CAuxPow> > vAuxPow;
+        pblocktree->ReadAuxPows(vAuxPowHashes, vAuxPow);
+        for (unsigned int i = 0, j = 0; i < vHeaders.size() && j < vAuxPow.size(); i++)
+            if (vHeaders[i].nVersion & BLOCK_VERSION_AUXPOW)
+                vHeaders[i].auxpow = vAuxPow[j++];
         pfrom->PushMessage("headers", vHeaders);
     }
 
@@ -3923,13 +4292,52 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             ReadCompactSize(vRecv); // ignore tx count; assume it is 0.
         }
 
-        LOCK(cs_main);
-
         if (nCount == 0) {
             // Nothing interesting. Stop asking this peers for more headers.
             return true;
         }
 
+        // The heights of the batch below count on a continuous sequence
+        for (unsigned int n = 1; n < headers.size(); n++) {
+            if (headers[n].hashPrevBlock != headers[n - 1].GetHash()) {
+                LOCK(cs_main);
+                Misbehaving(pfrom->GetId(), 20);
+                return error("non-continuous headers sequence");
+            }
+        }
+
+        // Verify the proof of work of the new headers, which for auxpow
+        // headers means their merkle branches, on the check threads and
+        // without holding cs_main. Accepting them below then finds them
+        // in the auxpow cache.
+        int nFirstHeight = -1;
+        unsigned int nKnown = 0;
+        {
+            LOCK(cs_main);
+            while (nKnown < headers.size() && mapBlockIndex.count(headers[nKnown].GetHash()))
+                nKnown++;
+            if (nKnown < headers.size()) {
+                BlockMap::iterator mi = mapBlockIndex.find(headers[nKnown].hashPrevBlock);
+                if (mi != mapBlockIndex.end())
+                    nFirstHeight = mi->second->nHeight + 1;
+            }
+        }
+        if (nFirstHeight >= 0) {
+            std::vector<CBlockHeader> vNewHeaders(headers.begin() + nKnown, headers.end());
+            bool fValid;
+            {
+                LOCK(cs_headercheckqueue);
+                fValid = CheckProofOfWorkBatch(vNewHeaders, nFirstHeight, nScriptCheckThreads ? &headercheckqueue : NULL);
+            }
+            if (!fValid) {
+                LOCK(cs_main);
+                Misbehaving(pfrom->GetId(), 50);
+                return error("headers with invalid proof of work received");
+            }
+        }
+
+        LOCK(cs_main);
+
         CBlockIndex *pindexLast = NULL;
         BOOST_FOREACH(const CBlockHeader& header, headers) {
             CValidationState state;
@@ -3986,7 +4394,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
     else if (strCommand == "getaddr")
     {
-        pfrom->vAddrToSend.clear();
+        {
+            LOCK(pfrom->cs_inventory);
+            pfrom->vAddrToSend.clear();
+        }
         vector<CAddress> vAddr = addrman.GetAddr();
         BOOST_FOREACH(const CAddress &addr, vAddr)
             pfrom->PushAddress(addr);
@@ -4103,16 +4514,34 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         vRecv >> alert;
 
         uint256 alertHash = alert.GetHash();
-        if (pfrom->setKnown.count(alertHash) == 0)
+        bool fKnown;
+        {
+            LOCK(pfrom->cs_inventory);
+            fKnown = pfrom->setKnown.count(alertHash);
+        }
+        if (!fKnown)
         {
             if (alert.ProcessAlert())
             {
                 // Relay
-                pfrom->setKnown.insert(alertHash);
+                {
+                    LOCK(pfrom->cs_inventory);
+                    pfrom->setKnown.insert(alertHash);
+                }
+                // Not under cs_vNodes, pushing waits for each node's cs_vSend
+                vector<CNode*> vNodesCopy;
                 {
                     LOCK(cs_vNodes);
-                    BOOST_FOREACH(CNode* pnode, vNodes)
-                        alert.RelayTo(pnode);
+                    vNodesCopy = vNodes;
+                    BOOST_FOREACH(CNode* pnode, vNodesCopy)
+                        pnode->AddRef();
+                }
+                BOOST_FOREACH(CNode* pnode, vNodesCopy)
+                    alert.RelayTo(pnode);
+                {
+                    LOCK(cs_vNodes);
+                    BOOST_FOREACH(CNode* pnode, vNodesCopy)
+                        pnode->Release();
                 }
             }
             else {
@@ -4158,10 +4587,16 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         {
             Misbehaving(pfrom->GetId(), 100);
         } else {
-            LOCK(pfrom->cs_filter);
-            if (pfrom->pfilter)
-                pfrom->pfilter->insert(vData);
-            else
+            // Misbehaving takes cs_main, which is taken before cs_filter
+            bool fNoFilter = false;
+            {
+                LOCK(pfrom->cs_filter);
+                if (pfrom->pfilter)
+                    pfrom->pfilter->insert(vData);
+                else
+                    fNoFilter = true;
+            }
+            if (fNoFilter)
                 Misbehaving(pfrom->GetId(), 100);
         }
     }
@@ -4378,7 +4813,10 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         if (!lockMain)
             return true;
 
-        // Address refresh broadcast
+        // Address refresh broadcast. SendMessages runs on the message
+        // handler and the message threads, the time of the last one is
+        // only touched under cs_main.
+        AssertLockHeld(cs_main);
         static int64_t nLastRebroadcast;
         if (!IsInitialBlockDownload() && (GetTime() - nLastRebroadcast > 24 * 60 * 60))
         {
@@ -4388,7 +4826,10 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                 {
                     // Periodically clear setAddrKnown to allow refresh broadcasts
                     if (nLastRebroadcast)
+                    {
+                        LOCK(pnode->cs_inventory);
                         pnode->setAddrKnown.clear();
+                    }
 
                     // Rebroadcast our address
                     if (fListen)
@@ -4407,6 +4848,7 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         //
         if (fSendTrickle)
         {
+            LOCK(pto->cs_inventory);
             vector<CAddress> vAddr;
             vAddr.reserve(pto->vAddrToSend.size());
             BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
@@ -4654,17 +5096,18 @@ std::string CDiskBlockIndex::ToString() const {
 }
 CBlockHeader CBlockIndex::GetBlockHeader() const
 {
-    CBlockHeader block;
+    CBlockHeader block = GetBlockHeaderWithoutAuxPow();
 
     if (nVersion & BLOCK_VERSION_AUXPOW) {
-        CDiskBlockIndex diskblockindex;
-        // auxpow is not in memory, load CDiskBlockHeader
-        // from database to get it
-  
-        pblocktree->ReadDiskBlockIndex(*phashBlock, diskblockindex);
-        block.auxpow = diskblockindex.auxpow;
+        // auxpow is not in memory, get it from the auxpow cache
+        // in front of the block tree database
+        pblocktree->ReadAuxPow(*phashBlock, block.auxpow);
     }
-
+    return block;
+}
+CBlockHeader CBlockIndex::GetBlockHeaderWithoutAuxPow() const
+{
+    CBlockHeader block;
     block.nVersion       = nVersion;
     if (pprev)
         block.hashPrevBlock = pprev->GetBlockHash();
@@ -4677,7 +5120,7 @@ CBlockHeader CBlockIndex::GetBlockHeader() const
 bool CDiskBlockIndex::CheckIndex() const
 {
     if (nVersion & BLOCK_VERSION_AUXPOW)
-        return CheckProofOfWork(auxpow->GetParentBlockHash(), nBits);
+        return auxpow && CheckProofOfWork(auxpow->GetParentBlockHash(), nBits);
     else
         return CheckProofOfWork(GetBlockHash(), nBits);
 }
@@ -0,0 +1,35 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_MEMUSAGE_H
+#define BITCOIN_MEMUSAGE_H
+
+#include <stddef.h>
+
+#include <vector>
+
+namespace memusage
+{
+
+/** Bytes the heap really takes for an allocation of alloc bytes: glibc
+ *  rounds up and keeps a header word in front of every chunk. */
+static inline size_t MallocUsage(size_t alloc)
+{
+    if (alloc == 0)
+        return 0;
+    if (sizeof(void*) == 8)
+        return ((alloc + 31) >> 4) << 4;
+    return ((alloc + 15) >> 3) << 3;
+}
+
+/** Heap memory owned by a vector, not counting what its elements own. */
+template <typename T>
+static inline size_t DynamicUsage(const std::vector<T>& v)
+{
+    return MallocUsage(v.capacity() * sizeof(T));
+}
+
+}
+
+#endif // BITCOIN_MEMUSAGE_H
@@ -10,6 +10,7 @@
 #include "main.h"
 #include "net.h"
 #include "pow.h"
+#include "receiverschedule.h"
 #include "util.h"
 #include "utilmoneystr.h"
 #include "base58.h"
@@ -98,46 +99,50 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
     txNew.vout[0].scriptPubKey = scriptPubKeyIn;
 
 	// DEVCOIN
-    vector<string> coinAddressStrings = getCoinAddressStrings(GetDataDir().string(), receiverCSV, (int)pindexPrev->nHeight+1, step);
-    txNew.vout.resize(coinAddressStrings.size() + 1);
+    int nHeight = pindexPrev->nHeight+1;
+    boost::shared_ptr<const CReceiverStep> preceiverStep = receiverSchedule.GetStep(nHeight);
+    if (preceiverStep->nStepIndex < 0)
+    {
+        // The prefetch thread has been asked for it, do not hand out work without the beneficiaries
+        LogPrintf("CreateNewBlock() : waiting for the receiver file of height %d\n", nHeight);
+        return NULL;
+    }
+    const vector<CReceiverAddress>& vReceivers = preceiverStep->GetAddresses(nHeight, step);
+    txNew.vout.resize(vReceivers.size() + 1);
     txNew.vout[0].scriptPubKey = scriptPubKeyIn;
 	
 	// Prepare to pay beneficiaries
 
     CAmount nFees = 0;
-    CAmount minerValue = GetBlockValue(pindexPrev->nHeight+1, nFees);
+    CAmount minerValue = GetBlockValue(nHeight, nFees);
     CAmount sharePerAddress = 0;
-    if (coinAddressStrings.size() == 0)
+    if (vReceivers.size() == 0)
         minerValue -= fallbackReduction;
     else
-        sharePerAddress = roundint64(share / (CAmount)coinAddressStrings.size());
+        sharePerAddress = roundint64(share / (CAmount)vReceivers.size());
 	
-	LogPrintf("coinAddressStrings: %d\n", coinAddressStrings.size());
-    for (unsigned int i=0; i<coinAddressStrings.size(); i++)
+	LogPrintf("coinAddressStrings: %d\n", vReceivers.size());
+    for (unsigned int i=0; i<vReceivers.size(); i++)
     {
-		
-     	const std::string coinAddressString = coinAddressStrings[i];
-        // Create transaction
-        CKeyID addrKeyId;
-		CBitcoinAddress addr(coinAddressString);
-		if(!addr.IsValid())
+        const CReceiverAddress& receiver = vReceivers[i];
+		if(!receiver.IsValid())
 		{
-			LogPrintf("CBitcoinAddress not valid! %s\n", coinAddressString.c_str());
+			LogPrintf("CBitcoinAddress not valid! %s\n", receiver.strAddress.c_str());
 			return NULL;
 		}
 		
-		if(addr.GetKeyID(addrKeyId))
+		if(!receiver.scriptPubKey.empty())
 		{
-			txNew.vout[i + 1].scriptPubKey << OP_DUP << OP_HASH160 << ToByteVector(addrKeyId) << OP_EQUALVERIFY << OP_CHECKSIG;
+			txNew.vout[i + 1].scriptPubKey = receiver.scriptPubKey;
 			txNew.vout[i + 1].nValue = sharePerAddress;
 			
 			minerValue -= sharePerAddress;
-			LogPrintf("Address %s valid, value %d, minerValue %d\n", coinAddressString.c_str(), txNew.vout[i + 1].nValue, minerValue);
+			LogPrintf("Address %s valid, value %d, minerValue %d\n", receiver.strAddress.c_str(), txNew.vout[i + 1].nValue, minerValue);
 			
 		}
 		else
 		{
-			LogPrintf("Address key invalid for: %s\n", coinAddressString.c_str());
+			LogPrintf("Address key invalid for: %s\n", receiver.strAddress.c_str());
 		}
 		if(txNew.vout[i + 1].nValue < 0)
 		{
@@ -27,6 +27,10 @@
 #include <miniupnpc/upnperrors.h>
 #endif
 
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+
 #include <boost/filesystem.hpp>
 #include <boost/thread.hpp>
 
@@ -73,6 +77,12 @@ map<CNetAddr, LocalServiceInfo> mapLocalHost;
 static bool vfReachable[NET_MAX] = {};
 static bool vfLimited[NET_MAX] = {};
 static CNode* pnodeLocalHost = NULL;
+// Nodes with work for the message threads, each holding a reference
+static std::deque<CNode*> vNodesMsgProc;
+static boost::mutex mutexMsgProc;
+static boost::condition_variable condMsgProc;
+// epoll instance the socket handler waits on, -1 when it uses select()
+static int hPollSocket = -1;
 uint64_t nLocalHostNonce = 0;
 static std::vector<ListenSocket> vhListenSocket;
 CAddrMan addrman;
@@ -81,7 +91,7 @@ bool fAddressesInitialized = false;
 
 vector<CNode*> vNodes;
 CCriticalSection cs_vNodes;
-map<CInv, CDataStream> mapRelay;
+map<CInv, CNetPayloadRef> mapRelay;
 deque<pair<int64_t, CInv> > vRelayExpiration;
 CCriticalSection cs_mapRelay;
 limitedmap<CInv, int64_t> mapAlreadyAskedFor(MAX_INV_SZ);
@@ -435,6 +445,65 @@ uint64_t CNode::nTotalBytesSent = 0;
 CCriticalSection CNode::cs_totalBytesRecv;
 CCriticalSection CNode::cs_totalBytesSent;
 
+#ifdef HAVE_SYS_EPOLL_H
+static void PollSetEvents(CNode* pnode, int nOp, bool fSendInterest)
+{
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+    if (fSendInterest)
+        event.events |= EPOLLOUT;
+    event.data.ptr = pnode;
+    if (epoll_ctl(hPollSocket, nOp, pnode->hSocket, &event) != 0)
+    {
+        LogPrintf("socket epoll_ctl error %s\n", NetworkErrorString(errno));
+        pnode->fDisconnect = true;
+        return;
+    }
+    pnode->fPollRegistered = true;
+    pnode->fPollSendInterest = fSendInterest;
+}
+#endif
+
+// Hand the socket of a new node to the epoll instance, if there is one
+static void PollAddNode(CNode* pnode)
+{
+#ifdef HAVE_SYS_EPOLL_H
+    if (hPollSocket == -1)
+        return;
+    LOCK(pnode->cs_vSend);
+    if (pnode->hSocket != INVALID_SOCKET)
+        PollSetEvents(pnode, EPOLL_CTL_ADD, !pnode->vSendMsg.empty());
+#endif
+}
+
+// Wait for write readiness exactly while there is data queued to send.
+// requires LOCK(cs_vSend)
+static void PollUpdateSendInterest(CNode* pnode)
+{
+#ifdef HAVE_SYS_EPOLL_H
+    bool fSendInterest = !pnode->vSendMsg.empty();
+    if (pnode->fPollRegistered && pnode->fPollSendInterest != fSendInterest)
+        PollSetEvents(pnode, EPOLL_CTL_MOD, fSendInterest);
+#endif
+}
+
+// Stop watching the socket of pnode before it is closed, so that no events
+// for it are reported once the socket number is reused.
+// requires LOCK(cs_vSend)
+static void PollRemoveNode(CNode* pnode)
+{
+#ifdef HAVE_SYS_EPOLL_H
+    if (!pnode->fPollRegistered)
+        return;
+    // Kernels before 2.6.9 want an event even though it is ignored
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    epoll_ctl(hPollSocket, EPOLL_CTL_DEL, pnode->hSocket, &event);
+    pnode->fPollRegistered = false;
+#endif
+}
+
 CNode* FindNode(const CNetAddr& ip)
 {
     LOCK(cs_vNodes);
@@ -492,6 +561,7 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest)
         CNode* pnode = new CNode(hSocket, addrConnect, pszDest ? pszDest : "", false);
         pnode->AddRef();
 
+        PollAddNode(pnode);
         {
             LOCK(cs_vNodes);
             vNodes.push_back(pnode);
@@ -508,10 +578,16 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest)
 void CNode::CloseSocketDisconnect()
 {
     fDisconnect = true;
-    if (hSocket != INVALID_SOCKET)
     {
-        LogPrint("net", "disconnecting peer=%d\n", id);
-        CloseSocket(hSocket);
+        // Senders use the socket with cs_vSend held, so it cannot be
+        // closed and its number reused under them
+        LOCK(cs_vSend);
+        if (hSocket != INVALID_SOCKET)
+        {
+            LogPrint("net", "disconnecting peer=%d\n", id);
+            PollRemoveNode(this);
+            CloseSocket(hSocket);
+        }
     }
 
     // in case this fails, we'll empty the recv buffer when the CNode is deleted
@@ -718,26 +794,71 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
 
 
 
+#ifdef WIN32
+// Winsock has no sendmsg(), the buffers go out one send() at a time
+static const int MAX_SEND_SEGMENTS = 1;
+#else
+static const int MAX_SEND_SEGMENTS = 64;
+#endif
+
 // requires LOCK(cs_vSend)
 void SocketSendData(CNode *pnode)
 {
-    std::deque<CSerializeData>::iterator it = pnode->vSendMsg.begin();
+    std::deque<CSendMessage>::iterator it = pnode->vSendMsg.begin();
 
     while (it != pnode->vSendMsg.end()) {
-        const CSerializeData &data = *it;
-        assert(data.size() > pnode->nSendOffset);
-        int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], data.size() - pnode->nSendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
+        // Gather the unsent part of the queue: each message is its own data
+        // followed by the payload it may share with other peers, written
+        // straight from where it is kept
+        std::pair<const char*, size_t> vSegments[MAX_SEND_SEGMENTS];
+        int nSegments = 0;
+        size_t nGathered = 0;
+        size_t nOffset = pnode->nSendOffset;
+        for (std::deque<CSendMessage>::iterator itGather = it; itGather != pnode->vSendMsg.end() && nSegments < MAX_SEND_SEGMENTS; itGather++) {
+            const CSendMessage &msg = *itGather;
+            assert(msg.size() > nOffset);
+            if (nOffset < msg.data.size()) {
+                vSegments[nSegments++] = std::make_pair(&msg.data[nOffset], msg.data.size() - nOffset);
+                nOffset = 0;
+            } else {
+                nOffset -= msg.data.size();
+            }
+            if (msg.payload && nOffset < msg.payload->vch.size() && nSegments < MAX_SEND_SEGMENTS)
+                vSegments[nSegments++] = std::make_pair(&msg.payload->vch[nOffset], msg.payload->vch.size() - nOffset);
+            nOffset = 0;
+        }
+        for (int i = 0; i < nSegments; i++)
+            nGathered += vSegments[i].second;
+
+#ifdef WIN32
+        int nBytes = send(pnode->hSocket, vSegments[0].first, vSegments[0].second, MSG_NOSIGNAL | MSG_DONTWAIT);
+#else
+        struct iovec iov[MAX_SEND_SEGMENTS];
+        for (int i = 0; i < nSegments; i++) {
+            iov[i].iov_base = (void*)vSegments[i].first;
+            iov[i].iov_len = vSegments[i].second;
+        }
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = nSegments;
+        int nBytes = sendmsg(pnode->hSocket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+#endif
         if (nBytes > 0) {
             pnode->nLastSend = GetTime();
             pnode->nSendBytes += nBytes;
-            pnode->nSendOffset += nBytes;
             pnode->RecordBytesSent(nBytes);
-            if (pnode->nSendOffset == data.size()) {
+            // Step over the messages that went out completely
+            size_t nLeft = nBytes;
+            while (nLeft > 0 && nLeft >= it->size() - pnode->nSendOffset) {
+                nLeft -= it->size() - pnode->nSendOffset;
                 pnode->nSendOffset = 0;
-                pnode->nSendSize -= data.size();
+                pnode->nSendSize -= it->size();
                 it++;
-            } else {
-                // could not send full message; stop sending more
+            }
+            pnode->nSendOffset += nLeft;
+            if ((size_t)nBytes < nGathered) {
+                // could not send all of it; stop sending more
                 break;
             }
         } else {
@@ -760,77 +881,238 @@ void SocketSendData(CNode *pnode)
         assert(pnode->nSendSize == 0);
     }
     pnode->vSendMsg.erase(pnode->vSendMsg.begin(), it);
+    PollUpdateSendInterest(pnode);
+
+    // Let the message handler go on with what it left for lack of room
+    if (pnode->fMsgProcWaitSend && pnode->nSendSize < SendBufferSize())
+    {
+        pnode->fMsgProcWaitSend = false;
+        WakeMessageHandler(pnode);
+    }
+}
+
+// Queue pnode for the message threads, unless it already is. A node that
+// is being served is only queued again once its thread is done with it.
+// Only takes mutexMsgProc, so callers may hold any of the node's locks. The
+// caller keeps the node alive, and once queued DisconnectNodes does not
+// delete it before a message thread is done with it.
+void WakeMessageHandler(CNode *pnode)
+{
+    bool fNotify = false;
+    {
+        boost::lock_guard<boost::mutex> lock(mutexMsgProc);
+        if (pnode->fMsgProcQueued)
+            return;
+        pnode->fMsgProcQueued = true;
+        if (!pnode->fMsgProcBusy)
+        {
+            vNodesMsgProc.push_back(pnode);
+            fNotify = true;
+        }
+    }
+    if (fNotify)
+        condMsgProc.notify_one();
+}
+
+// Whether the message threads have pnode queued or are serving it
+static bool IsMessageHandlerHolding(CNode *pnode)
+{
+    boost::lock_guard<boost::mutex> lock(mutexMsgProc);
+    return pnode->fMsgProcQueued || pnode->fMsgProcBusy;
 }
 
 static list<CNode*> vNodesDisconnected;
 
-void ThreadSocketHandler()
+static void DisconnectNodes(unsigned int& nPrevNodeCount)
 {
-    unsigned int nPrevNodeCount = 0;
-    while (true)
+    vector<CNode*> vNodesClosing;
     {
-        //
-        // Disconnect nodes
-        //
+        LOCK(cs_vNodes);
+        // Disconnect unused nodes
+        vector<CNode*> vNodesCopy = vNodes;
+        BOOST_FOREACH(CNode* pnode, vNodesCopy)
         {
-            LOCK(cs_vNodes);
-            // Disconnect unused nodes
-            vector<CNode*> vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            if (pnode->fDisconnect ||
+                (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0 && pnode->ssSend.empty()))
             {
-                if (pnode->fDisconnect ||
-                    (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0 && pnode->ssSend.empty()))
-                {
-                    // remove from vNodes
-                    vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
+                // remove from vNodes
+                vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
 
-                    // release outbound grant (if any)
-                    pnode->grantOutbound.Release();
+                // release outbound grant (if any)
+                pnode->grantOutbound.Release();
 
-                    // close socket and cleanup
-                    pnode->CloseSocketDisconnect();
+                vNodesClosing.push_back(pnode);
 
-                    // hold in disconnected pool until all refs are released
-                    if (pnode->fNetworkNode || pnode->fInbound)
-                        pnode->Release();
-                    vNodesDisconnected.push_back(pnode);
-                }
+                // hold in disconnected pool until all refs are released
+                if (pnode->fNetworkNode || pnode->fInbound)
+                    pnode->Release();
+                vNodesDisconnected.push_back(pnode);
             }
         }
+    }
+    // close sockets and cleanup, only deleted below. Not under cs_vNodes,
+    // closing waits for cs_vSend and message senders holding that may
+    // relay to all nodes.
+    BOOST_FOREACH(CNode* pnode, vNodesClosing)
+        pnode->CloseSocketDisconnect();
+    {
+        // Delete disconnected nodes
+        list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
+        BOOST_FOREACH(CNode* pnode, vNodesDisconnectedCopy)
         {
-            // Delete disconnected nodes
-            list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
-            BOOST_FOREACH(CNode* pnode, vNodesDisconnectedCopy)
+            // wait until threads are done using it
+            if (pnode->GetRefCount() <= 0)
             {
-                // wait until threads are done using it
-                if (pnode->GetRefCount() <= 0)
+                bool fDelete = false;
                 {
-                    bool fDelete = false;
+                    TRY_LOCK(pnode->cs_vSend, lockSend);
+                    if (lockSend)
                     {
-                        TRY_LOCK(pnode->cs_vSend, lockSend);
-                        if (lockSend)
+                        TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                        if (lockRecv)
                         {
-                            TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                            if (lockRecv)
-                            {
-                                TRY_LOCK(pnode->cs_inventory, lockInv);
-                                if (lockInv)
-                                    fDelete = true;
-                            }
+                            TRY_LOCK(pnode->cs_inventory, lockInv);
+                            if (lockInv)
+                                fDelete = !IsMessageHandlerHolding(pnode);
                         }
                     }
-                    if (fDelete)
-                    {
-                        vNodesDisconnected.remove(pnode);
-                        delete pnode;
-                    }
+                }
+                if (fDelete)
+                {
+                    vNodesDisconnected.remove(pnode);
+                    delete pnode;
                 }
             }
         }
-        if(vNodes.size() != nPrevNodeCount) {
-            nPrevNodeCount = vNodes.size();
-            uiInterface.NotifyNumConnectionsChanged(nPrevNodeCount);
+    }
+    if(vNodes.size() != nPrevNodeCount) {
+        nPrevNodeCount = vNodes.size();
+        uiInterface.NotifyNumConnectionsChanged(nPrevNodeCount);
+    }
+}
+
+static void AcceptConnection(const ListenSocket& hListenSocket)
+{
+    struct sockaddr_storage sockaddr;
+    socklen_t len = sizeof(sockaddr);
+    SOCKET hSocket = accept(hListenSocket.socket, (struct sockaddr*)&sockaddr, &len);
+    CAddress addr;
+    int nInbound = 0;
+
+    if (hSocket != INVALID_SOCKET)
+        if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
+            LogPrintf("Warning: Unknown socket family\n");
+
+    bool whitelisted = hListenSocket.whitelisted || CNode::IsWhitelistedRange(addr);
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes)
+            if (pnode->fInbound)
+                nInbound++;
+    }
+
+    if (hSocket == INVALID_SOCKET)
+    {
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK)
+            LogPrintf("socket error accept failed: %s\n", NetworkErrorString(nErr));
+    }
+    else if (nInbound >= nMaxConnections - MAX_OUTBOUND_CONNECTIONS)
+    {
+        CloseSocket(hSocket);
+    }
+    else if (CNode::IsBanned(addr) && !whitelisted)
+    {
+        LogPrintf("connection from %s dropped (banned)\n", addr.ToString());
+        CloseSocket(hSocket);
+    }
+    else
+    {
+        CNode* pnode = new CNode(hSocket, addr, "", true);
+        pnode->AddRef();
+        pnode->fWhitelisted = whitelisted;
+
+        PollAddNode(pnode);
+        {
+            LOCK(cs_vNodes);
+            vNodes.push_back(pnode);
+        }
+    }
+}
+
+// Read what the socket of pnode has buffered into its receive queue.
+// Returns the number of bytes read, or 0 if there was nothing to read or
+// the socket got closed.
+// requires LOCK(cs_vRecvMsg)
+static int SocketRecvData(CNode *pnode, char *pchBuf, size_t nBufSize)
+{
+    int nBytes = recv(pnode->hSocket, pchBuf, nBufSize, MSG_DONTWAIT);
+    if (nBytes > 0)
+    {
+        if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
+            pnode->CloseSocketDisconnect();
+        pnode->nLastRecv = GetTime();
+        pnode->nRecvBytes += nBytes;
+        pnode->RecordBytesRecv(nBytes);
+        if (!pnode->vRecvMsg.empty() && pnode->vRecvMsg.front().complete())
+            WakeMessageHandler(pnode);
+        return nBytes;
+    }
+    else if (nBytes == 0)
+    {
+        // socket closed gracefully
+        if (!pnode->fDisconnect)
+            LogPrint("net", "socket closed\n");
+        pnode->CloseSocketDisconnect();
+    }
+    else if (nBytes < 0)
+    {
+        // error
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
+        {
+            if (!pnode->fDisconnect)
+                LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
+            pnode->CloseSocketDisconnect();
+        }
+    }
+    return 0;
+}
+
+static void InactivityCheck(CNode *pnode)
+{
+    int64_t nTime = GetTime();
+    if (nTime - pnode->nTimeConnected > 60)
+    {
+        if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
+        {
+            LogPrint("net", "socket no message in first 60 seconds, %d %d from %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0, pnode->id);
+            pnode->fDisconnect = true;
         }
+        else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL)
+        {
+            LogPrintf("socket sending timeout: %is\n", nTime - pnode->nLastSend);
+            pnode->fDisconnect = true;
+        }
+        else if (nTime - pnode->nLastRecv > (pnode->nVersion > BIP0031_VERSION ? TIMEOUT_INTERVAL : 90*60))
+        {
+            LogPrintf("socket receive timeout: %is\n", nTime - pnode->nLastRecv);
+            pnode->fDisconnect = true;
+        }
+        else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros())
+        {
+            LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
+            pnode->fDisconnect = true;
+        }
+    }
+}
+
+static void ThreadSocketHandlerSelect()
+{
+    unsigned int nPrevNodeCount = 0;
+    while (true)
+    {
+        DisconnectNodes(nPrevNodeCount);
 
         //
         // Find which sockets have data to receive
@@ -860,6 +1142,12 @@ void ThreadSocketHandler()
             {
                 if (pnode->hSocket == INVALID_SOCKET)
                     continue;
+#ifndef WIN32
+                // Only possible when epoll could not be set up after init
+                // allowed more connections than select() takes
+                if (pnode->hSocket >= FD_SETSIZE)
+                    continue;
+#endif
                 FD_SET(pnode->hSocket, &fdsetError);
                 hSocketMax = max(hSocketMax, pnode->hSocket);
                 have_fds = true;
@@ -920,52 +1208,7 @@ void ThreadSocketHandler()
         BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket)
         {
             if (hListenSocket.socket != INVALID_SOCKET && FD_ISSET(hListenSocket.socket, &fdsetRecv))
-            {
-                struct sockaddr_storage sockaddr;
-                socklen_t len = sizeof(sockaddr);
-                SOCKET hSocket = accept(hListenSocket.socket, (struct sockaddr*)&sockaddr, &len);
-                CAddress addr;
-                int nInbound = 0;
-
-                if (hSocket != INVALID_SOCKET)
-                    if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
-                        LogPrintf("Warning: Unknown socket family\n");
-
-                bool whitelisted = hListenSocket.whitelisted || CNode::IsWhitelistedRange(addr);
-                {
-                    LOCK(cs_vNodes);
-                    BOOST_FOREACH(CNode* pnode, vNodes)
-                        if (pnode->fInbound)
-                            nInbound++;
-                }
-
-                if (hSocket == INVALID_SOCKET)
-                {
-                    int nErr = WSAGetLastError();
-                    if (nErr != WSAEWOULDBLOCK)
-                        LogPrintf("socket error accept failed: %s\n", NetworkErrorString(nErr));
-                }
-                else if (nInbound >= nMaxConnections - MAX_OUTBOUND_CONNECTIONS)
-                {
-                    CloseSocket(hSocket);
-                }
-                else if (CNode::IsBanned(addr) && !whitelisted)
-                {
-                    LogPrintf("connection from %s dropped (banned)\n", addr.ToString());
-                    CloseSocket(hSocket);
-                }
-                else
-                {
-                    CNode* pnode = new CNode(hSocket, addr, "", true);
-                    pnode->AddRef();
-                    pnode->fWhitelisted = whitelisted;
-
-                    {
-                        LOCK(cs_vNodes);
-                        vNodes.push_back(pnode);
-                    }
-                }
-            }
+                AcceptConnection(hListenSocket);
         }
 
         //
@@ -987,42 +1230,18 @@ void ThreadSocketHandler()
             //
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
+#ifndef WIN32
+            if (pnode->hSocket >= FD_SETSIZE)
+                continue;
+#endif
             if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError))
             {
                 TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
                 if (lockRecv)
                 {
-                    {
-                        // typical socket buffer is 8K-64K
-                        char pchBuf[0x10000];
-                        int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
-                        if (nBytes > 0)
-                        {
-                            if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
-                                pnode->CloseSocketDisconnect();
-                            pnode->nLastRecv = GetTime();
-                            pnode->nRecvBytes += nBytes;
-                            pnode->RecordBytesRecv(nBytes);
-                        }
-                        else if (nBytes == 0)
-                        {
-                            // socket closed gracefully
-                            if (!pnode->fDisconnect)
-                                LogPrint("net", "socket closed\n");
-                            pnode->CloseSocketDisconnect();
-                        }
-                        else if (nBytes < 0)
-                        {
-                            // error
-                            int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
-                            {
-                                if (!pnode->fDisconnect)
-                                    LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
-                                pnode->CloseSocketDisconnect();
-                            }
-                        }
-                    }
+                    // typical socket buffer is 8K-64K
+                    char pchBuf[0x10000];
+                    SocketRecvData(pnode, pchBuf, sizeof(pchBuf));
                 }
             }
 
@@ -1041,39 +1260,189 @@ void ThreadSocketHandler()
             //
             // Inactivity checking
             //
-            int64_t nTime = GetTime();
-            if (nTime - pnode->nTimeConnected > 60)
+            InactivityCheck(pnode);
+        }
+        {
+            LOCK(cs_vNodes);
+            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+                pnode->Release();
+        }
+    }
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+// Act on the readiness epoll reported for pnode. Returns -1 when it is all
+// used, otherwise how many milliseconds to wait before the next try: none
+// if the socket still has data after a fair share was read, a little if a
+// lock was taken, longer if the receive buffer is full.
+static int ServeNode(CNode *pnode)
+{
+    if (pnode->hSocket == INVALID_SOCKET)
+        return -1;
+
+    {
+        TRY_LOCK(pnode->cs_vSend, lockSend);
+        if (!lockSend)
+            return 1;
+        if (pnode->fPollSend)
+        {
+            pnode->fPollSend = false;
+            SocketSendData(pnode);
+        }
+        // Drain the send buffer before receiving more, for the reasons given
+        // in the select() loop. Write readiness brings the node back here.
+        if (!pnode->vSendMsg.empty())
+            return -1;
+    }
+
+    if (!pnode->fPollRecv || pnode->hSocket == INVALID_SOCKET)
+        return -1;
+    TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+    if (!lockRecv)
+        return 1;
+    // typical socket buffer is 8K-64K
+    char pchBuf[0x10000];
+    for (int i = 0; i < 4; i++)
+    {
+        // Leave the rest in the socket until the message handler made room
+        if (!pnode->vRecvMsg.empty() && pnode->vRecvMsg.front().complete() &&
+            pnode->GetTotalRecvSize() > ReceiveFloodSize())
+            return 10;
+        // Edge triggered: only a short read shows the socket is drained
+        if (SocketRecvData(pnode, pchBuf, sizeof(pchBuf)) < (int)sizeof(pchBuf))
+        {
+            pnode->fPollRecv = false;
+            return -1;
+        }
+    }
+    return pnode->hSocket != INVALID_SOCKET ? 0 : -1;
+}
+
+static void ThreadSocketHandlerEpoll()
+{
+    unsigned int nPrevNodeCount = 0;
+    int64_t nLastInactivityCheck = 0;
+    // Nodes with readiness left from earlier passes, each holding a reference
+    vector<CNode*> vNodesPending;
+    int nPendingWait = 50;
+    vector<struct epoll_event> vEvents(1024);
+
+    BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket)
+    {
+        // Level triggered, marked by a NULL node
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN;
+        event.data.ptr = NULL;
+        if (epoll_ctl(hPollSocket, EPOLL_CTL_ADD, hListenSocket.socket, &event) != 0)
+            LogPrintf("socket epoll_ctl error %s\n", NetworkErrorString(errno));
+    }
+
+    while (true)
+    {
+        DisconnectNodes(nPrevNodeCount);
+
+        // Nodes are only deleted above, so the ones events point to stay
+        // valid until the next pass
+        int nEvents = epoll_wait(hPollSocket, &vEvents[0], vEvents.size(), nPendingWait);
+        boost::this_thread::interruption_point();
+
+        if (nEvents == SOCKET_ERROR)
+        {
+            int nErr = errno;
+            if (nErr != EINTR)
             {
-                if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
-                {
-                    LogPrint("net", "socket no message in first 60 seconds, %d %d from %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0, pnode->id);
-                    pnode->fDisconnect = true;
-                }
-                else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL)
-                {
-                    LogPrintf("socket sending timeout: %is\n", nTime - pnode->nLastSend);
-                    pnode->fDisconnect = true;
-                }
-                else if (nTime - pnode->nLastRecv > (pnode->nVersion > BIP0031_VERSION ? TIMEOUT_INTERVAL : 90*60))
+                LogPrintf("socket epoll_wait error %s\n", NetworkErrorString(nErr));
+                MilliSleep(50);
+            }
+            nEvents = 0;
+        }
+
+        bool fAccept = false;
+        vector<CNode*> vNodesReady;
+        {
+            LOCK(cs_vNodes);
+            vNodesReady.swap(vNodesPending);
+            for (int i = 0; i < nEvents; i++)
+            {
+                CNode* pnode = (CNode*)vEvents[i].data.ptr;
+                if (pnode == NULL)
                 {
-                    LogPrintf("socket receive timeout: %is\n", nTime - pnode->nLastRecv);
-                    pnode->fDisconnect = true;
+                    fAccept = true;
+                    continue;
                 }
-                else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros())
+                if (vEvents[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                    pnode->fPollRecv = true;
+                if (vEvents[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+                    pnode->fPollSend = true;
+                if (!pnode->fPollQueued)
                 {
-                    LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
-                    pnode->fDisconnect = true;
+                    pnode->fPollQueued = true;
+                    pnode->AddRef();
+                    vNodesReady.push_back(pnode);
                 }
             }
         }
+
+        //
+        // Accept new connections
+        //
+        if (fAccept)
+        {
+            BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket)
+                if (hListenSocket.socket != INVALID_SOCKET)
+                    AcceptConnection(hListenSocket);
+        }
+
+        //
+        // Service the sockets that became ready
+        //
+        nPendingWait = 50;
+        BOOST_FOREACH(CNode* pnode, vNodesReady)
+        {
+            boost::this_thread::interruption_point();
+            int nRetry = ServeNode(pnode);
+            if (nRetry >= 0)
+            {
+                vNodesPending.push_back(pnode);
+                nPendingWait = min(nPendingWait, nRetry);
+            }
+            else
+                pnode->fPollQueued = false;
+        }
         {
             LOCK(cs_vNodes);
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
-                pnode->Release();
+            BOOST_FOREACH(CNode* pnode, vNodesReady)
+                if (!pnode->fPollQueued)
+                    pnode->Release();
+        }
+
+        //
+        // Inactivity checking, no need to look at every node every pass
+        //
+        int64_t nTime = GetTime();
+        if (nTime != nLastInactivityCheck)
+        {
+            nLastInactivityCheck = nTime;
+            LOCK(cs_vNodes);
+            BOOST_FOREACH(CNode* pnode, vNodes)
+                InactivityCheck(pnode);
         }
     }
 }
+#endif
 
+void ThreadSocketHandler()
+{
+#ifdef HAVE_SYS_EPOLL_H
+    if (hPollSocket != -1)
+    {
+        ThreadSocketHandlerEpoll();
+        return;
+    }
+#endif
+    ThreadSocketHandlerSelect();
+}
 
 
 
@@ -1481,6 +1850,78 @@ bool OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGrant *grantOu
 }
 
 
+// Process the messages pnode was woken up for, and send what they produced
+static void ServeNodeMessages(CNode* pnode)
+{
+    bool fMore = false;
+    {
+        LOCK(pnode->cs_vRecvMsg);
+        if (!g_signals.ProcessMessages(pnode))
+            pnode->CloseSocketDisconnect();
+
+        // Messages are processed one at a time, and block requests served
+        // one at a time, so other nodes get their turn in between
+        if (!pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete()))
+        {
+            LOCK(pnode->cs_vSend);
+            if (pnode->nSendSize < SendBufferSize())
+                fMore = true;
+            else
+                pnode->fMsgProcWaitSend = true;
+        }
+    }
+    boost::this_thread::interruption_point();
+
+    {
+        LOCK(pnode->cs_vSend);
+        g_signals.SendMessages(pnode, false);
+    }
+
+    if (fMore && !pnode->fDisconnect)
+        WakeMessageHandler(pnode);
+}
+
+// Serve the woken nodes, one thread per node at a time so that a peer's
+// messages are processed in order. Messages that need chain state
+// serialize on cs_main, the others run alongside them.
+void ThreadMessageWorker()
+{
+    SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
+    while (true)
+    {
+        CNode* pnode;
+        {
+            boost::unique_lock<boost::mutex> lock(mutexMsgProc);
+            while (vNodesMsgProc.empty())
+                condMsgProc.wait(lock);
+            pnode = vNodesMsgProc.front();
+            vNodesMsgProc.pop_front();
+            pnode->fMsgProcQueued = false;
+            pnode->fMsgProcBusy = true;
+        }
+
+        if (!pnode->fDisconnect)
+            ServeNodeMessages(pnode);
+
+        bool fNotify = false;
+        {
+            boost::lock_guard<boost::mutex> lock(mutexMsgProc);
+            pnode->fMsgProcBusy = false;
+            // Woken again meanwhile, the queue holds its own reference
+            if (pnode->fMsgProcQueued)
+            {
+                vNodesMsgProc.push_back(pnode);
+                fNotify = true;
+            }
+        }
+        if (fNotify)
+            condMsgProc.notify_one();
+        boost::this_thread::interruption_point();
+    }
+}
+
+// Run SendMessages over all nodes every 100ms, for pings, trickling and
+// block download scheduling
 void ThreadMessageHandler()
 {
     SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
@@ -1495,37 +1936,15 @@ void ThreadMessageHandler()
             }
         }
 
-        // Poll the connected nodes for messages
         CNode* pnodeTrickle = NULL;
         if (!vNodesCopy.empty())
             pnodeTrickle = vNodesCopy[GetRand(vNodesCopy.size())];
 
-        bool fSleep = true;
-
         BOOST_FOREACH(CNode* pnode, vNodesCopy)
         {
             if (pnode->fDisconnect)
                 continue;
 
-            // Receive messages
-            {
-                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                if (lockRecv)
-                {
-                    if (!g_signals.ProcessMessages(pnode))
-                        pnode->CloseSocketDisconnect();
-
-                    if (pnode->nSendSize < SendBufferSize())
-                    {
-                        if (!pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete()))
-                        {
-                            fSleep = false;
-                        }
-                    }
-                }
-            }
-            boost::this_thread::interruption_point();
-
             // Send messages
             {
                 TRY_LOCK(pnode->cs_vSend, lockSend);
@@ -1541,8 +1960,7 @@ void ThreadMessageHandler()
                 pnode->Release();
         }
 
-        if (fSleep)
-            MilliSleep(100);
+        MilliSleep(100);
     }
 }
 
@@ -1716,6 +2134,17 @@ void StartNode(boost::thread_group& threadGroup)
 
     Discover(threadGroup);
 
+#ifdef HAVE_SYS_EPOLL_H
+    if (hPollSocket == -1)
+    {
+        hPollSocket = epoll_create(1);
+        if (hPollSocket == -1)
+            LogPrintf("epoll_create failed: %s, waiting for sockets with select()\n", NetworkErrorString(errno));
+        else
+            fcntl(hPollSocket, F_SETFD, FD_CLOEXEC);
+    }
+#endif
+
     //
     // Start threads
     //
@@ -1738,6 +2167,9 @@ void StartNode(boost::thread_group& threadGroup)
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "opencon", &ThreadOpenConnections));
 
     // Process messages
+    int nMsgProcThreads = std::max(1, std::min((int)GetArg("-msgthreads", DEFAULT_MSGPROC_THREADS), MAX_MSGPROC_THREADS));
+    for (int i = 0; i < nMsgProcThreads; i++)
+        threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msgproc", &ThreadMessageWorker));
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msghand", &ThreadMessageHandler));
 
     // Dump network addresses
@@ -1784,11 +2216,17 @@ public:
             delete pnode;
         vNodes.clear();
         vNodesDisconnected.clear();
+        vNodesMsgProc.clear();
         vhListenSocket.clear();
         delete semOutbound;
         semOutbound = NULL;
         delete pnodeLocalHost;
         pnodeLocalHost = NULL;
+#ifdef HAVE_SYS_EPOLL_H
+        if (hPollSocket != -1)
+            close(hPollSocket);
+        hPollSocket = -1;
+#endif
 
 #ifdef WIN32
         // Shutdown Windows Sockets
@@ -1806,13 +2244,10 @@ instance_of_cnetcleanup;
 
 void RelayTransaction(const CTransaction& tx)
 {
-    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-    ss.reserve(10000);
-    ss << tx;
-    RelayTransaction(tx, ss);
+    RelayTransaction(tx, MakeNetPayload(tx));
 }
 
-void RelayTransaction(const CTransaction& tx, const CDataStream& ss)
+void RelayTransaction(const CTransaction& tx, const CNetPayloadRef& payload)
 {
     CInv inv(MSG_TX, tx.GetHash());
     {
@@ -1824,8 +2259,9 @@ void RelayTransaction(const CTransaction& tx, const CDataStream& ss)
             vRelayExpiration.pop_front();
         }
 
-        // Save original serialized message so newer versions are preserved
-        mapRelay.insert(std::make_pair(inv, ss));
+        // Save original serialized message so newer versions are preserved,
+        // every peer that asks for it is sent this same payload
+        mapRelay.insert(std::make_pair(inv, payload));
         vRelayExpiration.push_back(std::make_pair(GetTime() + 15 * 60, inv));
     }
     LOCK(cs_vNodes);
@@ -2030,6 +2466,14 @@ CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fIn
     nRefCount = 0;
     nSendSize = 0;
     nSendOffset = 0;
+    fPollRegistered = false;
+    fPollSendInterest = false;
+    fPollRecv = false;
+    fPollSend = false;
+    fPollQueued = false;
+    fMsgProcQueued = false;
+    fMsgProcBusy = false;
+    fMsgProcWaitSend = false;
     hashContinue = 0;
     nStartingHeight = -1;
     fGetAddr = false;
@@ -2116,6 +2560,11 @@ void CNode::AbortMessage() UNLOCK_FUNCTION(cs_vSend)
 }
 
 void CNode::EndMessage() UNLOCK_FUNCTION(cs_vSend)
+{
+    EndMessage(CNetPayloadRef());
+}
+
+void CNode::EndMessage(const CNetPayloadRef& payload) UNLOCK_FUNCTION(cs_vSend)
 {
     // The -*messagestest options are intentionally not documented in the help message,
     // since they are only used during development to debug the networking code and are
@@ -2134,19 +2583,32 @@ void CNode::EndMessage() UNLOCK_FUNCTION(cs_vSend)
 
     // Set the size
     unsigned int nSize = ssSend.size() - CMessageHeader::HEADER_SIZE;
+    if (payload)
+        nSize += payload->vch.size();
     memcpy((char*)&ssSend[CMessageHeader::MESSAGE_SIZE_OFFSET], &nSize, sizeof(nSize));
 
-    // Set the checksum
-    uint256 hash = Hash(ssSend.begin() + CMessageHeader::HEADER_SIZE, ssSend.end());
+    // Set the checksum, a shared payload comes with its own
     unsigned int nChecksum = 0;
-    memcpy(&nChecksum, &hash, sizeof(nChecksum));
+    if (payload && ssSend.size() == CMessageHeader::HEADER_SIZE) {
+        nChecksum = payload->nChecksum;
+    } else {
+        CHash256 hasher;
+        if (ssSend.size() > CMessageHeader::HEADER_SIZE)
+            hasher.Write((const unsigned char*)&ssSend[CMessageHeader::HEADER_SIZE], ssSend.size() - CMessageHeader::HEADER_SIZE);
+        if (payload && !payload->vch.empty())
+            hasher.Write((const unsigned char*)&payload->vch[0], payload->vch.size());
+        uint256 hash;
+        hasher.Finalize((unsigned char*)&hash);
+        memcpy(&nChecksum, &hash, sizeof(nChecksum));
+    }
     assert(ssSend.size () >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
     memcpy((char*)&ssSend[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
 
     LogPrint("net", "(%d bytes) peer=%d\n", nSize, id);
 
-    std::deque<CSerializeData>::iterator it = vSendMsg.insert(vSendMsg.end(), CSerializeData());
-    ssSend.GetAndClear(*it);
+    std::deque<CSendMessage>::iterator it = vSendMsg.insert(vSendMsg.end(), CSendMessage());
+    ssSend.GetAndClear((*it).data);
+    (*it).payload = payload;
     nSendSize += (*it).size();
 
     // If write queue empty, attempt "optimistic write"
@@ -27,6 +27,7 @@
 
 #include <boost/filesystem/path.hpp>
 #include <boost/foreach.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/signals2/signal.hpp>
 
 class CAddrMan;
@@ -53,8 +54,54 @@ static const bool DEFAULT_UPNP = false;
 #endif
 /** The maximum number of entries in mapAskFor */
 static const size_t MAPASKFOR_MAX_SZ = MAX_INV_SZ;
+/** -msgthreads default, threads processing peer messages */
+static const int DEFAULT_MSGPROC_THREADS = 4;
+static const int MAX_MSGPROC_THREADS = 16;
 
 unsigned int ReceiveFloodSize();
+
+/** Serialized payload of a message, made once and then shared by the send
+ *  queues of every peer it goes to. Immutable, its checksum is computed
+ *  when it is made. */
+class CNetPayload
+{
+private:
+    CNetPayload(const CNetPayload&);
+    CNetPayload& operator=(const CNetPayload&);
+
+public:
+    CSerializeData vch;
+    unsigned int nChecksum;
+
+    /** Take over what was serialized into ss, leaving it empty. */
+    explicit CNetPayload(CDataStream& ss)
+    {
+        ss.GetAndClear(vch);
+        uint256 hash = Hash(vch.begin(), vch.end());
+        memcpy(&nChecksum, &hash, sizeof(nChecksum));
+    }
+};
+typedef boost::shared_ptr<const CNetPayload> CNetPayloadRef;
+
+template<typename T>
+CNetPayloadRef MakeNetPayload(const T& obj)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss.reserve(::GetSerializeSize(obj, SER_NETWORK, PROTOCOL_VERSION));
+    ss << obj;
+    return CNetPayloadRef(new CNetPayload(ss));
+}
+
+/** A message in a node's send queue: the message as serialized for that
+ *  node, or just its header when the payload is a shared one. */
+class CSendMessage
+{
+public:
+    CSerializeData data;
+    CNetPayloadRef payload;
+
+    size_t size() const { return data.size() + (payload ? payload->vch.size() : 0); }
+};
 unsigned int SendBufferSize();
 
 void AddOneShot(std::string strDest);
@@ -72,6 +119,7 @@ bool BindListenPort(const CService &bindAddr, std::string& strError, bool fWhite
 void StartNode(boost::thread_group& threadGroup);
 bool StopNode();
 void SocketSendData(CNode *pnode);
+void WakeMessageHandler(CNode *pnode);
 
 typedef int NodeId;
 
@@ -124,7 +172,7 @@ extern int nMaxConnections;
 
 extern std::vector<CNode*> vNodes;
 extern CCriticalSection cs_vNodes;
-extern std::map<CInv, CDataStream> mapRelay;
+extern std::map<CInv, CNetPayloadRef> mapRelay;
 extern std::deque<std::pair<int64_t, CInv> > vRelayExpiration;
 extern CCriticalSection cs_mapRelay;
 extern limitedmap<CInv, int64_t> mapAlreadyAskedFor;
@@ -220,8 +268,25 @@ public:
     size_t nSendSize; // total size of all vSendMsg entries
     size_t nSendOffset; // offset inside the first vSendMsg already sent
     uint64_t nSendBytes;
-    std::deque<CSerializeData> vSendMsg;
+    std::deque<CSendMessage> vSendMsg;
     CCriticalSection cs_vSend;
+    // Whether hSocket is registered with epoll, and waits for write readiness
+    // there. It only does while vSendMsg is not empty. Guarded by cs_vSend.
+    bool fPollRegistered;
+    bool fPollSendInterest;
+    // Readiness reported by epoll that the socket handler has not acted on
+    // yet, and whether the node is in its list of nodes to serve. Only used
+    // by the socket handler thread.
+    bool fPollRecv;
+    bool fPollSend;
+    bool fPollQueued;
+    // Whether the node waits in the message handler's queue and whether a
+    // message thread is serving it, guarded by that queue, and whether the
+    // handler left work until the send buffer has room again (cs_vSend).
+    // The node is not deleted while it is queued or served.
+    bool fMsgProcQueued;
+    bool fMsgProcBusy;
+    bool fMsgProcWaitSend;
 
     std::deque<CInv> vRecvGetData;
     std::deque<CNetMessage> vRecvMsg;
@@ -277,7 +342,7 @@ public:
     uint256 hashContinue;
     int nStartingHeight;
 
-    // flood relay
+    // flood relay, guarded by cs_inventory as other threads push to it
     std::vector<CAddress> vAddrToSend;
     mruset<CAddress> setAddrKnown;
     bool fGetAddr;
@@ -359,6 +424,7 @@ public:
 
     void AddAddressKnown(const CAddress& addr)
     {
+        LOCK(cs_inventory);
         setAddrKnown.insert(addr);
     }
 
@@ -367,6 +433,7 @@ public:
         // Known checking here is only to save space from duplicates.
         // SendMessages will filter it again for knowns that were added
         // after addresses were pushed.
+        LOCK(cs_inventory);
         if (addr.IsValid() && !setAddrKnown.count(addr))
             vAddrToSend.push_back(addr);
     }
@@ -387,6 +454,10 @@ public:
             if (!setInventoryKnown.count(inv))
                 vInventoryToSend.push_back(inv);
         }
+        // Announce blocks right away instead of on the next round of
+        // SendMessages
+        if (inv.type == MSG_BLOCK)
+            WakeMessageHandler(this);
     }
 
     void AskFor(const CInv& inv);
@@ -400,6 +471,10 @@ public:
     // TODO: Document the precondition of this function.  Is cs_vSend locked?
     void EndMessage() UNLOCK_FUNCTION(cs_vSend);
 
+    // Ends the message with a payload shared with other peers, after
+    // whatever was written to ssSend since BeginMessage.
+    void EndMessage(const CNetPayloadRef& payload) UNLOCK_FUNCTION(cs_vSend);
+
     void PushVersion();
 
 
@@ -417,6 +492,20 @@ public:
         }
     }
 
+    void PushMessage(const char* pszCommand, const CNetPayloadRef& payload)
+    {
+        try
+        {
+            BeginMessage(pszCommand);
+            EndMessage(payload);
+        }
+        catch (...)
+        {
+            AbortMessage();
+            throw;
+        }
+    }
+
     template<typename T1>
     void PushMessage(const char* pszCommand, const T1& a1)
     {
@@ -600,7 +689,7 @@ public:
 
 class CTransaction;
 void RelayTransaction(const CTransaction& tx);
-void RelayTransaction(const CTransaction& tx, const CDataStream& ss);
+void RelayTransaction(const CTransaction& tx, const CNetPayloadRef& payload);
 
 /** Access to the (IP) address database (peers.dat) */
 class CAddrDB
@@ -10,7 +10,34 @@
 #include "uint256.h"
 #include "util.h"
 #include "core.h"
+#include "digestset.h"
+#include "hash.h"
 #include "wallet.h"
+
+namespace {
+
+// Auxpows found valid, so a header verified during headers-first sync is
+// not verified again when its block arrives or is read back from disk.
+// Hashing the entry is cheaper than the merkle branches and parent header
+// hash it stands for. Two days of blocks many times over, ~32 bytes each.
+CDigestSet& GetAuxPowCache()
+{
+    static CDigestSet auxPowCache(50000);
+    return auxPowCache;
+}
+
+// The header hash commits to nBits and the chain ID, the rest to the auxpow
+CSHA256 GetAuxPowCacheEntry(const CBlockHeader& header)
+{
+    CHashWriter ss(SER_GETHASH, 0);
+    ss << header.GetHash() << *header.auxpow;
+    uint256 hash = ss.GetHash();
+    CSHA256 hasher = GetAuxPowCache().Hasher();
+    hasher.Write(hash.begin(), 32);
+    return hasher;
+}
+
+}
 unsigned int GetNextWorkRequired_Old(const CBlockIndex* pindexLast, const CBlockHeader *pblock)
 {
     unsigned int nProofOfWorkLimit = Params().ProofOfWorkLimit().GetCompact();
@@ -220,11 +247,15 @@ bool CBlockHeader::CheckProofOfWork(int nHeight) const {
 					"CheckProofOfWork() : block does not have our chain ID");
 
 		if (auxpow.get() != NULL) {
+			CSHA256 entry = GetAuxPowCacheEntry(*this);
+			if (GetAuxPowCache().Contains(entry))
+				return true;
 			if (!auxpow->Check(GetHash(), GetChainID()))
 				return error("CheckProofOfWork() : AUX POW is not valid");
 			// Check proof of work matches claimed amount
 			if (!::CheckProofOfWork(auxpow->GetParentBlockHash(), nBits))
 				return error("CheckProofOfWork() : AUX proof of work failed");
+			GetAuxPowCache().Insert(entry);
 		} else {
 			// Check proof of work matches claimed amount
 			if (!::CheckProofOfWork(GetHash(), nBits))
@@ -242,6 +273,30 @@ bool CBlockHeader::CheckProofOfWork(int nHeight) const {
 	}
 	return true;
 }
+bool CHeaderPoWCheck::operator()()
+{
+    return pheader->CheckProofOfWork(nHeight);
+}
+
+bool CheckProofOfWorkBatch(const std::vector<CBlockHeader>& vHeaders, int nFirstHeight, CCheckQueue<CHeaderPoWCheck>* pqueue)
+{
+    if (pqueue == NULL) {
+        for (unsigned int i = 0; i < vHeaders.size(); i++)
+            if (!vHeaders[i].CheckProofOfWork(nFirstHeight + i))
+                return false;
+        return true;
+    }
+
+    std::vector<CHeaderPoWCheck> vChecks;
+    vChecks.reserve(vHeaders.size());
+    for (unsigned int i = 0; i < vHeaders.size(); i++)
+        vChecks.push_back(CHeaderPoWCheck(vHeaders[i], nFirstHeight + i));
+
+    CCheckQueueControl<CHeaderPoWCheck> control(pqueue);
+    control.Add(vChecks);
+    return control.Wait();
+}
+
 bool CheckProofOfWork(uint256 hash, unsigned int nBits)
 {
     bool fNegative;
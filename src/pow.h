@@ -6,7 +6,11 @@
 #ifndef BITCOIN_POW_H
 #define BITCOIN_POW_H
 
+#include "checkqueue.h"
+
+#include <algorithm>
 #include <stdint.h>
+#include <vector>
 
 class CBlockHeader;
 class CBlockIndex;
@@ -21,4 +25,30 @@ void UpdateTime(CBlockHeader* block, const CBlockIndex* pindexPrev);
 
 uint256 GetProofIncrement(unsigned int nBits);
 
+/** Proof of work check of one header, including its auxpow, for a CCheckQueue.
+ *  The header must outlive the check. */
+class CHeaderPoWCheck
+{
+private:
+    const CBlockHeader* pheader;
+    int nHeight;
+
+public:
+    CHeaderPoWCheck() : pheader(NULL), nHeight(0) {}
+    CHeaderPoWCheck(const CBlockHeader& header, int nHeightIn) : pheader(&header), nHeight(nHeightIn) {}
+
+    bool operator()();
+
+    void swap(CHeaderPoWCheck& check)
+    {
+        std::swap(pheader, check.pheader);
+        std::swap(nHeight, check.nHeight);
+    }
+};
+
+/** Check the proof of work of consecutive headers, the first at nFirstHeight.
+ *  The checks are spread over the threads serving pqueue, or run on the
+ *  calling thread when it is NULL. Only one batch may use a queue at a time. */
+bool CheckProofOfWorkBatch(const std::vector<CBlockHeader>& vHeaders, int nFirstHeight, CCheckQueue<CHeaderPoWCheck>* pqueue);
+
 #endif // BITCOIN_POW_H
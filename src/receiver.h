@@ -1,8 +1,16 @@
 #ifndef RECEIVER_H
 #define RECEIVER_H
+#include <algorithm>
 #include <boost/asio.hpp>
 #include <boost/filesystem.hpp>
+#include <boost/shared_ptr.hpp>
+#include <cmath>
 #include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
 #define CURL_STATICLIB
 extern "C" {
 #include <curl/curl.h>
@@ -11,7 +19,6 @@ using namespace boost;
 using namespace std;
 
 
-static map<string, string> globalCacheMap;
 static const double globalMinimumIdenticalProportion = 0.500001;
 static const int globalStepDefault = 4000;
 static const double globalWriteNextThreshold = 0.75;
@@ -19,10 +26,10 @@ static const double globalLessThanOne = 0.95;
 static const double globalLessThanOneMinusThreshold = globalLessThanOne * (1.0 - globalWriteNextThreshold);
 
 
+int addIdenticalPage(map<string, int>& pageMap, const string& page);
 size_t curlWriteFunction(void* buf, size_t size, size_t nmemb, void* userp);
-string getCachedText(const string& fileName);
-vector<string> getCoinAddressStrings(const string& dataDirectory, const string& fileName, int height, int step=globalStepDefault);
 vector<string> getCommaDividedWords(const string& text);
+string getCommonOutputByAddresses(const vector<string>& addresses);
 string getCommonOutputByText(const string& fileName, const string& suffix=string(""));
 vector<string> getDirectoryNames(const string& directoryName);
 string getDirectoryPath(const string& fileName);
@@ -33,10 +40,10 @@ string getFileText(const string& fileName);
 string getHttpsText(const string& address);
 int getInt(const string& integerString);
 string getInternetText(const string& address);
-bool getIsSufficientAmount(vector<string> addressStrings, vector<int64_t> amounts, const string& dataDirectory, const string& fileName, int height, int64_t share, int step=globalStepDefault);
 string getJoinedPath(const string& directoryPath, const string& fileName);
 string getLocationText(const string& address);
 vector<string> getLocationTexts(vector<string> addresses);
+string getLocationTextsUntilIdentical(const vector<string>& addresses, vector<string>& pages, int minimumIdentical);
 string getLower(const string& text);
 vector<string> getPeerNames(const string& text);
 string getReplaced(const string& text, const string& searchString=string(" "), const string& replaceString=string());
@@ -54,11 +61,27 @@ vector<string> getTextLines(const string& text);
 string getTextWithoutWhitespaceByLines(vector<string> lines);
 vector<string> getTokens(const string& text=string(), const string& delimiters=string(" "));
 void makeDirectory(const string& directoryPath);
+void setHttpsOptions(CURL* curl, const string& address, std::ostream* outputStream);
 void writeFileText(const string& fileName, const string& fileText);
 void writeFileTextByDirectory(const string& directoryPath, const string& fileName, const string& fileText);
 void writeNextIfValueHigher(const string& directoryPath, const string& fileName, int height, int step, const string& stepText);
 
 
+// Add a receiver page to the map of identical pages, and return how many identical pages there are now.
+inline int addIdenticalPage(map<string, int>& pageMap, const string& page)
+{
+	string firstLine = string();
+	vector<string> lines = getTextLines(page);
+
+	if (lines.size() > 0)
+		firstLine = getLower(lines[0]);
+
+	if (!getStartsWith(firstLine, string("format")) || (firstLine.find(string("pluribusunum")) == string::npos))
+		return 0;
+
+	return ++pageMap[getTextWithoutWhitespaceByLines(lines)];
+}
+
 // Callback function writes data to a std::ostream.
 inline size_t curlWriteFunction(void* buf, size_t size, size_t nmemb, void* userp)
 {
@@ -74,72 +97,6 @@ inline size_t curlWriteFunction(void* buf, size_t size, size_t nmemb, void* user
 	return 0;
 }
 
-// Get the cached text or read it from a file.
-inline string getCachedText(const string& fileName)
-{
-	if (globalCacheMap.count(fileName) == 0)
-		globalCacheMap[fileName] = getFileText(fileName);
-
-	return globalCacheMap[fileName];
-}
-
-// Get the coin address strings for a height.
-inline vector<string> getCoinAddressStrings(const string& dataDirectory, const string& fileName, int height, int step)
-{
-	vector<string> coinList;
-	vector<vector<string> > coinLists;
-	vector<string> textLines = getTextLines(getStepOutput(dataDirectory, fileName, height, step));
-	bool isCoinSection = false;
-	string oldToken = string();
-
-	for (unsigned int lineIndex = 0; lineIndex < textLines.size(); lineIndex++)
-	{
-		string firstLowerSpaceless = string();
-		string line = textLines[lineIndex];
-		vector<string> words = getCommaDividedWords(line);
-
-		if (words.size() > 0)
-			firstLowerSpaceless = getReplaced(getLower(words[0]));
-
-		if (firstLowerSpaceless == string("coin"))
-		{
-			vector<string> coinList = getTokens(words[1], ",");
-			coinLists.push_back(coinList);
-		}
-
-		if (firstLowerSpaceless == string("_endcoins") || firstLowerSpaceless == string("_endaddresses"))
-			isCoinSection = false;
-
-		if (isCoinSection)
-		{
-			vector<string> coinList = getTokens(line, ",");
-			coinLists.push_back(coinList);
-		}
-
-		if (firstLowerSpaceless == string("_begincoins") || firstLowerSpaceless == string("_beginaddresses"))
-			isCoinSection = true;
-	}
-
-	if ((unsigned int)coinLists.size() == 0)
-	{
-		printf("Warning, no coin lists were found for the file: %s\n", fileName.c_str());
-		return getTokens();
-	}
-
-	int remainder = height - step * (height / step);
-	int modulo = remainder % (int)coinLists.size();
-
-	vector<string> originalList = coinLists[modulo];
-	for (vector<string>::iterator tokenIterator = originalList.begin(); tokenIterator != originalList.end(); tokenIterator++)
-	{
-		if (*tokenIterator != string("="))
-			oldToken = tokenIterator->substr();
-
-		coinList.push_back(oldToken);
-	}
-	return coinList;
-}
-
 // Get the words divided around the comma.
 inline vector<string> getCommaDividedWords(const string& text)
 {
@@ -157,6 +114,23 @@ inline vector<string> getCommaDividedWords(const string& text)
 	return commaDividedWords;
 }
 
+// Get the page that more than half of the addresses agree on, stopping as soon as enough identical pages are in.
+inline string getCommonOutputByAddresses(const vector<string>& addresses)
+{
+	vector<string> pages;
+	int minimumIdentical = (int)ceil(globalMinimumIdenticalProportion * (double)addresses.size());
+	string commonOutput = getLocationTextsUntilIdentical(addresses, pages, minimumIdentical);
+
+	cout << endl << "Number of pages in getCommonOutputByText: " << addresses.size() << endl;
+
+	if (commonOutput == string())
+		cout << "Insufficient identical pages in getCommonOutputByText." << endl;
+	else
+		cout << "Reached the " << minimumIdentical << " identical pages in getCommonOutputByText." << endl << endl;
+
+	return commonOutput;
+}
+
 // Get the common output according to the peers listed in a text.
 inline string getCommonOutputByText(const string& fileText, const string& suffix)
 {
@@ -171,39 +145,7 @@ inline string getCommonOutputByText(const string& fileText, const string& suffix
 	}
 
 	vector<string> peerNames = getPeerNames(fileText);
-	vector<string> pages = getLocationTexts(getSuffixedFileNames(peerNames, suffix));
-	int minimumIdentical = (int)ceil(globalMinimumIdenticalProportion * (double)pages.size());
-	map<string, int> pageMap;
-
-	for (vector<string>::iterator pageIterator = pages.begin(); pageIterator != pages.end(); pageIterator++)
-	{
-		string firstLine = string();
-		vector<string> lines = getTextLines(*pageIterator);
-		string textWithoutWhitespace = getTextWithoutWhitespaceByLines(lines);
-
-		if (lines.size() > 0)
-			firstLine = getLower(lines[0]);
-
-		if (getStartsWith(firstLine, string("format")) && (firstLine.find(string("pluribusunum")) != string::npos))
-		{
-			if (pageMap.count(textWithoutWhitespace))
-				pageMap[textWithoutWhitespace] += 1;
-			else
-				pageMap[textWithoutWhitespace] = 1;
-		}
-	}
-
-	cout << endl << "Number of pages in getCommonOutputByText: " << pages.size() << endl;
-
-	for (map<string,int>::iterator pageMapIterator = pageMap.begin(); pageMapIterator != pageMap.end(); pageMapIterator++)
-		if ((*pageMapIterator).second >= minimumIdentical)
-		{
-			cout << "Number of identical pages in getCommonOutputByText: " << (*pageMapIterator).second << endl << endl;
-			return (*pageMapIterator).first;
-		}
-
-	cout << "Insufficient identical pages in getCommonOutputByText." << endl;
-	return string();
+	return getCommonOutputByAddresses(getSuffixedFileNames(peerNames, suffix));
 }
 
 // Get the vector of directory names of the given directory.
@@ -304,16 +246,7 @@ inline string getHttpsText(const string& address)
 	{
 		CURLcode code;
 		std::ostringstream oss;
-//		curl_easy_setopt(curl, CURLOPT_VERBOSE, 1L);
-//		curl_easy_setopt(curl, CURLOPT_HEADER, 1L);
-		curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 0L);
-		curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 1L);
-		curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 0L);
-		curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0L);
-		curl_easy_setopt(curl, CURLOPT_TIMEOUT, 10L);
-		curl_easy_setopt(curl, CURLOPT_WRITEDATA, &oss);
-		curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, &curlWriteFunction);
-		curl_easy_setopt(curl, CURLOPT_URL, address.c_str());
+		setHttpsOptions(curl, address, &oss);
 		code = curl_easy_perform(curl);
 //                printf("Curl-- Response: %d\n", code);
 
@@ -346,64 +279,6 @@ inline int getInt(const string& integerString)
 	}
 }
 
-// Determine if the transactions add up to a share per address for each address.
-inline bool getIsSufficientAmount(vector<string> addressStrings, vector<int64_t> amounts, const string& dataDirectory, const string& fileName, int height, int64_t share, int step)
-{
-	vector<string> coinAddressStrings = getCoinAddressStrings(dataDirectory, fileName, height, step);
-	map<string, int64_t> receiverMap;
-
-	if (coinAddressStrings.size() == 0)
-	{
-		cout << "No coin addresses were found, there may be something wrong with the receiver_x.csv files." << endl;
-		return false;
-	}
-
-	int64_t sharePerAddress = share / (int64_t)coinAddressStrings.size();
-
-	for (unsigned int i = 0; i < coinAddressStrings.size(); i++)
-		receiverMap[coinAddressStrings[i]] = (int64_t)0;
-
-	for (unsigned int i = 0; i < addressStrings.size(); i++)
-	{
-		string addressString = addressStrings[i];
-
-		if (receiverMap.count(addressString) > 0)
-			receiverMap[addressString] += amounts[i];
-	}
-
-	for (unsigned int i = 0; i < coinAddressStrings.size(); i++)
-	{
-		if (receiverMap[coinAddressStrings[i]] < sharePerAddress)
-		{
-			cout << endl << "In receiver.h, getIsSufficientAmount rejected the addresses or amounts." << endl;
-			cout << "For the given:" << endl;
-			cout << "Height: " << height << endl;
-			cout << "Share: " << share << endl;
-			cout << "Step: " << step << endl;
-			cout << "The expected addresses are:" << endl;
-			cout << "The receiverMap shows that they should get " << receiverMap[coinAddressStrings[i]] << " coins" << endl;
-			cout << "The shares per address however are set to " << sharePerAddress << endl;
-			for (unsigned int i = 0; i < coinAddressStrings.size(); i++)
-				cout << coinAddressStrings[i] << endl;
-
-			cout << endl << "The given addresses are:" << endl;
-
-			for (unsigned int i = 0; i < addressStrings.size(); i++)
-				cout << addressStrings[i] << endl;
-
-			cout << endl << "The given amounts are:" << endl;
-
-			for (unsigned int i = 0; i < amounts.size(); i++)
-				cout << amounts[i] << endl;
-
-			cout << endl;
-			return false;
-		}
-	}
-
-	return true;
-}
-
 // Get the directory path joined with the file name.
 inline string getJoinedPath(const string& directoryPath, const string& fileName)
 {
@@ -426,12 +301,93 @@ inline vector<string> getLocationTexts(vector<string> addresses)
 {
 	vector<string> locationTexts;
 
-	for(unsigned int addressIndex = 0; addressIndex < addresses.size(); addressIndex++)
-		locationTexts.push_back(getLocationText(addresses[addressIndex]));
-
+	getLocationTextsUntilIdentical(addresses, locationTexts, 0);
 	return locationTexts;
 }
 
+// Get the pages by the addresses, downloading the hypertext addresses concurrently with the curl multi interface.
+// If minimumIdentical is positive, stop as soon as that many identical receiver pages are in and return that page.
+inline string getLocationTextsUntilIdentical(const vector<string>& addresses, vector<string>& pages, int minimumIdentical)
+{
+	map<string, int> pageMap;
+	string commonPage = string();
+	CURLM* multi = curl_multi_init();
+	vector<CURL*> handles(addresses.size(), (CURL*)NULL);
+	vector<boost::shared_ptr<ostringstream> > streams(addresses.size());
+
+	pages.assign(addresses.size(), string());
+
+	for (unsigned int addressIndex = 0; addressIndex < addresses.size() && commonPage == string(); addressIndex++)
+	{
+		const string& address = addresses[addressIndex];
+
+		if (!getStartsWith(address, string("https://")) && !getStartsWith(address, string("http://")))
+		{
+			pages[addressIndex] = getFileText(address);
+			if (minimumIdentical > 0 && addIdenticalPage(pageMap, pages[addressIndex]) >= minimumIdentical)
+				commonPage = getTextWithoutWhitespaceByLines(getTextLines(pages[addressIndex]));
+			continue;
+		}
+
+		handles[addressIndex] = curl_easy_init();
+		if (multi == NULL || handles[addressIndex] == NULL)
+			continue;
+
+		streams[addressIndex].reset(new ostringstream());
+		setHttpsOptions(handles[addressIndex], address, streams[addressIndex].get());
+		curl_multi_add_handle(multi, handles[addressIndex]);
+	}
+
+	int runningCount = 1;
+
+	while (multi != NULL && commonPage == string() && runningCount > 0)
+	{
+		if (curl_multi_perform(multi, &runningCount) != CURLM_OK)
+			break;
+
+		CURLMsg* message;
+		int queuedCount;
+
+		while ((message = curl_multi_info_read(multi, &queuedCount)) != NULL && commonPage == string())
+		{
+			if (message->msg != CURLMSG_DONE)
+				continue;
+
+			unsigned int addressIndex = find(handles.begin(), handles.end(), message->easy_handle) - handles.begin();
+			long httpCode = 0;
+
+			if (addressIndex >= handles.size() || message->data.result != CURLE_OK)
+				continue;
+
+			curl_easy_getinfo(message->easy_handle, CURLINFO_HTTP_CODE, &httpCode);
+			if (httpCode != 200)
+				continue;
+
+			pages[addressIndex] = streams[addressIndex]->str();
+			if (minimumIdentical > 0 && addIdenticalPage(pageMap, pages[addressIndex]) >= minimumIdentical)
+				commonPage = getTextWithoutWhitespaceByLines(getTextLines(pages[addressIndex]));
+		}
+
+		if (commonPage == string() && runningCount > 0)
+			curl_multi_wait(multi, NULL, 0, 1000, NULL);
+	}
+
+	for (unsigned int addressIndex = 0; addressIndex < handles.size(); addressIndex++)
+	{
+		if (handles[addressIndex] == NULL)
+			continue;
+
+		if (multi != NULL)
+			curl_multi_remove_handle(multi, handles[addressIndex]);
+		curl_easy_cleanup(handles[addressIndex]);
+	}
+
+	if (multi != NULL)
+		curl_multi_cleanup(multi);
+
+	return commonPage;
+}
+
 // Get the lowercase string.
 inline string getLower(const string& text)
 {
@@ -563,11 +519,9 @@ inline string getStepText(const string& dataDirectory, const string& fileName, i
 		return getFileText(stepFileName);
 
 	string directorySubName = getJoinedPath(dataDirectory, stepFileName);
+	// The parsed step files are cached by CReceiverSchedule, so read the text directly.
 	if (getExists(directorySubName))
-	{
-			return getCachedText(directorySubName);
-	}
-//			return getFileText(directorySubName);
+		return getFileText(directorySubName);
 	
 	string stepText = getFileText(stepFileName);
 
@@ -737,6 +691,22 @@ inline void makeDirectory(const string& directoryPath)
 		printf("Receiver.h can not make the directory %s so give it read/write permission for that directory.\n", directoryPath.c_str());
 }
 
+// Set the options shared by the single and the concurrent page downloads.
+inline void setHttpsOptions(CURL* curl, const string& address, std::ostream* outputStream)
+{
+//	curl_easy_setopt(curl, CURLOPT_VERBOSE, 1L);
+//	curl_easy_setopt(curl, CURLOPT_HEADER, 1L);
+	curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 0L);
+	curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 1L);
+	curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+	curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 0L);
+	curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0L);
+	curl_easy_setopt(curl, CURLOPT_TIMEOUT, 10L);
+	curl_easy_setopt(curl, CURLOPT_WRITEDATA, outputStream);
+	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, &curlWriteFunction);
+	curl_easy_setopt(curl, CURLOPT_URL, address.c_str());
+}
+
 // Write a text to a file.
 inline void writeFileText(const string& fileName, const string& fileText)
 {
@@ -747,12 +717,19 @@ inline void writeFileText(const string& fileName, const string& fileText)
 	}
 
 	makeDirectory(getDirectoryPath(fileName));
-	ofstream fileStream(fileName.c_str());
+
+	// Write to a temporary file then rename it, so a reader never sees a partial file.
+	string temporaryFileName = fileName + string(".tmp");
+	ofstream fileStream(temporaryFileName.c_str());
 
 	if (fileStream.is_open())
 	{
 	  fileStream << fileText;
 	  fileStream.close();
+	  boost::system::error_code errorCode;
+	  filesystem::rename(filesystem::path(temporaryFileName), filesystem::path(fileName), errorCode);
+	  if (errorCode)
+		printf("The file %s can not be renamed to %s.\n", temporaryFileName.c_str(), fileName.c_str());
 	}
 	else printf("The file %s can not be written to.\n", fileName.c_str());
 }
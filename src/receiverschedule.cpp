@@ -0,0 +1,303 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "receiverschedule.h"
+
+#include "base58.h"
+#include "core.h"
+#include "main.h"
+#include "util.h"
+
+#include <iostream>
+#include <map>
+#include <set>
+#include <sstream>
+
+#include <boost/foreach.hpp>
+
+#include "receiver.h"
+
+CReceiverSchedule receiverSchedule(receiverCSV, step);
+
+CReceiverAddress::CReceiverAddress(const std::string& strAddressIn) : strAddress(strAddressIn)
+{
+    CBitcoinAddress address(strAddress);
+    destination = address.Get();
+
+    CKeyID keyID;
+    if (address.GetKeyID(keyID))
+        scriptPubKey << OP_DUP << OP_HASH160 << ToByteVector(keyID) << OP_EQUALVERIFY << OP_CHECKSIG;
+}
+
+bool CReceiverAddress::IsValid() const
+{
+    return boost::get<CNoDestination>(&destination) == NULL;
+}
+
+// Decode a coin list, where "=" repeats the previous address of the list.
+static std::vector<CReceiverAddress> CompileCoinList(const std::vector<std::string>& vTokens)
+{
+    std::vector<CReceiverAddress> vAddresses;
+    std::string strPrevious;
+    BOOST_FOREACH(const std::string& strToken, vTokens)
+    {
+        if (strToken != "=")
+            strPrevious = strToken;
+        vAddresses.push_back(CReceiverAddress(strPrevious));
+    }
+    return vAddresses;
+}
+
+CReceiverStep::CReceiverStep(int nStepIndexIn, const std::string& strText) : nStepIndex(nStepIndexIn)
+{
+    std::vector<std::string> vLines = getTextLines(strText);
+    bool fCoinSection = false;
+
+    BOOST_FOREACH(const std::string& strLine, vLines)
+    {
+        std::vector<std::string> vWords = getCommaDividedWords(strLine);
+        std::string strFirst = vWords.empty() ? std::string() : getReplaced(getLower(vWords[0]));
+
+        if (strFirst == "coin" && vWords.size() > 1)
+            vCoinLists.push_back(CompileCoinList(getTokens(vWords[1], ",")));
+        if (strFirst == "_endcoins" || strFirst == "_endaddresses")
+            fCoinSection = false;
+        if (fCoinSection)
+            vCoinLists.push_back(CompileCoinList(getTokens(strLine, ",")));
+        if (strFirst == "_begincoins" || strFirst == "_beginaddresses")
+            fCoinSection = true;
+    }
+}
+
+const std::vector<CReceiverAddress>& CReceiverStep::GetAddresses(int nHeight, int nStep) const
+{
+    static const std::vector<CReceiverAddress> vEmpty;
+    if (vCoinLists.empty())
+        return vEmpty;
+
+    int nRemainder = nHeight - nStep * (nHeight / nStep);
+    return vCoinLists[nRemainder % vCoinLists.size()];
+}
+
+CReceiverSchedule::CReceiverSchedule(const std::string& strFileNameIn, int nStepIn) : strFileName(strFileNameIn), nStep(nStepIn), nHits(0), nMisses(0), nLastPrefetchTime(0)
+{
+}
+
+std::string CReceiverSchedule::GetDirectory() const
+{
+    return getJoinedPath(GetDataDir().string(), strFileName.substr(0, strFileName.rfind('.')));
+}
+
+std::string CReceiverSchedule::GetLocalText(int nHeight) const
+{
+    std::string strStepFileName = getStepFileName(strFileName, nHeight, nStep);
+    std::string strPath = getJoinedPath(GetDirectory(), strStepFileName);
+    if (getExists(strPath))
+        return getFileText(strPath);
+
+    // A copy shipped in the working directory, as getStepText accepts
+    return getFileText(strStepFileName);
+}
+
+void CReceiverSchedule::RequestPrefetch(int nHeight)
+{
+    boost::unique_lock<boost::mutex> lock(mutexPrefetch);
+    mapRequested.insert(std::make_pair(nHeight / nStep, nHeight));
+    condPrefetch.notify_one();
+}
+
+boost::shared_ptr<const CReceiverStep> CReceiverSchedule::GetStep(int nHeight)
+{
+    int nIndex = nHeight / nStep;
+    {
+        LOCK(cs);
+        std::map<int, boost::shared_ptr<const CReceiverStep> >::const_iterator it = mapSteps.find(nIndex);
+        if (it != mapSteps.end())
+        {
+            nHits++;
+            return it->second;
+        }
+        nMisses++;
+    }
+
+    std::string strText = GetLocalText(nHeight);
+    if (strText.empty())
+    {
+        // Do not remember a missing file, the prefetch thread will download it
+        LogPrintf("CReceiverSchedule::GetStep() : %s is not available yet\n", getStepFileName(strFileName, nHeight, nStep));
+        RequestPrefetch(nHeight);
+        return boost::shared_ptr<const CReceiverStep>(new CReceiverStep());
+    }
+
+    boost::shared_ptr<const CReceiverStep> pstep(new CReceiverStep(nIndex, strText));
+    LogPrint("receiver", "Compiled %s with %u coin lists\n", getStepFileName(strFileName, nHeight, nStep), pstep->GetCoinListCount());
+
+    LOCK(cs);
+    std::pair<std::map<int, boost::shared_ptr<const CReceiverStep> >::iterator, bool> ret = mapSteps.insert(std::make_pair(nIndex, pstep));
+
+    // Keep the new step and its neighbours, callers still holding an evicted step keep it alive
+    std::map<int, boost::shared_ptr<const CReceiverStep> >::iterator it = mapSteps.begin();
+    while (it != mapSteps.end())
+    {
+        if (it->first < nIndex - 1 || it->first > nIndex + 1)
+            mapSteps.erase(it++);
+        else
+            it++;
+    }
+    return ret.first->second;
+}
+
+bool CReceiverSchedule::Prefetch(int nHeight)
+{
+    // getStepOutput downloads any missing step files up to nHeight from the
+    // peers, and in the last part of a step writeNextIfValueHigher fetches
+    // the next file well before the chain reaches it.
+    getStepOutput(GetDataDir().string(), strFileName, nHeight, nStep);
+    {
+        LOCK(cs);
+        nLastPrefetchTime = GetTime();
+    }
+
+    bool fAvailable = false;
+    boost::unique_lock<boost::mutex> lock(mutexPrefetch);
+    std::map<int, int>::iterator it = mapRequested.begin();
+    while (it != mapRequested.end())
+    {
+        if (!GetLocalText(it->second).empty())
+        {
+            fAvailable = true;
+            mapRequested.erase(it++);
+        }
+        else
+            it++;
+    }
+    return fAvailable;
+}
+
+std::vector<int> CReceiverSchedule::WaitForRequests(int64_t nTimeoutMillis)
+{
+    boost::unique_lock<boost::mutex> lock(mutexPrefetch);
+    if (mapRequested.empty())
+        condPrefetch.timed_wait(lock, boost::posix_time::milliseconds(nTimeoutMillis));
+
+    std::vector<int> vHeights;
+    for (std::map<int, int>::const_iterator it = mapRequested.begin(); it != mapRequested.end(); it++)
+        vHeights.push_back(it->second);
+    return vHeights;
+}
+
+std::vector<CReceiverStepStatus> CReceiverSchedule::GetStatus(int nHeight) const
+{
+    std::set<int> setIndexes;
+    int nIndex = nHeight / nStep;
+    for (int i = std::max(0, nIndex - 1); i <= nIndex + 1; i++)
+        setIndexes.insert(i);
+    {
+        boost::unique_lock<boost::mutex> lock(mutexPrefetch);
+        for (std::map<int, int>::const_iterator it = mapRequested.begin(); it != mapRequested.end(); it++)
+            setIndexes.insert(it->first);
+    }
+
+    std::vector<CReceiverStepStatus> vStatus;
+    BOOST_FOREACH(int i, setIndexes)
+    {
+        CReceiverStepStatus status;
+        status.nStepIndex = i;
+        status.strFileName = getStepFileName(strFileName, i * nStep, nStep);
+        status.fOnDisk = getExists(getJoinedPath(GetDirectory(), status.strFileName));
+        {
+            LOCK(cs);
+            std::map<int, boost::shared_ptr<const CReceiverStep> >::const_iterator it = mapSteps.find(i);
+            status.fResident = it != mapSteps.end();
+            status.nCoinLists = status.fResident ? it->second->GetCoinListCount() : 0;
+        }
+        {
+            boost::unique_lock<boost::mutex> lock(mutexPrefetch);
+            status.fRequested = mapRequested.count(i) > 0;
+        }
+        vStatus.push_back(status);
+    }
+    return vStatus;
+}
+
+int64_t CReceiverSchedule::GetLastPrefetchTime() const
+{
+    LOCK(cs);
+    return nLastPrefetchTime;
+}
+
+void CReceiverSchedule::GetCacheStats(uint64_t& nHitsOut, uint64_t& nMissesOut, unsigned int& nResidentOut) const
+{
+    LOCK(cs);
+    nHitsOut = nHits;
+    nMissesOut = nMisses;
+    nResidentOut = mapSteps.size();
+}
+
+bool CReceiverSchedule::IsSufficientAmount(const CTransaction& txCoinbase, int nHeight, CAmount nShare)
+{
+    boost::shared_ptr<const CReceiverStep> pstep = GetStep(nHeight);
+    if (pstep->nStepIndex < 0)
+        return error("CReceiverSchedule::IsSufficientAmount() : waiting for the receiver file of height %d", nHeight);
+
+    const std::vector<CReceiverAddress>& vAddresses = pstep->GetAddresses(nHeight, nStep);
+    if (vAddresses.empty())
+        return error("CReceiverSchedule::IsSufficientAmount() : no coin addresses were found for height %d, there may be something wrong with the receiver_x.csv files", nHeight);
+
+    CAmount nSharePerAddress = nShare / (CAmount)vAddresses.size();
+
+    // Sum what the coinbase pays to each destination
+    std::map<CTxDestination, CAmount> mapPaid;
+    for (unsigned int i = 1; i < txCoinbase.vout.size(); i++)
+    {
+        CTxDestination destination;
+        if (ExtractDestination(txCoinbase.vout[i].scriptPubKey, destination))
+            mapPaid[destination] += txCoinbase.vout[i].nValue;
+    }
+
+    BOOST_FOREACH(const CReceiverAddress& address, vAddresses)
+    {
+        CAmount nPaid = 0;
+        if (address.IsValid() && mapPaid.count(address.destination))
+            nPaid = mapPaid[address.destination];
+        if (nPaid < nSharePerAddress)
+            return error("CReceiverSchedule::IsSufficientAmount() : %s receives %d at height %d, share per address is %d",
+                         address.strAddress, nPaid, nHeight, nSharePerAddress);
+    }
+
+    return true;
+}
+
+void ThreadReceiverPrefetch()
+{
+    // Look again every minute, so the next step file is fetched ahead of the
+    // boundary even when no lookup ever misses.
+    static const int64_t nPrefetchInterval = 60 * 1000;
+
+    while (true)
+    {
+        std::vector<int> vHeights = receiverSchedule.WaitForRequests(nPrefetchInterval);
+        {
+            LOCK(cs_main);
+            vHeights.push_back(chainActive.Height() + 1);
+            if (pindexBestHeader && pindexBestHeader->nHeight > chainActive.Height())
+                vHeights.push_back(pindexBestHeader->nHeight);
+        }
+
+        bool fAvailable = false;
+        BOOST_FOREACH(int nHeight, vHeights)
+        {
+            boost::this_thread::interruption_point();
+            if (receiverSchedule.Prefetch(nHeight))
+                fAvailable = true;
+        }
+
+        // Blocks that could not be connected for lack of the file can go now
+        if (fAvailable)
+        {
+            CValidationState state;
+            ActivateBestChain(state);
+        }
+    }
+}
@@ -0,0 +1,131 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_RECEIVERSCHEDULE_H
+#define BITCOIN_RECEIVERSCHEDULE_H
+
+#include "amount.h"
+#include "script/script.h"
+#include "script/standard.h"
+#include "sync.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+
+class CTransaction;
+
+/** A beneficiary address of a receiver file, decoded once when the file is compiled. */
+class CReceiverAddress
+{
+public:
+    std::string strAddress;
+    //! CNoDestination when the address does not decode for the current network
+    CTxDestination destination;
+    //! Pay-to-pubkey-hash script for key addresses, empty otherwise
+    CScript scriptPubKey;
+
+    explicit CReceiverAddress(const std::string& strAddressIn);
+
+    bool IsValid() const;
+};
+
+/** The coin lists of one receiver_N.csv step file, parsed once. */
+class CReceiverStep
+{
+private:
+    std::vector<std::vector<CReceiverAddress> > vCoinLists;
+
+public:
+    int nStepIndex;
+
+    CReceiverStep() : nStepIndex(-1) {}
+    CReceiverStep(int nStepIndexIn, const std::string& strText);
+
+    /** Beneficiaries for a height inside this step. Empty if the file has no coin lists. */
+    const std::vector<CReceiverAddress>& GetAddresses(int nHeight, int nStep) const;
+
+    unsigned int GetCoinListCount() const { return vCoinLists.size(); }
+};
+
+/** Availability of one step file, as reported by getreceiverstatus. */
+struct CReceiverStepStatus
+{
+    int nStepIndex;
+    std::string strFileName;
+    bool fOnDisk;
+    bool fResident;
+    unsigned int nCoinLists;
+    bool fRequested;
+};
+
+/**
+ * Height-indexed beneficiary schedule. Every step file is read and parsed
+ * once, after which looking up the beneficiaries of a height is a lookup by
+ * step index plus a modulo. This is the one process-wide cache of receiver
+ * files, shared by the validation and the miner threads; only the step of
+ * the latest lookup and its neighbours stay resident.
+ *
+ * Lookups only read step files that are already on disk. Downloading the
+ * files and reaching the peer quorum is done by ThreadReceiverPrefetch, so
+ * a slow peer never stalls validation or mining while cs_main is held.
+ */
+class CReceiverSchedule
+{
+private:
+    mutable CCriticalSection cs;
+    std::string strFileName;
+    int nStep;
+    //! Resident compiled step files, by step index (height / nStep)
+    std::map<int, boost::shared_ptr<const CReceiverStep> > mapSteps;
+    uint64_t nHits;
+    uint64_t nMisses;
+
+    //! Step files a lookup found missing, step index -> height
+    std::map<int, int> mapRequested;
+    int64_t nLastPrefetchTime;
+    mutable boost::mutex mutexPrefetch;
+    boost::condition_variable condPrefetch;
+
+    std::string GetDirectory() const;
+    std::string GetLocalText(int nHeight) const;
+    void RequestPrefetch(int nHeight);
+
+public:
+    CReceiverSchedule(const std::string& strFileNameIn, int nStepIn);
+
+    int GetStepSize() const { return nStep; }
+
+    /** Return the compiled step file covering nHeight, never NULL. If the
+     *  file is not on disk yet the returned step is empty (nStepIndex -1)
+     *  and the prefetch thread is asked to download it. */
+    boost::shared_ptr<const CReceiverStep> GetStep(int nHeight);
+
+    /** Check that a coinbase pays nShare evenly to the beneficiaries of nHeight. */
+    bool IsSufficientAmount(const CTransaction& txCoinbase, int nHeight, CAmount nShare);
+
+    /** Download the step file for nHeight, and the next one when nHeight is
+     *  close enough to the boundary. May block on the network. Returns true
+     *  if a step file a lookup was waiting for became available. */
+    bool Prefetch(int nHeight);
+
+    /** Wait until a lookup requests a step file or the timeout expires, and
+     *  return the requested heights. */
+    std::vector<int> WaitForRequests(int64_t nTimeoutMillis);
+
+    std::vector<CReceiverStepStatus> GetStatus(int nHeight) const;
+    int64_t GetLastPrefetchTime() const;
+    void GetCacheStats(uint64_t& nHitsOut, uint64_t& nMissesOut, unsigned int& nResidentOut) const;
+};
+
+extern CReceiverSchedule receiverSchedule;
+
+/** Keep the receiver step files of the active chain downloaded ahead of time. */
+void ThreadReceiverPrefetch();
+
+#endif // BITCOIN_RECEIVERSCHEDULE_H
@@ -5,8 +5,10 @@
 
 #include "checkpoints.h"
 #include "main.h"
+#include "receiverschedule.h"
 #include "rpcserver.h"
 #include "sync.h"
+#include "txdb.h"
 #include "util.h"
 #include <stdint.h>
 
@@ -362,6 +364,86 @@ Value gettxoutsetinfo(const Array& params, bool fHelp)
     return ret;
 }
 
+static Object LevelDBStatsToJSON(const CLevelDBWrapper& db, const std::vector<std::pair<std::string, char> >& vPrefixes)
+{
+    const CLevelDBProfile& profile = db.GetProfile();
+    Object objProfile;
+    objProfile.push_back(Pair("maxopenfiles", profile.nMaxOpenFiles));
+    objProfile.push_back(Pair("blockcachepercent", profile.nBlockCachePercent));
+    objProfile.push_back(Pair("blocksize", (int64_t)profile.nBlockSize));
+    objProfile.push_back(Pair("compression", profile.fCompression));
+    objProfile.push_back(Pair("verifychecksums", profile.fVerifyChecksums));
+
+    Object objSizes;
+    for (unsigned int i = 0; i < vPrefixes.size(); i++)
+        objSizes.push_back(Pair(vPrefixes[i].first, (int64_t)db.GetApproximateSize(vPrefixes[i].second)));
+
+    Array arrFiles;
+    for (int nLevel = 0; nLevel < 7; nLevel++) {
+        std::string strFiles;
+        if (!db.GetProperty(strprintf("leveldb.num-files-at-level%d", nLevel), strFiles))
+            break;
+        arrFiles.push_back(atoi(strFiles));
+    }
+
+    std::string strStats;
+    db.GetProperty("leveldb.stats", strStats);
+
+    Object ret;
+    ret.push_back(Pair("profile", objProfile));
+    ret.push_back(Pair("approximatesizes", objSizes));
+    ret.push_back(Pair("filesperlevel", arrFiles));
+    ret.push_back(Pair("stats", strStats));
+    return ret;
+}
+
+Value getleveldbstats(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getleveldbstats\n"
+            "\nReturns the settings and internal statistics of the LevelDB databases.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"chainstate\": {            (json object) The coin database\n"
+            "    \"profile\": {             (json object) The options it was opened with\n"
+            "      \"maxopenfiles\": n,     (numeric) Table files kept open\n"
+            "      \"blockcachepercent\": n, (numeric) Share of its cache used as block cache\n"
+            "      \"blocksize\": n,        (numeric) Size of the data blocks in bytes\n"
+            "      \"compression\": true|false, (boolean) Whether Snappy compression was requested\n"
+            "      \"verifychecksums\": true|false (boolean) Whether lookups verify checksums\n"
+            "    },\n"
+            "    \"approximatesizes\": {    (json object) Bytes on disk per kind of record\n"
+            "      \"coins\": n\n"
+            "    },\n"
+            "    \"filesperlevel\": [n,...], (array) Number of table files at each level\n"
+            "    \"stats\": \"text\"         (string) The leveldb.stats report\n"
+            "  },\n"
+            "  \"blockindex\": {            (json object) The block index database, with the same fields;\n"
+            "                                its approximatesizes are blockindex, blockfiles and txindex\n"
+            "  }\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getleveldbstats", "")
+            + HelpExampleRpc("getleveldbstats", "")
+        );
+
+    Object ret;
+    if (pcoinsdbview) {
+        std::vector<std::pair<std::string, char> > vPrefixes;
+        vPrefixes.push_back(std::make_pair("coins", 'c'));
+        ret.push_back(Pair("chainstate", LevelDBStatsToJSON(pcoinsdbview->GetDB(), vPrefixes)));
+    }
+    if (pblocktree) {
+        std::vector<std::pair<std::string, char> > vPrefixes;
+        vPrefixes.push_back(std::make_pair("blockindex", 'b'));
+        vPrefixes.push_back(std::make_pair("blockfiles", 'f'));
+        vPrefixes.push_back(std::make_pair("txindex", 't'));
+        ret.push_back(Pair("blockindex", LevelDBStatsToJSON(*pblocktree, vPrefixes)));
+    }
+    return ret;
+}
+
 Value gettxout(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() < 2 || params.size() > 3)
@@ -591,3 +673,68 @@ Value getmempoolinfo(const Array& params, bool fHelp)
     return ret;
 }
 
+Value getreceiverstatus(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getreceiverstatus\n"
+            "\nReturns which receiver step files are ready for validation and mining.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"height\": xxxx,             (numeric) height of the next block\n"
+            "  \"step\": xxxx,               (numeric) number of blocks covered by one step file\n"
+            "  \"lastprefetch\": xxxx,       (numeric) time of the last prefetch round, 0 if none\n"
+            "  \"cachehits\": xxxx,          (numeric) lookups answered by a parsed step file in memory\n"
+            "  \"cachemisses\": xxxx,        (numeric) lookups that had to read and parse a step file\n"
+            "  \"resident\": n,              (numeric) parsed step files in memory\n"
+            "  \"files\": [\n"
+            "    {\n"
+            "      \"index\": n,              (numeric) step index, height / step\n"
+            "      \"file\": \"name\",          (string) file name\n"
+            "      \"ondisk\": true|false,    (boolean) whether the file has been downloaded\n"
+            "      \"resident\": true|false,  (boolean) whether the parsed file is in the cache\n"
+            "      \"coinlists\": n,          (numeric) number of coin lists in the file\n"
+            "      \"requested\": true|false  (boolean) whether a lookup is waiting for the file\n"
+            "    }, ...\n"
+            "  ]\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getreceiverstatus", "")
+            + HelpExampleRpc("getreceiverstatus", "")
+        );
+
+    int nHeight;
+    {
+        LOCK(cs_main);
+        nHeight = chainActive.Height() + 1;
+    }
+
+    Array files;
+    BOOST_FOREACH(const CReceiverStepStatus& status, receiverSchedule.GetStatus(nHeight))
+    {
+        Object obj;
+        obj.push_back(Pair("index", status.nStepIndex));
+        obj.push_back(Pair("file", status.strFileName));
+        obj.push_back(Pair("ondisk", status.fOnDisk));
+        obj.push_back(Pair("resident", status.fResident));
+        obj.push_back(Pair("coinlists", (int)status.nCoinLists));
+        obj.push_back(Pair("requested", status.fRequested));
+        files.push_back(obj);
+    }
+
+    Object ret;
+    ret.push_back(Pair("height", nHeight));
+    ret.push_back(Pair("step", receiverSchedule.GetStepSize()));
+    ret.push_back(Pair("lastprefetch", receiverSchedule.GetLastPrefetchTime()));
+
+    uint64_t nHits, nMisses;
+    unsigned int nResident;
+    receiverSchedule.GetCacheStats(nHits, nMisses, nResident);
+    ret.push_back(Pair("cachehits", nHits));
+    ret.push_back(Pair("cachemisses", nMisses));
+    ret.push_back(Pair("resident", (int)nResident));
+    ret.push_back(Pair("files", files));
+
+    return ret;
+}
+
@@ -6,11 +6,13 @@
 #include "chainparams.h"
 #include "core_io.h"
 #include "init.h"
+#include "lrucache.h"
 #include "net.h"
 #include "main.h"
 #include "miner.h"
 #include "pow.h"
 #include "rpcserver.h"
+#include "ui_interface.h"
 #include "util.h"
 #include "miner.cpp"
 #ifdef ENABLE_WALLET
@@ -20,6 +22,7 @@
 
 #include <stdint.h>
 
+#include <boost/algorithm/string/replace.hpp>
 #include <boost/assign/list_of.hpp>
 
 #include "json/json_spirit_utils.h"
@@ -32,6 +35,14 @@ using namespace std;
 // Allocated in InitRPCMining, free'd in ShutdownRPCMining
 static CReserveKey* pMiningKey = NULL;
 
+// Runs -auxblocknotify for new tips, it uses the key of the aux block cache.
+// Started in InitRPCMining, joined in ShutdownRPCMining before the key is free'd
+static boost::thread* pAuxNotifyThread = NULL;
+
+static void SetAuxBlockWallet(CWallet* pwallet);
+static void ThreadAuxBlockNotify();
+static void AuxBlockNotifyCallback(const uint256& hashNewTip);
+
 void InitRPCMining()
 {
     if (!pwalletMain)
@@ -39,6 +50,14 @@ void InitRPCMining()
 
     // getwork/getblocktemplate mining rewards paid here:
     pMiningKey = new CReserveKey(pwalletMain);
+    // getauxblock and -auxblocknotify mining rewards paid to a key of their own:
+    SetAuxBlockWallet(pwalletMain);
+
+    if (mapArgs.count("-auxblocknotify"))
+    {
+        pAuxNotifyThread = new boost::thread(ThreadAuxBlockNotify);
+        uiInterface.NotifyBlockTip.connect(AuxBlockNotifyCallback);
+    }
 }
 
 void ShutdownRPCMining()
@@ -46,6 +65,14 @@ void ShutdownRPCMining()
     if (!pMiningKey)
         return;
 
+    uiInterface.NotifyBlockTip.disconnect(AuxBlockNotifyCallback);
+    if (pAuxNotifyThread)
+    {
+        pAuxNotifyThread->interrupt();
+        pAuxNotifyThread->join();
+        delete pAuxNotifyThread; pAuxNotifyThread = NULL;
+    }
+    SetAuxBlockWallet(NULL);
     delete pMiningKey; pMiningKey = NULL;
 }
 #else
@@ -356,11 +383,44 @@ void FormatHashBuffers(CBlock* pblock, char* pmidstate, char* pdata, char* phash
     memcpy(pdata, &tmp.block, 128);
     memcpy(phash1, &tmp.hash1, 64);
 }
+// The work a long poll waits on: <hashBestChain><nTransactionsUpdatedLast>
+static std::string LongPollId(const uint256& hashBestChain, unsigned int nTransactionsUpdated)
+{
+    return hashBestChain.GetHex() + i64tostr(nTransactionsUpdated);
+}
+
+// Wait until either the best block changes, OR a minute has passed and there
+// are more transactions than in the work of strLongPollId. Callers must not
+// hold cs_main.
+static void WaitForNewWork(const std::string& strLongPollId)
+{
+    uint256 hashWatchedChain;
+    hashWatchedChain.SetHex(strLongPollId.substr(0, 64));
+    unsigned int nTransactionsUpdatedLastLP = atoi64(strLongPollId.substr(std::min(strLongPollId.size(), (size_t)64)));
+
+    boost::system_time checktxtime = boost::get_system_time() + boost::posix_time::minutes(1);
+
+    boost::unique_lock<boost::mutex> lock(csBestBlock);
+    while (chainActive.Tip()->GetBlockHash() == hashWatchedChain && IsRPCRunning())
+    {
+        if (!cvBlockChange.timed_wait(lock, checktxtime))
+        {
+            // Timeout: Check transactions for update
+            if (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLastLP)
+                break;
+            checktxtime += boost::posix_time::seconds(10);
+        }
+    }
+
+    if (!IsRPCRunning())
+        throw JSONRPCError(RPC_CLIENT_NOT_CONNECTED, "Shutting down");
+}
+
 Value getworkaux(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() < 1)
 		throw runtime_error(
-            "getworkaux <aux>\n"
+            "getworkaux <aux> [longpollid]\n"
             "getworkaux '' <data>\n"
             "getworkaux 'submit' <data>\n"
             "getworkaux '' <data> <chain-index> <branch>*\n"
@@ -373,6 +433,8 @@ Value getworkaux(const Array& params, bool fHelp)
             "  \"data\" : block data\n"
             "  \"hash1\" : formatted hash buffer for second hash\n"
             "  \"target\" : little endian hash target\n"
+            "  \"longpollid\" : id to wait on for new work\n"
+            "If [longpollid] is specified, waits until the best block changes, or a minute has passed and there are more transactions, before returning work.\n"
             "If <data> is specified and 'submit', tries to solve the block for this (parent) chain and returns true if it was successful."
             "If <data> is specified and empty first argument, returns the aux merkle root, with size and nonce."
             "If <data> and <chain-index> are specified, creates an auxiliary proof of work for the chain specified and returns:\n"
@@ -390,12 +452,41 @@ Value getworkaux(const Array& params, bool fHelp)
     static mapNewBlock_t mapNewBlock;    // FIXME: thread safety
     static vector<CBlockTemplate*> vNewBlockTemplate;
 
-    if (params.size() == 1)
+    if (params.size() == 1 || (params.size() == 2 && params[0].get_str() != "submit" && params[0].get_str() != ""))
    {
         static vector<unsigned char> vchAuxPrev;
         vector<unsigned char> vchAux = ParseHex(params[0].get_str());
-        // Update block
         static unsigned int nTransactionsUpdatedLast;
+
+        if (params.size() == 2)
+        {
+            // Release the wallet and main lock while waiting
+#ifdef ENABLE_WALLET
+            if(pwalletMain)
+                LEAVE_CRITICAL_SECTION(pwalletMain->cs_wallet);
+#endif
+            LEAVE_CRITICAL_SECTION(cs_main);
+            try
+            {
+                WaitForNewWork(params[1].get_str());
+            }
+            catch (...)
+            {
+                ENTER_CRITICAL_SECTION(cs_main);
+#ifdef ENABLE_WALLET
+                if(pwalletMain)
+                    ENTER_CRITICAL_SECTION(pwalletMain->cs_wallet);
+#endif
+                throw;
+            }
+            ENTER_CRITICAL_SECTION(cs_main);
+#ifdef ENABLE_WALLET
+            if(pwalletMain)
+                ENTER_CRITICAL_SECTION(pwalletMain->cs_wallet);
+#endif
+        }
+
+        // Update block
         static CBlockIndex* pindexPrev;
         static int64_t nStart;
         static CBlockTemplate* pblocktemplate;
@@ -457,6 +548,7 @@ Value getworkaux(const Array& params, bool fHelp)
         result.push_back(Pair("data",     HexStr(BEGIN(pdata), END(pdata))));
         result.push_back(Pair("hash1",    HexStr(BEGIN(phash1), END(phash1)))); // deprecated
         result.push_back(Pair("target",   HexStr(BEGIN(hashTarget), END(hashTarget))));
+        result.push_back(Pair("longpollid", LongPollId(pindexPrev->GetBlockHash(), nTransactionsUpdatedLast)));
         return result;
     }
     else
@@ -542,13 +634,218 @@ Value getworkaux(const Array& params, bool fHelp)
     }
 }
 
+/** Blocks handed out by getauxblock, by the hash merged miners work on.
+ *  Polls are answered from the current block until the tip changes, or the
+ *  mempool changed and the block is older than nRefreshInterval seconds. A
+ *  single caller builds the next block while the others keep getting the
+ *  current one. Earlier blocks of the tip stay available for submission,
+ *  up to nMaxBlocks of them. */
+class CAuxBlockCache
+{
+private:
+    static const int64_t nRefreshInterval = 60;
+
+    mutable CCriticalSection cs;
+    lrucache<uint256, boost::shared_ptr<CBlockTemplate> > cacheBlocks;
+    boost::shared_ptr<CBlockTemplate> pcurrent;
+    CBlockIndex* pindexPrev;
+    unsigned int nTransactionsUpdatedLast;
+    int64_t nStart;
+    bool fBuilding;
+    unsigned int nExtraNonce;
+
+    //! Serializes the use of the key, by builders and submitters. It is
+    //! not pMiningKey, whose users are serialized by cs_main instead.
+    CCriticalSection cs_key;
+    CReserveKey* pkey;
+
+public:
+    CAuxBlockCache(size_t nMaxBlocks) : cacheBlocks(nMaxBlocks), pindexPrev(NULL), nTransactionsUpdatedLast(0), nStart(0), fBuilding(false), nExtraNonce(0), pkey(NULL) {}
+
+    /** Pay the blocks to a key of pwallet, or stop handing out blocks if it is NULL. */
+    void SetWallet(CWallet* pwallet)
+    {
+        LOCK(cs_key);
+        delete pkey;
+        pkey = pwallet ? new CReserveKey(pwallet) : NULL;
+    }
+
+    /** The block polls should work on, built when there is no up to date one.
+     *  nTransactionsUpdatedRet is set to the mempool state the block was built from. */
+    boost::shared_ptr<const CBlockTemplate> GetCurrent(unsigned int& nTransactionsUpdatedRet)
+    {
+        CBlockIndex* pindexTip;
+        {
+            LOCK(cs_main);
+            pindexTip = chainActive.Tip();
+        }
+        unsigned int nTransactionsUpdated = mempool.GetTransactionsUpdated();
+
+        {
+            LOCK(cs);
+            if (pindexPrev != pindexTip)
+            {
+                // Blocks of an old tip can not be accepted anymore
+                cacheBlocks.clear();
+                pcurrent.reset();
+                pindexPrev = NULL;
+            }
+            bool fStale = nTransactionsUpdated != nTransactionsUpdatedLast && GetTime() - nStart > nRefreshInterval;
+            if (pcurrent && (!fStale || fBuilding))
+            {
+                nTransactionsUpdatedRet = nTransactionsUpdatedLast;
+                return pcurrent;
+            }
+            fBuilding = true;
+        }
+
+        // Builders are serialized up to the update of the cache, so the last
+        // one to build, on the tip of its moment, sets the current block
+        LOCK(cs_key);
+        boost::shared_ptr<CBlockTemplate> pblocktemplate;
+        try
+        {
+            if (!pkey)
+                throw JSONRPCError(RPC_METHOD_NOT_FOUND, "Method not found (disabled)");
+            LOCK(cs_main);
+            // The tip may have moved since the check above
+            pindexTip = chainActive.Tip();
+            nTransactionsUpdated = mempool.GetTransactionsUpdated();
+            pblocktemplate.reset(CreateNewBlockWithKey(*pkey));
+            if (pblocktemplate)
+            {
+                CBlock* pblock = &pblocktemplate->block;
+                UpdateTime(pblock, pindexTip);
+                pblock->nNonce = 0;
+                IncrementExtraNonce(pblock, pindexTip, nExtraNonce);
+                // Sets the version
+                pblock->SetAuxPow(new CAuxPow());
+            }
+        }
+        catch (...)
+        {
+            LOCK(cs);
+            fBuilding = false;
+            throw;
+        }
+
+        {
+            LOCK(cs);
+            fBuilding = false;
+            if (!pblocktemplate)
+                throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
+            if (pindexPrev != pindexTip)
+                cacheBlocks.clear();
+            pindexPrev = pindexTip;
+            nTransactionsUpdatedLast = nTransactionsUpdated;
+            nStart = GetTime();
+            pcurrent = pblocktemplate;
+            // Every block handed out can be submitted
+            cacheBlocks.insert(pblocktemplate->block.GetHash(), pblocktemplate);
+        }
+        nTransactionsUpdatedRet = nTransactionsUpdated;
+        return pblocktemplate;
+    }
+
+    /** A block handed out earlier, or NULL when it is unknown or obsolete. */
+    boost::shared_ptr<const CBlockTemplate> Find(const uint256& hash)
+    {
+        LOCK(cs);
+        boost::shared_ptr<CBlockTemplate> pblocktemplate;
+        cacheBlocks.get(hash, pblocktemplate);
+        return pblocktemplate;
+    }
+
+    /** Submit a solved copy of a block handed out earlier. */
+    bool Submit(CBlock& block, CWallet& wallet)
+    {
+        LOCK(cs_key);
+        if (!pkey || !ProcessBlockFound(&block, wallet, *pkey))
+            return false;
+        {
+            LOCK(cs);
+            cacheBlocks.erase(block.GetHash());
+        }
+        return true;
+    }
+};
+
+static CAuxBlockCache auxBlockCache(16);
+
+static void SetAuxBlockWallet(CWallet* pwallet)
+{
+    auxBlockCache.SetWallet(pwallet);
+}
+
+static boost::mutex mutexAuxNotify;
+static boost::condition_variable condAuxNotify;
+static bool fAuxNotifyPending = false;
+
+static void AuxBlockNotify()
+{
+    // The node may have fallen behind again since the tip was notified
+    if (IsInitialBlockDownload())
+        return;
+
+    try
+    {
+        unsigned int nTransactionsUpdated;
+        boost::shared_ptr<const CBlockTemplate> pblocktemplate = auxBlockCache.GetCurrent(nTransactionsUpdated);
+        uint256 hashTarget;
+        hashTarget.SetCompact(pblocktemplate->block.nBits);
+
+        std::string strCmd = GetArg("-auxblocknotify", "");
+        boost::replace_all(strCmd, "%s", pblocktemplate->block.GetHash().GetHex());
+        boost::replace_all(strCmd, "%t", HexStr(BEGIN(hashTarget), END(hashTarget)));
+        runCommand(strCmd);
+    }
+    catch (std::exception& e)
+    {
+        PrintExceptionContinue(&e, "AuxBlockNotify()");
+    }
+    catch (...)
+    {
+        PrintExceptionContinue(NULL, "AuxBlockNotify()");
+    }
+}
+
+// Tips that come in while the command runs are notified once, after it
+static void ThreadAuxBlockNotify()
+{
+    RenameThread("bitcoin-auxnotify");
+    while (true)
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutexAuxNotify);
+            while (!fAuxNotifyPending)
+                condAuxNotify.wait(lock);
+            fAuxNotifyPending = false;
+        }
+        AuxBlockNotify();
+        boost::this_thread::interruption_point();
+    }
+}
+
+static void AuxBlockNotifyCallback(const uint256& hashNewTip)
+{
+    // No work is handed out while catching up, as getauxblock does
+    if (IsInitialBlockDownload())
+        return;
+
+    boost::lock_guard<boost::mutex> lock(mutexAuxNotify);
+    fAuxNotifyPending = true;
+    condAuxNotify.notify_one();
+}
+
 Value getauxblock(const Array& params, bool fHelp)
 {
-    if (fHelp || (params.size() != 0 && params.size() != 2))
+    if (fHelp || params.size() > 2)
         throw runtime_error(
-            "getauxblock [<hash> <auxpow>]\n"
+            "getauxblock [<hash> <auxpow>] | [longpollid]\n"
             " create a new block"
             "If <hash>, <auxpow> is not specified, returns a new block hash.\n"
+            "If [longpollid] is specified, waits until the best block changes, or a minute has passed "
+            "and there are more transactions, before returning the block hash.\n"
             "If <hash>, <auxpow> is specified, tries to solve the block based on "
             "the aux proof of work and returns true if it was successful.");
     if (vNodes.empty())
@@ -557,65 +854,22 @@ Value getauxblock(const Array& params, bool fHelp)
     if (IsInitialBlockDownload())
         throw JSONRPCError(RPC_CLIENT_IN_INITIAL_DOWNLOAD, "Bitcoin is downloading blocks...");
 
-    static map<uint256, CBlock*> mapNewBlock;
-    static vector<CBlockTemplate*> vNewBlockTemplate;
-    if (params.size() == 0)
+    if (params.size() < 2)
     {
-        // Update block
-        static unsigned int nTransactionsUpdatedLast;
-        static CBlockIndex* pindexPrev;
-        static int64_t nStart;
-		static CBlock* pblock;
-        static CBlockTemplate* pblocktemplate;
-		if (pindexPrev != chainActive.Tip() ||
-            (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLast && GetTime() - nStart > 60))
-        {
-            if (pindexPrev != chainActive.Tip())
-            {
-                // Deallocate old blocks since they're obsolete now
-                mapNewBlock.clear();
-                BOOST_FOREACH(CBlockTemplate* pblocktemplate, vNewBlockTemplate)
-                    delete pblocktemplate;
-                vNewBlockTemplate.clear();
-            }
-			// Clear pindexPrev so future getworks make a new block, despite any failures from here on
-            pindexPrev = NULL;
-            // Store the pindexBest used before CreateNewBlock, to avoid races
-            nTransactionsUpdatedLast = mempool.GetTransactionsUpdated();
-            CBlockIndex* pindexPrevNew = chainActive.Tip();
+        if (params.size() == 1)
+            WaitForNewWork(params[0].get_str());
 
-            nStart = GetTime();
-            // Create new block with nonce = 0 and extraNonce = 1
-            pblocktemplate = CreateNewBlockWithKey(*pMiningKey);
-            if (!pblocktemplate)
-                throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
-
-			pblock = &pblocktemplate->block;
-            // Update nTime
-            UpdateTime(pblock, pindexPrev);
-            pblock->nNonce = 0;
-			// Need to update only after we know CreateNewBlock succeeded
-            pindexPrev = pindexPrevNew;
-    
-			static unsigned int nExtraNonce = 0;
-            IncrementExtraNonce(pblock, pindexPrev, nExtraNonce);
-
-			CAuxPow *blockAuxPow = new CAuxPow();
-            // Sets the version
-            pblock->SetAuxPow(blockAuxPow);
+        unsigned int nTransactionsUpdated;
+        boost::shared_ptr<const CBlockTemplate> pblocktemplate = auxBlockCache.GetCurrent(nTransactionsUpdated);
+        const CBlock& block = pblocktemplate->block;
 
-            // Save
-            mapNewBlock[pblock->GetHash()] = pblock;
-
-            vNewBlockTemplate.push_back(pblocktemplate);
-
-        }
         uint256 hashTarget;
-		hashTarget.SetCompact(pblock->nBits);
+        hashTarget.SetCompact(block.nBits);
         Object result;
         result.push_back(Pair("target",   HexStr(BEGIN(hashTarget), END(hashTarget))));
-        result.push_back(Pair("hash", pblock->GetHash().GetHex()));
-        result.push_back(Pair("chainid", pblock->GetChainID()));
+        result.push_back(Pair("hash", block.GetHash().GetHex()));
+        result.push_back(Pair("chainid", block.GetChainID()));
+        result.push_back(Pair("longpollid", LongPollId(block.hashPrevBlock, nTransactionsUpdated)));
         return result;
     }
     else
@@ -626,19 +880,18 @@ Value getauxblock(const Array& params, bool fHelp)
         CDataStream ss(vchAuxPow, SER_GETHASH, PROTOCOL_VERSION);
         CAuxPow* pow = new CAuxPow();
         ss >> *pow;
-        if (!mapNewBlock.count(hash))
-            return ::error("getauxblock() : block not found");
 
-        CBlock* pblock = mapNewBlock[hash];
-        pblock->SetAuxPow(pow);
-        if (!ProcessBlockFound(pblock, *pwalletMain, *pMiningKey))
-        {
-            return false;
-        }
-        else
+        boost::shared_ptr<const CBlockTemplate> pblocktemplate = auxBlockCache.Find(hash);
+        if (!pblocktemplate)
         {
-            return true;
+            delete pow;
+            return ::error("getauxblock() : block not found");
         }
+
+        // Solve a copy, the cached block may be submitted again by other miners
+        CBlock block(pblocktemplate->block);
+        block.SetAuxPow(pow);
+        return auxBlockCache.Submit(block, *pwalletMain);
     }
 }
 Value buildmerkletree(const Array& params, bool fHelp)
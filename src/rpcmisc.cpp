@@ -4,12 +4,15 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "base58.h"
+#include "blockfilereader.h"
 #include "init.h"
 #include "main.h"
 #include "net.h"
 #include "netbase.h"
 #include "rpcserver.h"
+#include "script/sigcache.h"
 #include "timedata.h"
+#include "txdb.h"
 #include "util.h"
 #ifdef ENABLE_WALLET
 #include "wallet.h"
@@ -63,6 +66,27 @@ Value getinfo(const Array& params, bool fHelp)
             "  \"unlocked_until\": ttt,      (numeric) the timestamp in seconds since epoch (midnight Jan 1 1970 GMT) that the wallet is unlocked for transfers, or 0 if the wallet is locked\n"
             "  \"paytxfee\": x.xxxx,         (numeric) the transaction fee set in btc/kb\n"
             "  \"relayfee\": x.xxxx,         (numeric) minimum relay fee for non-free transactions in btc/kb\n"
+            "  \"auxpowcache\": {            (json object) the in-memory auxpow cache used to serve headers\n"
+            "     \"size\": xxxx,              (numeric) number of cached auxpows\n"
+            "     \"maxsize\": xxxx,           (numeric) the -auxpowcache limit\n"
+            "     \"hits\": xxxx,              (numeric) auxpows served from memory\n"
+            "     \"misses\": xxxx,            (numeric) auxpows read from the block index database\n"
+            "     \"blockfilereads\": xxxx,    (numeric) auxpows not kept in the block index, read from a block file\n"
+            "     \"hitrate\": x.xxxx          (numeric) hits / (hits + misses)\n"
+            "  },\n"
+            "  \"blockfiles\": {             (json object) the memory mapped block files blocks are read from\n"
+            "     \"mapped\": xxxx,            (numeric) number of block files mapped now\n"
+            "     \"maxmapped\": xxxx,         (numeric) the -mapblockfiles limit\n"
+            "     \"reads\": xxxx,             (numeric) blocks and headers read from a mapping\n"
+            "     \"maps\": xxxx               (numeric) times a block file was (re)mapped\n"
+            "  },\n"
+            "  \"sigcache\": {               (json object) the cache of verified signatures\n"
+            "     \"size\": xxxx,              (numeric) number of cached signatures\n"
+            "     \"maxsize\": xxxx,           (numeric) number of entries, -maxsigcachesize rounded up to a power of two\n"
+            "     \"hits\": xxxx,              (numeric) signatures found in the cache\n"
+            "     \"misses\": xxxx,            (numeric) signatures that had to be verified\n"
+            "     \"hitrate\": x.xxxx          (numeric) hits / (hits + misses)\n"
+            "  },\n"
             "  \"errors\": \"...\"           (string) any error messages\n"
             "}\n"
             "\nExamples:\n"
@@ -98,6 +122,41 @@ Value getinfo(const Array& params, bool fHelp)
     obj.push_back(Pair("paytxfee",      ValueFromAmount(payTxFee.GetFeePerK())));
 #endif
     obj.push_back(Pair("relayfee",      ValueFromAmount(::minRelayTxFee.GetFeePerK())));
+    if (pblocktree) {
+        uint64_t nHits, nMisses, nBlockFileReads;
+        unsigned int nEntries, nMaxEntries;
+        pblocktree->GetAuxPowCacheStats(nHits, nMisses, nBlockFileReads, nEntries, nMaxEntries);
+        Object auxpowcache;
+        auxpowcache.push_back(Pair("size",    (int)nEntries));
+        auxpowcache.push_back(Pair("maxsize", (int)nMaxEntries));
+        auxpowcache.push_back(Pair("hits",    (uint64_t)nHits));
+        auxpowcache.push_back(Pair("misses",  (uint64_t)nMisses));
+        auxpowcache.push_back(Pair("blockfilereads", (uint64_t)nBlockFileReads));
+        auxpowcache.push_back(Pair("hitrate", nHits + nMisses > 0 ? (double)nHits / (nHits + nMisses) : 0.0));
+        obj.push_back(Pair("auxpowcache", auxpowcache));
+    }
+    {
+        uint64_t nReads, nMaps;
+        unsigned int nMapped, nMaxMapped;
+        blockFileReader.GetStats(nReads, nMaps, nMapped, nMaxMapped);
+        Object blockfiles;
+        blockfiles.push_back(Pair("mapped",    (int)nMapped));
+        blockfiles.push_back(Pair("maxmapped", (int)nMaxMapped));
+        blockfiles.push_back(Pair("reads",     (uint64_t)nReads));
+        blockfiles.push_back(Pair("maps",      (uint64_t)nMaps));
+        obj.push_back(Pair("blockfiles", blockfiles));
+    }
+    {
+        uint64_t nHits, nMisses, nEntries, nMaxEntries;
+        GetSignatureCacheStats(nHits, nMisses, nEntries, nMaxEntries);
+        Object sigcache;
+        sigcache.push_back(Pair("size",    (uint64_t)nEntries));
+        sigcache.push_back(Pair("maxsize", (uint64_t)nMaxEntries));
+        sigcache.push_back(Pair("hits",    (uint64_t)nHits));
+        sigcache.push_back(Pair("misses",  (uint64_t)nMisses));
+        sigcache.push_back(Pair("hitrate", nHits + nMisses > 0 ? (double)nHits / (nHits + nMisses) : 0.0));
+        obj.push_back(Pair("sigcache", sigcache));
+    }
     obj.push_back(Pair("errors",        GetWarnings("statusbar")));
     return obj;
 }
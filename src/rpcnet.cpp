@@ -336,7 +336,13 @@ Value getnettotals(const Array& params, bool fHelp)
             "{\n"
             "  \"totalbytesrecv\": n,   (numeric) Total bytes received\n"
             "  \"totalbytessent\": n,   (numeric) Total bytes sent\n"
-            "  \"timemillis\": t        (numeric) Total cpu time\n"
+            "  \"timemillis\": t,       (numeric) Total cpu time\n"
+            "  \"blockcache\": {        (json object) Recent blocks kept in memory for getdata requests\n"
+            "    \"size\": n,           (numeric) Blocks in the cache\n"
+            "    \"maxsize\": n,        (numeric) Most blocks it keeps\n"
+            "    \"hits\": n,           (numeric) Blocks sent from the cache\n"
+            "    \"misses\": n          (numeric) Blocks read from disk to be sent\n"
+            "  }\n"
             "}\n"
             "\nExamples:\n"
             + HelpExampleCli("getnettotals", "")
@@ -347,6 +353,17 @@ Value getnettotals(const Array& params, bool fHelp)
     obj.push_back(Pair("totalbytesrecv", CNode::GetTotalBytesRecv()));
     obj.push_back(Pair("totalbytessent", CNode::GetTotalBytesSent()));
     obj.push_back(Pair("timemillis", GetTimeMillis()));
+    {
+        uint64_t nHits, nMisses;
+        unsigned int nEntries, nMaxEntries;
+        GetServedBlockCacheStats(nHits, nMisses, nEntries, nMaxEntries);
+        Object blockcache;
+        blockcache.push_back(Pair("size",    (int)nEntries));
+        blockcache.push_back(Pair("maxsize", (int)nMaxEntries));
+        blockcache.push_back(Pair("hits",    (uint64_t)nHits));
+        blockcache.push_back(Pair("misses",  (uint64_t)nMisses));
+        obj.push_back(Pair("blockcache", blockcache));
+    }
     return obj;
 }
 
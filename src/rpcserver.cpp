@@ -257,7 +257,9 @@ static const CRPCCommand vRPCCommands[] =
     { "blockchain",         "getblockhash",           &getblockhash,           true,      false,      false },
     { "blockchain",         "getchaintips",           &getchaintips,           true,      false,      false },
     { "blockchain",         "getdifficulty",          &getdifficulty,          true,      false,      false },
+    { "blockchain",         "getleveldbstats",        &getleveldbstats,        true,      false,      false },
     { "blockchain",         "getmempoolinfo",         &getmempoolinfo,         true,      true,       false },
+    { "blockchain",         "getreceiverstatus",      &getreceiverstatus,      true,      true,       false },
     { "blockchain",         "getrawmempool",          &getrawmempool,          true,      false,      false },
     { "blockchain",         "gettxout",               &gettxout,               true,      false,      false },
     { "blockchain",         "gettxoutsetinfo",        &gettxoutsetinfo,        true,      false,      false },
@@ -270,7 +272,7 @@ static const CRPCCommand vRPCCommands[] =
     { "mining",             "prioritisetransaction",  &prioritisetransaction,  true,      false,      false },
     { "mining",             "submitblock",            &submitblock,            true,      true,       false },
 	{ "mining",             "getworkaux",             &getworkaux,             true,      false,	  false },
-	{ "mining",             "getauxblock",            &getauxblock,            true,      false,	  false },
+	{ "mining",             "getauxblock",            &getauxblock,            true,      true, 	  false },
     { "mining",             "buildmerkletree",        &buildmerkletree,        false,     false,	  false },
 
 #ifdef ENABLE_WALLET
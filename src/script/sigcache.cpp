@@ -6,75 +6,55 @@
 #include "sigcache.h"
 
 #include "key.h"
-#include "random.h"
 #include "uint256.h"
 #include "util.h"
 
-#include <boost/thread.hpp>
-#include <boost/tuple/tuple_comparison.hpp>
+CSHA256 CSignatureCache::Hasher(const uint256& hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey) const
+{
+    CSHA256 hasher = setValid.Hasher();
+    hasher.Write(hash.begin(), 32).Write(pubKey.begin(), pubKey.size());
+    if (!vchSig.empty())
+        hasher.Write(&vchSig[0], vchSig.size());
+    return hasher;
+}
+
+bool CSignatureCache::Get(const uint256& hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
+{
+    return setValid.Contains(Hasher(hash, vchSig, pubKey));
+}
+
+void CSignatureCache::Set(const uint256& hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
+{
+    setValid.Insert(Hasher(hash, vchSig, pubKey));
+}
+
+void CSignatureCache::GetStats(uint64_t& nHits, uint64_t& nMisses, uint64_t& nEntries, uint64_t& nMaxEntries) const
+{
+    setValid.GetStats(nHits, nMisses, nEntries, nMaxEntries);
+}
 
 namespace {
 
 // Valid signature cache, to avoid doing expensive ECDSA signature checking
 // twice for every transaction (once when accepted into memory pool, and
 // again when accepted into the block chain)
-class CSignatureCache
+CSignatureCache& GetSignatureCache()
 {
-private:
-     // sigdata_type is (signature hash, signature, public key):
-    typedef boost::tuple<uint256, std::vector<unsigned char>, CPubKey> sigdata_type;
-    std::set< sigdata_type> setValid;
-    boost::shared_mutex cs_sigcache;
-
-public:
-    bool
-    Get(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
-    {
-        boost::shared_lock<boost::shared_mutex> lock(cs_sigcache);
-
-        sigdata_type k(hash, vchSig, pubKey);
-        std::set<sigdata_type>::iterator mi = setValid.find(k);
-        if (mi != setValid.end())
-            return true;
-        return false;
-    }
-
-    void Set(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
-    {
-        // DoS prevention: limit cache size to less than 10MB
-        // (~200 bytes per cache entry times 50,000 entries)
-        // Since there are a maximum of 20,000 signature operations per block
-        // 50,000 is a reasonable default.
-        int64_t nMaxCacheSize = GetArg("-maxsigcachesize", 50000);
-        if (nMaxCacheSize <= 0) return;
-
-        boost::unique_lock<boost::shared_mutex> lock(cs_sigcache);
-
-        while (static_cast<int64_t>(setValid.size()) > nMaxCacheSize)
-        {
-            // Evict a random entry. Random because that helps
-            // foil would-be DoS attackers who might try to pre-generate
-            // and re-use a set of valid signatures just-slightly-greater
-            // than our cache size.
-            uint256 randomHash = GetRandHash();
-            std::vector<unsigned char> unused;
-            std::set<sigdata_type>::iterator it =
-                setValid.lower_bound(sigdata_type(randomHash, unused, unused));
-            if (it == setValid.end())
-                it = setValid.begin();
-            setValid.erase(*it);
-        }
+    // DoS prevention: the size is fixed at the first use, ~32 bytes per entry
+    static CSignatureCache signatureCache(std::max((int64_t)0, GetArg("-maxsigcachesize", DEFAULT_MAX_SIG_CACHE_SIZE)));
+    return signatureCache;
+}
 
-        sigdata_type k(hash, vchSig, pubKey);
-        setValid.insert(k);
-    }
-};
+}
 
+void GetSignatureCacheStats(uint64_t& nHits, uint64_t& nMisses, uint64_t& nEntries, uint64_t& nMaxEntries)
+{
+    GetSignatureCache().GetStats(nHits, nMisses, nEntries, nMaxEntries);
 }
 
 bool CachingSignatureChecker::VerifySignature(const std::vector<unsigned char>& vchSig, const CPubKey& pubkey, const uint256& sighash) const
 {
-    static CSignatureCache signatureCache;
+    CSignatureCache& signatureCache = GetSignatureCache();
 
     if (signatureCache.Get(sighash, vchSig, pubkey))
         return true;
@@ -6,12 +6,38 @@
 #ifndef H_BITCOIN_SCRIPT_SIGCACHE
 #define H_BITCOIN_SCRIPT_SIGCACHE
 
+#include "digestset.h"
 #include "script/interpreter.h"
 
 #include <vector>
 
 class CPubKey;
 
+/** Default for -maxsigcachesize, the number of entries of the signature cache. */
+static const unsigned int DEFAULT_MAX_SIG_CACHE_SIZE = 50000;
+
+/** Valid signatures, by a salted SHA-256 of (signature hash, signature, public key). */
+class CSignatureCache
+{
+private:
+    CDigestSet setValid;
+
+    CSHA256 Hasher(const uint256& hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey) const;
+
+public:
+    /** A cache of at least nMaxEntries entries, rounded up to a power of two. 0 disables it. */
+    CSignatureCache(size_t nMaxEntries) : setValid(nMaxEntries) {}
+
+    bool Get(const uint256& hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey);
+    void Set(const uint256& hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey);
+
+    /** Lookups that found a signature or not, the number of stored signatures and of entries. */
+    void GetStats(uint64_t& nHits, uint64_t& nMisses, uint64_t& nEntries, uint64_t& nMaxEntries) const;
+};
+
+/** The statistics of the cache used by CachingSignatureChecker. */
+void GetSignatureCacheStats(uint64_t& nHits, uint64_t& nMisses, uint64_t& nEntries, uint64_t& nMaxEntries);
+
 class CachingSignatureChecker : public SignatureChecker
 {
 private:
@@ -82,6 +82,9 @@ enum
     SER_NETWORK         = (1 << 0),
     SER_DISK            = (1 << 1),
     SER_GETHASH         = (1 << 2),
+
+    // modifiers
+    SER_BLOCKHEADERONLY = (1 << 17),
 };
 
 #define READWRITE(obj)      (::SerReadWrite(s, (obj), nType, nVersion, ser_action))
@@ -1136,11 +1139,81 @@ public:
     }
 
     void GetAndClear(CSerializeData &data) {
-        data.insert(data.end(), begin(), end());
+        if (data.empty() && nReadPos == 0)
+            vch.swap(data); // hand the buffer over instead of copying it
+        else
+            data.insert(data.end(), begin(), end());
         clear();
     }
 };
 
+/** Read-only stream over memory owned by someone else, such as a LevelDB
+ *  slice or a mapped block file. Unserializes in place without copying the
+ *  buffer, which has to outlive the stream.
+ */
+class CSpanStream
+{
+protected:
+    const char* pbegin;
+    const char* pend;
+
+public:
+    int nType;
+    int nVersion;
+
+    typedef size_t size_type;
+
+    CSpanStream(const char* pbeginIn, const char* pendIn, int nTypeIn, int nVersionIn) :
+        pbegin(pbeginIn), pend(pendIn), nType(nTypeIn), nVersion(nVersionIn) {}
+
+    //
+    // Vector subset
+    //
+    const char* begin() const    { return pbegin; }
+    const char* end() const      { return pend; }
+    size_type size() const       { return pend - pbegin; }
+    bool empty() const           { return pbegin == pend; }
+    std::string str() const      { return std::string(pbegin, pend); }
+
+    //
+    // Stream subset
+    //
+    bool eof() const             { return empty(); }
+    int in_avail()               { return size(); }
+
+    void SetType(int n)          { nType = n; }
+    int GetType()                { return nType; }
+    void SetVersion(int n)       { nVersion = n; }
+    int GetVersion()             { return nVersion; }
+    void ReadVersion()           { *this >> nVersion; }
+
+    CSpanStream& read(char* pch, size_t nSize)
+    {
+        if (nSize > size())
+            throw std::ios_base::failure("CSpanStream::read() : end of data");
+        memcpy(pch, pbegin, nSize);
+        pbegin += nSize;
+        return (*this);
+    }
+
+    CSpanStream& ignore(int nSize)
+    {
+        assert(nSize >= 0);
+        if ((size_t)nSize > size())
+            throw std::ios_base::failure("CSpanStream::ignore() : end of data");
+        pbegin += nSize;
+        return (*this);
+    }
+
+    template<typename T>
+    CSpanStream& operator>>(T& obj)
+    {
+        // Unserialize from this stream
+        ::Unserialize(*this, obj, nType, nVersion);
+        return (*this);
+    }
+};
+
 
 
 
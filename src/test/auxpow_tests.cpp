@@ -0,0 +1,234 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "chain.h"
+#include "chainparams.h"
+#include "core.h"
+#include "pow.h"
+#include "random.h"
+#include "serialize.h"
+#include "util.h"
+#include "utilstrencodings.h"
+#include "version.h"
+
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+using namespace std;
+
+static boost::shared_ptr<CAuxPow> MakeAuxPow()
+{
+    CMutableTransaction txCoinbase;
+    txCoinbase.vin.resize(1);
+    txCoinbase.vin[0].scriptSig = CScript() << 486604799 << ParseHex("fabe6d6d");
+    txCoinbase.vout.resize(1);
+    txCoinbase.vout[0].nValue = 25 * COIN;
+    txCoinbase.vout[0].scriptPubKey = CScript() << OP_TRUE;
+
+    boost::shared_ptr<CAuxPow> auxpow(new CAuxPow(txCoinbase));
+    for (int i = 0; i < 6; i++)
+        auxpow->vMerkleBranch.push_back(uint256(1000 + i));
+    auxpow->nIndex = 0;
+    for (int i = 0; i < 3; i++)
+        auxpow->vChainMerkleBranch.push_back(uint256(2000 + i));
+    auxpow->nChainIndex = 5;
+    auxpow->parentBlockHeader.nVersion = 2;
+    auxpow->parentBlockHeader.hashPrevBlock = uint256(3000);
+    auxpow->parentBlockHeader.hashMerkleRoot = uint256(3001);
+    auxpow->parentBlockHeader.nTime = 1400000000;
+    auxpow->parentBlockHeader.nBits = 0x1d00ffff;
+    auxpow->parentBlockHeader.nNonce = 42;
+    auxpow->hashBlock = auxpow->GetParentBlockHash();
+    return auxpow;
+}
+
+static std::string Serialized(const CAuxPow& auxpow)
+{
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << auxpow;
+    return ss.str();
+}
+
+// A merged mined header with a valid auxpow under the regtest params
+static CBlockHeader MakeAuxPowHeader(int n)
+{
+    CBlockHeader header;
+    header.nVersion = BLOCK_VERSION_DEFAULT | BLOCK_VERSION_AUXPOW | (GetOurChainID() * BLOCK_VERSION_CHAIN_START);
+    header.hashPrevBlock = uint256(n);
+    header.nTime = 1400000000 + n;
+    header.nBits = 0x207fffff;
+
+    std::vector<uint256> vChainMerkleBranch;
+    for (int i = 0; i < 3; i++)
+        vChainMerkleBranch.push_back(GetRandHash());
+    int nNonce = n;
+    unsigned int rand = nNonce;
+    rand = rand * 1103515245 + 12345;
+    rand += GetOurChainID();
+    rand = rand * 1103515245 + 12345;
+    int nSize = 1 << vChainMerkleBranch.size();
+    int nChainIndex = rand % nSize;
+
+    // Chain merkle root, tree size and nonce after the merged mining header
+    uint256 hashRoot = CBlock::CheckMerkleBranch(header.GetHash(), vChainMerkleBranch, nChainIndex);
+    std::vector<unsigned char> vchAux = ParseHex("fabe6d6d");
+    std::vector<unsigned char> vchRoot(hashRoot.begin(), hashRoot.end());
+    std::reverse(vchRoot.begin(), vchRoot.end());
+    vchAux.insert(vchAux.end(), vchRoot.begin(), vchRoot.end());
+    vchAux.insert(vchAux.end(), (unsigned char*)&nSize, (unsigned char*)&nSize + 4);
+    vchAux.insert(vchAux.end(), (unsigned char*)&nNonce, (unsigned char*)&nNonce + 4);
+
+    CMutableTransaction txCoinbase;
+    txCoinbase.vin.resize(1);
+    txCoinbase.vin[0].scriptSig = CScript() << vchAux;
+    txCoinbase.vout.resize(1);
+    txCoinbase.vout[0].nValue = 25 * COIN;
+
+    boost::shared_ptr<CAuxPow> auxpow(new CAuxPow(txCoinbase));
+    auxpow->vChainMerkleBranch = vChainMerkleBranch;
+    auxpow->nChainIndex = nChainIndex;
+    for (int i = 0; i < 10; i++)
+        auxpow->vMerkleBranch.push_back(GetRandHash());
+    auxpow->nIndex = 0;
+
+    auxpow->parentBlockHeader.nVersion = 2;
+    auxpow->parentBlockHeader.hashMerkleRoot = CBlock::CheckMerkleBranch(auxpow->GetHash(), auxpow->vMerkleBranch, 0);
+    auxpow->parentBlockHeader.nTime = header.nTime;
+    auxpow->parentBlockHeader.nBits = header.nBits;
+    while (!CheckProofOfWork(auxpow->GetParentBlockHash(), header.nBits))
+        auxpow->parentBlockHeader.nNonce++;
+    auxpow->hashBlock = auxpow->GetParentBlockHash();
+
+    header.auxpow = auxpow;
+    return header;
+}
+
+BOOST_AUTO_TEST_SUITE(auxpow_tests)
+
+BOOST_AUTO_TEST_CASE(auxpow_compact_roundtrip)
+{
+    boost::shared_ptr<CAuxPow> auxpow = MakeAuxPow();
+
+    // hashBlock as the parent block hash, null, and anything else
+    for (int i = 0; i < 3; i++) {
+        if (i == 1)
+            auxpow->hashBlock = 0;
+        if (i == 2)
+            auxpow->hashBlock = uint256(4000);
+
+        CDataStream ss(SER_DISK, CLIENT_VERSION);
+        ss << CCompactAuxPow(*auxpow);
+        BOOST_CHECK(ss.size() < Serialized(*auxpow).size() || i == 2);
+
+        CAuxPow auxpowRead;
+        ss >> REF(CCompactAuxPow(auxpowRead));
+        BOOST_CHECK(ss.empty());
+        BOOST_CHECK(Serialized(auxpowRead) == Serialized(*auxpow));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(diskblockindex_upgrade)
+{
+    boost::shared_ptr<CAuxPow> auxpow = MakeAuxPow();
+    CBlockIndex index;
+    index.nHeight = 30000;
+    index.nVersion = BLOCK_VERSION_DEFAULT | BLOCK_VERSION_AUXPOW | (GetOurChainID() * BLOCK_VERSION_CHAIN_START);
+    index.hashMerkleRoot = uint256(5000);
+    index.nTime = 1400000100;
+    index.nBits = 0x1d00ffff;
+
+    // A row as written before the compact encoding
+    CDataStream ssLegacy(SER_DISK, CLIENT_VERSION);
+    ssLegacy << VARINT(CLIENT_VERSION) << VARINT(index.nHeight) << VARINT(index.nTx);
+    ssLegacy << index.nVersion << uint256(0) << index.hashMerkleRoot << index.nTime << index.nBits << index.nNonce;
+    ssLegacy << *auxpow;
+
+    CDiskBlockIndex legacy;
+    CDataStream(ssLegacy) >> legacy;
+    BOOST_CHECK_EQUAL(legacy.nAuxPowFormat, CDiskBlockIndex::AUXPOW_LEGACY);
+    BOOST_CHECK(legacy.auxpow && Serialized(*legacy.auxpow) == Serialized(*auxpow));
+
+    CDiskBlockIndex headerOnly;
+    CDataStream(ssLegacy.begin(), ssLegacy.end(), SER_DISK | SER_BLOCKHEADERONLY, CLIENT_VERSION) >> headerOnly;
+    BOOST_CHECK_EQUAL(headerOnly.nAuxPowFormat, CDiskBlockIndex::AUXPOW_LEGACY);
+    BOOST_CHECK(!headerOnly.auxpow);
+    BOOST_CHECK(headerOnly.CalcBlockHash() == legacy.CalcBlockHash());
+
+    // Rewritten before the block is stored, the auxpow stays in the row
+    CDataStream ssInline(SER_DISK, CLIENT_VERSION);
+    ssInline << CDiskBlockIndex(&index, legacy.auxpow);
+    BOOST_CHECK(ssInline.size() < ssLegacy.size());
+    CDiskBlockIndex compact;
+    ssInline >> compact;
+    BOOST_CHECK_EQUAL(compact.nAuxPowFormat, CDiskBlockIndex::AUXPOW_INLINE);
+    BOOST_CHECK(compact.auxpow && Serialized(*compact.auxpow) == Serialized(*auxpow));
+    BOOST_CHECK(compact.CalcBlockHash() == legacy.CalcBlockHash());
+
+    // A stored block above the last checkpoint keeps it in the row
+    index.nStatus = BLOCK_HAVE_DATA;
+    index.nFile = 7;
+    index.nDataPos = 123456;
+    CDataStream ssRecent(SER_DISK, CLIENT_VERSION);
+    ssRecent << CDiskBlockIndex(&index, legacy.auxpow);
+    CDiskBlockIndex recent;
+    ssRecent >> recent;
+    BOOST_CHECK_EQUAL(recent.nAuxPowFormat, CDiskBlockIndex::AUXPOW_INLINE);
+    BOOST_CHECK(recent.auxpow && Serialized(*recent.auxpow) == Serialized(*auxpow));
+
+    // Below it, only the position of the stored block is kept
+    CDataStream ssStored(SER_DISK, CLIENT_VERSION);
+    ssStored << CDiskBlockIndex(&index, boost::shared_ptr<CAuxPow>());
+    BOOST_CHECK(ssStored.size() < 100);
+    CDiskBlockIndex stored;
+    ssStored >> stored;
+    BOOST_CHECK_EQUAL(stored.nAuxPowFormat, CDiskBlockIndex::AUXPOW_IN_BLOCK_FILE);
+    BOOST_CHECK(!stored.auxpow);
+    BOOST_CHECK_EQUAL(stored.nFile, 7);
+    BOOST_CHECK_EQUAL(stored.nDataPos, 123456U);
+    BOOST_CHECK(stored.CalcBlockHash() == legacy.CalcBlockHash());
+}
+
+BOOST_AUTO_TEST_CASE(auxpow_check_batch)
+{
+    static const int nHeaders = 2000;
+    static const int nFirstHeight = 30000;
+    SelectParams(CBaseChainParams::REGTEST);
+
+    // Two sets, so the serial run does not warm the auxpow cache for the parallel one
+    std::vector<CBlockHeader> vSerial, vParallel;
+    for (int i = 0; i < nHeaders; i++) {
+        vSerial.push_back(MakeAuxPowHeader(i));
+        vParallel.push_back(MakeAuxPowHeader(nHeaders + i));
+    }
+
+    BOOST_CHECK(CheckProofOfWorkBatch(vSerial, nFirstHeight, NULL));
+
+    int nThreads = std::max(2, (int)boost::thread::hardware_concurrency());
+    CCheckQueue<CHeaderPoWCheck> queue(16);
+    boost::thread_group threads;
+    for (int i = 0; i < nThreads - 1; i++)
+        threads.create_thread(boost::bind(&CCheckQueue<CHeaderPoWCheck>::Thread, &queue));
+    BOOST_CHECK(CheckProofOfWorkBatch(vParallel, nFirstHeight, &queue));
+
+    // A broken auxpow fails the whole batch, either way
+    std::vector<CBlockHeader> vBroken(vParallel.begin(), vParallel.begin() + 100);
+    vBroken.push_back(MakeAuxPowHeader(2 * nHeaders));
+    vBroken.back().auxpow->parentBlockHeader.hashMerkleRoot = 0;
+    BOOST_CHECK(!CheckProofOfWorkBatch(vBroken, nFirstHeight, NULL));
+    BOOST_CHECK(!CheckProofOfWorkBatch(vBroken, nFirstHeight, &queue));
+
+    threads.interrupt_all();
+    threads.join_all();
+
+    // Both sets were cached: their regtest nBits are out of range on main,
+    // so only a header that is checked again fails there
+    std::vector<CBlockHeader> vUncached(1, MakeAuxPowHeader(3 * nHeaders));
+    SelectParams(CBaseChainParams::MAIN);
+    BOOST_CHECK(CheckProofOfWorkBatch(vSerial, nFirstHeight, NULL));
+    BOOST_CHECK(CheckProofOfWorkBatch(vParallel, nFirstHeight, NULL));
+    BOOST_CHECK(!CheckProofOfWorkBatch(vUncached, nFirstHeight, NULL));
+    SelectParams(CBaseChainParams::UNITTEST);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
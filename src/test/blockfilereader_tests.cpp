@@ -0,0 +1,106 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockfilereader.h"
+
+#include "chainparams.h"
+#include "core.h"
+#include "main.h"
+#include "serialize.h"
+#include "util.h"
+
+#include <stdio.h>
+
+#include <boost/filesystem.hpp>
+#include <boost/test/unit_test.hpp>
+
+static CBlock MakeBlock(int n)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].scriptSig = CScript() << n << OP_0;
+    tx.vout.resize(1 + n);
+    for (int i = 0; i <= n; i++) {
+        tx.vout[i].nValue = i;
+        tx.vout[i].scriptPubKey = CScript() << OP_TRUE;
+    }
+    CBlock block;
+    block.nTime = 1400000000 + n;
+    block.vtx.push_back(tx);
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    return block;
+}
+
+// Append a block the way WriteBlockToDisk does, returning its position
+static CDiskBlockPos AppendBlock(int nFile, const CBlock& block)
+{
+    CAutoFile file(fopen(GetBlockPosFilename(CDiskBlockPos(nFile, 0), "blk").string().c_str(), "ab"), SER_DISK, CLIENT_VERSION);
+    BOOST_REQUIRE(!file.IsNull());
+    fseek(file.Get(), 0, SEEK_END);
+    file << FLATDATA(Params().MessageStart()) << (unsigned int)file.GetSerializeSize(block);
+    CDiskBlockPos pos(nFile, ftell(file.Get()));
+    file << block;
+    return pos;
+}
+
+BOOST_AUTO_TEST_SUITE(blockfilereader_tests)
+
+BOOST_AUTO_TEST_CASE(blockfilereader_read)
+{
+    // A file number the test chain does not use
+    static const int nFile = 4242;
+    boost::filesystem::path path = GetBlockPosFilename(CDiskBlockPos(nFile, 0), "blk");
+    boost::filesystem::create_directories(path.parent_path());
+    boost::filesystem::remove(path);
+
+    CBlockFileReader reader(2);
+    std::vector<CDiskBlockPos> vPos;
+    for (int i = 0; i < 3; i++)
+        vPos.push_back(AppendBlock(nFile, MakeBlock(i)));
+
+    // Not mapped while blocks may still be appended to the file
+    CBlock block;
+    reader.SetWriteFile(nFile);
+    BOOST_CHECK(!reader.Read(vPos[0], block));
+
+    reader.SetWriteFile(nFile + 1);
+    for (int i = 0; i < 3; i++) {
+        BOOST_CHECK(reader.Read(vPos[i], block));
+        BOOST_CHECK(block.GetHash() == MakeBlock(i).GetHash());
+        BOOST_CHECK(block.vtx.size() == 1 && block.vtx[0].GetHash() == MakeBlock(i).vtx[0].GetHash());
+    }
+    {
+        CSequentialBlockReads sequential;
+        CBlockHeader header;
+        BOOST_CHECK(reader.Read(vPos[2], header));
+        BOOST_CHECK(header.GetHash() == MakeBlock(2).GetHash());
+    }
+    uint64_t nReads, nMaps;
+    unsigned int nMapped, nMaxMapped;
+    reader.GetStats(nReads, nMaps, nMapped, nMaxMapped);
+    BOOST_CHECK_EQUAL(nReads, 4U);
+    BOOST_CHECK_EQUAL(nMaps, 1U);
+    BOOST_CHECK_EQUAL(nMapped, 1U);
+    BOOST_CHECK_EQUAL(nMaxMapped, 2U);
+
+    // Going back to writing the file, as a reindex does, drops its mapping
+    reader.SetWriteFile(nFile);
+    reader.GetStats(nReads, nMaps, nMapped, nMaxMapped);
+    BOOST_CHECK_EQUAL(nMapped, 0U);
+    reader.SetWriteFile(nFile + 2);
+
+    // Positions without a block behind them are left to the stdio reader
+    BOOST_CHECK(!reader.Read(CDiskBlockPos(nFile + 1, 8), block));
+    BOOST_CHECK(!reader.Read(CDiskBlockPos(nFile, vPos[2].nPos + 100000), block));
+
+    // So is everything when no file may be mapped
+    reader.SetMaxFiles(0);
+    BOOST_CHECK(!reader.Read(vPos[0], block));
+    reader.GetStats(nReads, nMaps, nMapped, nMaxMapped);
+    BOOST_CHECK_EQUAL(nMapped, 0U);
+
+    boost::filesystem::remove(path);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -4,12 +4,16 @@
 
 #include "coins.h"
 #include "random.h"
+#include "txdb.h"
 #include "uint256.h"
 
 #include <vector>
 #include <map>
 
+#include <boost/bind.hpp>
+#include <boost/foreach.hpp>
 #include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
 
 namespace
 {
@@ -58,6 +62,29 @@ public:
 
     bool GetStats(CCoinsStats& stats) const { return false; }
 };
+
+class CCoinsViewCacheTest : public CCoinsViewCache
+{
+public:
+    CCoinsViewCacheTest(CCoinsView* base) : CCoinsViewCache(base) {}
+
+    void SelfTest() const
+    {
+        // Manually recompute the dynamic usage of the whole data, and compare it.
+        size_t ret = cacheCoins.DynamicMemoryUsage();
+        for (CCoinsMap::const_iterator it = cacheCoins.begin(); it != cacheCoins.end(); it++) {
+            ret += it->second.coins.DynamicMemoryUsage();
+        }
+        BOOST_CHECK_EQUAL(DynamicMemoryUsage(), ret);
+    }
+};
+
+class CCoinsKeyHasherTest
+{
+public:
+    // A poor hash, so probe sequences run into each other
+    size_t operator()(const uint256& key) const { return key.GetLow64() % 7; }
+};
 }
 
 BOOST_AUTO_TEST_SUITE(coins_tests)
@@ -89,8 +116,8 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
 
     // The cache stack.
     CCoinsViewTest base; // A CCoinsViewTest at the bottom.
-    std::vector<CCoinsViewCache*> stack; // A stack of CCoinsViewCaches on top.
-    stack.push_back(new CCoinsViewCache(&base)); // Start with one cache.
+    std::vector<CCoinsViewCacheTest*> stack; // A stack of CCoinsViewCaches on top.
+    stack.push_back(new CCoinsViewCacheTest(&base)); // Start with one cache.
 
     // Use a limited set of random transaction ids, so we do test overwriting entries.
     std::vector<uint256> txids;
@@ -115,6 +142,7 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
                 coins.nVersion = insecure_rand();
                 coins.vout.resize(1);
                 coins.vout[0].nValue = insecure_rand();
+                coins.vout[0].scriptPubKey.resize(insecure_rand() % 64);
                 *entry = coins;
             } else {
                 coins.Clear();
@@ -135,6 +163,9 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
                     missed_an_entry = true;
                 }
             }
+            BOOST_FOREACH(const CCoinsViewCacheTest *test, stack) {
+                test->SelfTest();
+            }
         }
 
         if (insecure_rand() % 100 == 0) {
@@ -151,7 +182,7 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
                 } else {
                     removed_all_caches = true;
                 }
-                stack.push_back(new CCoinsViewCache(tip));
+                stack.push_back(new CCoinsViewCacheTest(tip));
                 if (stack.size() == 4) {
                     reached_4_caches = true;
                 }
@@ -175,4 +206,152 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
     BOOST_CHECK(missed_an_entry);
 }
 
+// Read a mix of present and missing txids through the reader threads.
+BOOST_AUTO_TEST_CASE(coins_prefetch_test)
+{
+    CCoinsViewTest base;
+    CCoinsViewCacheTest parent(&base);
+    std::vector<uint256> txids;
+    for (int i = 0; i < 200; i++) {
+        txids.push_back(GetRandHash());
+        if (i % 2 == 0) {
+            CCoinsModifier coins = parent.ModifyCoins(txids.back());
+            coins->nVersion = 1;
+            coins->vout.resize(1 + i % 5);
+            coins->vout.back().nValue = i;
+            coins->vout.back().scriptPubKey.resize(25);
+        }
+    }
+    parent.Flush();
+
+    CCheckQueue<CCoinsReadCheck> queue(8);
+    boost::thread_group threads;
+    for (int i = 0; i < 3; i++)
+        threads.create_thread(boost::bind(&CCheckQueue<CCoinsReadCheck>::Thread, &queue));
+
+    CCoinsViewCacheTest cache(&base);
+    cache.AccessCoins(txids[0]);
+    BOOST_CHECK_EQUAL(cache.Prefetch(txids, &queue), 99U);
+    BOOST_CHECK_EQUAL(cache.Prefetch(txids, NULL), 0U);
+    cache.SelfTest();
+    for (unsigned int i = 0; i < txids.size(); i++) {
+        BOOST_CHECK_EQUAL(cache.HaveCoinsInCache(txids[i]), i % 2 == 0);
+        CCoins coins;
+        BOOST_CHECK_EQUAL(base.GetCoins(txids[i], coins), i % 2 == 0);
+        if (i % 2 == 0)
+            BOOST_CHECK(*cache.AccessCoins(txids[i]) == coins);
+    }
+
+    threads.interrupt_all();
+    threads.join_all();
+}
+
+// Flush through the background flusher of the coin database, in shards.
+BOOST_AUTO_TEST_CASE(coins_db_flush_test)
+{
+    // Committed right away, then in the background on four threads
+    for (int nFlushThreads = 0; nFlushThreads <= 4; nFlushThreads += 4) {
+        CCoinsViewDB db(1 << 20, true, true);
+        if (nFlushThreads)
+            db.StartFlusher(nFlushThreads);
+        std::vector<uint256> txids;
+        {
+            CCoinsViewCache cache(&db);
+            for (int i = 0; i < 10000; i++) {
+                txids.push_back(GetRandHash());
+                CCoinsModifier coins = cache.ModifyCoins(txids.back());
+                coins->nVersion = 1;
+                coins->nHeight = i;
+                coins->vout.resize(1);
+                coins->vout[0].nValue = i;
+            }
+            cache.SetBestBlock(uint256(1));
+            BOOST_CHECK(cache.Flush());
+        }
+
+        // Readers see the entries before and after they are committed
+        for (int nPass = 0; nPass < 2; nPass++) {
+            BOOST_CHECK(db.GetBestBlock() == uint256(1));
+            for (unsigned int i = 0; i < txids.size(); i += 97) {
+                CCoins coins;
+                BOOST_CHECK(db.GetCoins(txids[i], coins));
+                BOOST_CHECK_EQUAL(coins.nHeight, (int)i);
+            }
+            BOOST_CHECK(db.Sync());
+        }
+        BOOST_CHECK_EQUAL(db.FlushingMemoryUsage(), 0U);
+
+        // Spent entries are erased
+        {
+            CCoinsViewCache cache(&db);
+            for (unsigned int i = 0; i < txids.size(); i += 2)
+                cache.ModifyCoins(txids[i])->Clear();
+            cache.SetBestBlock(uint256(2));
+            BOOST_CHECK(cache.Flush());
+        }
+        db.StopFlusher();
+        BOOST_CHECK(db.GetBestBlock() == uint256(2));
+        for (unsigned int i = 0; i < 100; i++)
+            BOOST_CHECK_EQUAL(db.HaveCoins(txids[i]), i % 2 == 1);
+    }
+}
+
+// Exercise the flat table with a hasher that makes every key collide with
+// others, against a std::map holding the same elements.
+BOOST_AUTO_TEST_CASE(coins_map_test)
+{
+    flatmap<uint256, int, CCoinsKeyHasherTest> map;
+    std::map<uint256, int> expected;
+
+    // References survive the table growing
+    std::vector<uint256> keys;
+    for (int i = 0; i < 1000; i++)
+        keys.push_back(GetRandHash());
+    int& first = map[keys[0]];
+    first = 42;
+    for (unsigned int i = 0; i < keys.size(); i++) {
+        BOOST_CHECK(map.insert(std::make_pair(keys[i], (int)i)).second == (i != 0));
+        expected[keys[i]] = i;
+    }
+    BOOST_CHECK_EQUAL(first, 42);
+    expected[keys[0]] = 42;
+
+    // An iterator taken before an insertion can still be erased
+    uint256 keyErased = keys[1];
+    flatmap<uint256, int, CCoinsKeyHasherTest>::iterator itOld = map.find(keyErased);
+    for (int i = 0; i < 1000; i++) {
+        uint256 key = GetRandHash();
+        map[key] = -i;
+        expected[key] = -i;
+    }
+    map.erase(itOld);
+    expected.erase(keyErased);
+    BOOST_CHECK(map.find(keyErased) == map.end());
+
+    // Random erases leave deleted slots in the probe sequences
+    for (int i = 0; i < 500; i++) {
+        uint256 key = keys[insecure_rand() % keys.size()];
+        BOOST_CHECK_EQUAL(map.erase(key), expected.erase(key));
+    }
+    BOOST_CHECK_EQUAL(map.size(), expected.size());
+    for (std::map<uint256, int>::const_iterator it = expected.begin(); it != expected.end(); it++) {
+        BOOST_CHECK(map.count(it->first));
+        BOOST_CHECK_EQUAL(map[it->first], it->second);
+    }
+    BOOST_CHECK(map.DynamicMemoryUsage() > map.size() * sizeof(std::pair<uint256, int>));
+
+    // Drain the map while walking it, the way BatchWrite does
+    size_t nVisited = 0;
+    for (flatmap<uint256, int, CCoinsKeyHasherTest>::iterator it = map.begin(); it != map.end(); ) {
+        BOOST_CHECK_EQUAL(expected[it->first], it->second);
+        nVisited++;
+        map.erase(it++);
+    }
+    BOOST_CHECK_EQUAL(nVisited, expected.size());
+    BOOST_CHECK(map.empty());
+
+    map.clear();
+    BOOST_CHECK_EQUAL(map.DynamicMemoryUsage(), 0U);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
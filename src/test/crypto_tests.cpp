@@ -2,6 +2,11 @@
 // Distributed under the MIT/X11 software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#if defined(HAVE_CONFIG_H)
+#include "config/bitcoin-config.h"
+#endif
+
+#include "crypto/common.h"
 #include "crypto/ripemd160.h"
 #include "crypto/sha1.h"
 #include "crypto/sha2.h"
@@ -12,6 +17,32 @@
 
 #include <boost/test/unit_test.hpp>
 
+#if defined(__x86_64__) || defined(__amd64__) || defined(__i386__)
+#if defined(ENABLE_SSE41) || defined(ENABLE_AVX2) || defined(ENABLE_SHANI)
+#include <cpuid.h>
+#define TEST_SHA256_DISPATCH
+#endif
+#endif
+
+#ifdef ENABLE_SSE41
+namespace sha256d64_sse41
+{
+void Transform_4way(unsigned char* out, const unsigned char* in);
+}
+#endif
+#ifdef ENABLE_AVX2
+namespace sha256d64_avx2
+{
+void Transform_8way(unsigned char* out, const unsigned char* in);
+}
+#endif
+#ifdef ENABLE_SHANI
+namespace sha256_shani
+{
+void Transform(uint32_t* s, const unsigned char* chunk);
+}
+#endif
+
 BOOST_AUTO_TEST_SUITE(crypto_tests)
 
 template<typename Hasher, typename In, typename Out>
@@ -121,6 +152,107 @@ BOOST_AUTO_TEST_CASE(sha256_testvectors) {
     TestSHA256(test1, "a316d55510b49662420f49d145d42fb83f31ef8dc016aa4e32df049991a91e26");
 }
 
+BOOST_AUTO_TEST_CASE(sha256d64) {
+    SHA256AutoDetect();
+
+    // Every lane count against the double hash of CSHA256, whatever SHA256AutoDetect chose
+    std::vector<unsigned char> in(64 * 65), out(32 * 64);
+    for (size_t i = 0; i < in.size(); i++)
+        in[i] = insecure_rand();
+    for (int i = 0; i <= 32; i++) {
+        std::fill(out.begin(), out.end(), 0);
+        SHA256D64(&out[0], &in[64], i);
+        for (int j = 0; j < i; j++) {
+            unsigned char hash[32];
+            CSHA256().Write(&in[64 + 64 * j], 64).Finalize(hash);
+            CSHA256().Write(hash, 32).Finalize(hash);
+            BOOST_CHECK(memcmp(&out[32 * j], hash, 32) == 0);
+        }
+        BOOST_CHECK(out[32 * i] == 0);
+    }
+
+    // Merkle tree sized batches hash the same all at once as one at a time
+    static const int nBlobs = 4096;
+    in.resize(64 * nBlobs);
+    for (size_t i = 0; i < in.size(); i++)
+        in[i] = insecure_rand();
+    std::vector<unsigned char> outSingle(32 * nBlobs), outBatch(32 * nBlobs);
+    for (int i = 0; i < nBlobs; i++)
+        SHA256D64(&outSingle[32 * i], &in[64 * i], 1);
+    SHA256D64(&outBatch[0], &in[0], nBlobs);
+    BOOST_CHECK(outBatch == outSingle);
+}
+
+#ifdef TEST_SHA256_DISPATCH
+/** The double hash of each 64-byte blob of in, by CSHA256. */
+static std::vector<unsigned char> SHA256D64Reference(const std::vector<unsigned char>& in)
+{
+    std::vector<unsigned char> out(in.size() / 2);
+    for (size_t i = 0; i < in.size() / 64; i++) {
+        CSHA256().Write(&in[64 * i], 64).Finalize(&out[32 * i]);
+        CSHA256().Write(&out[32 * i], 32).Finalize(&out[32 * i]);
+    }
+    return out;
+}
+
+// Every implementation this CPU can run, not only the ones SHA256AutoDetect
+// picks: with SHA-NI the SSE4.1 4-way is never used by SHA256D64.
+BOOST_AUTO_TEST_CASE(sha256_implementations) {
+    uint32_t eax, ebx, ecx, edx;
+    BOOST_REQUIRE(__get_cpuid(1, &eax, &ebx, &ecx, &edx));
+    bool fSSE41 = (ecx >> 19) & 1;
+    bool fAVX = false;
+    if (((ecx >> 27) & 1) && ((ecx >> 28) & 1)) {
+        uint32_t a, d;
+        __asm__("xgetbv" : "=a"(a), "=d"(d) : "c"(0));
+        fAVX = (a & 6) == 6;
+    }
+    uint32_t nFeatures7 = 0;
+    if (__get_cpuid_max(0, NULL) >= 7) {
+        __cpuid_count(7, 0, eax, ebx, ecx, edx);
+        nFeatures7 = ebx;
+    }
+
+    for (int n = 0; n < 16; n++) {
+        std::vector<unsigned char> in(64 * 8), out(32 * 8);
+        for (size_t i = 0; i < in.size(); i++)
+            in[i] = insecure_rand();
+        std::vector<unsigned char> expected = SHA256D64Reference(in);
+#ifdef ENABLE_SSE41
+        if (fSSE41) {
+            sha256d64_sse41::Transform_4way(&out[0], &in[0]);
+            BOOST_CHECK(memcmp(&out[0], &expected[0], 32 * 4) == 0);
+        }
+#endif
+#ifdef ENABLE_AVX2
+        if (fAVX && ((nFeatures7 >> 5) & 1)) {
+            sha256d64_avx2::Transform_8way(&out[0], &in[0]);
+            BOOST_CHECK(memcmp(&out[0], &expected[0], 32 * 8) == 0);
+        }
+#endif
+    }
+
+#ifdef ENABLE_SHANI
+    if (fSSE41 && ((nFeatures7 >> 29) & 1)) {
+        // A 64-byte message and its padding block from the initial state,
+        // against a test vector as CSHA256 may itself use SHA-NI
+        static const std::string str = "This is exactly 64 bytes long, not counting the terminating byte";
+        uint32_t s[8] = {0x6a09e667ul, 0xbb67ae85ul, 0x3c6ef372ul, 0xa54ff53aul, 0x510e527ful, 0x9b05688cul, 0x1f83d9abul, 0x5be0cd19ul};
+        unsigned char pad[64] = {0x80};
+        pad[62] = 0x02;
+        sha256_shani::Transform(s, (const unsigned char*)str.data());
+        sha256_shani::Transform(s, pad);
+        unsigned char hash[32];
+        for (int i = 0; i < 8; i++)
+            WriteBE32(hash + 4 * i, s[i]);
+        BOOST_CHECK_EQUAL(HexStr(hash, hash + 32), "ab64eff7e88e2e46165e29f2bce41826bd4c7b3552f6b382a9e7d3af47c245f8");
+    }
+#endif
+    (void)fAVX;
+    (void)nFeatures7;
+}
+#endif
+
 BOOST_AUTO_TEST_CASE(sha512_testvectors) {
     TestSHA512("",
                "cf83e1357eefb8bdf1542850d66d8007d620e4050b5715dc83f4a921d36ce9ce"
@@ -0,0 +1,71 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "lrucache.h"
+
+#include "random.h"
+
+#include <boost/test/unit_test.hpp>
+
+#define NUM_TESTS 16
+#define MAX_SIZE 100
+
+BOOST_AUTO_TEST_SUITE(lrucache_tests)
+
+// Test that an lrucache's size never exceeds its max_size
+BOOST_AUTO_TEST_CASE(lrucache_limited_size)
+{
+    for (int nTest=0; nTest<NUM_TESTS; nTest++)
+    {
+        lrucache<int, int> cache(MAX_SIZE);
+        for (int nAction=0; nAction<3*MAX_SIZE; nAction++)
+        {
+            int n = GetRandInt(2 * MAX_SIZE);
+            cache.insert(n, -n);
+            BOOST_CHECK(cache.size() <= MAX_SIZE);
+
+            int v = 0;
+            BOOST_CHECK(cache.get(n, v));
+            BOOST_CHECK_EQUAL(v, -n);
+        }
+    }
+}
+
+// Test that reading an element protects it from eviction
+BOOST_AUTO_TEST_CASE(lrucache_recently_used)
+{
+    lrucache<int, int> cache(MAX_SIZE);
+    for (int n=0; n<MAX_SIZE; n++)
+        cache.insert(n, n);
+
+    // Touch the oldest element, then push out half of the others
+    int v;
+    BOOST_CHECK(cache.get(0, v));
+    for (int n=MAX_SIZE; n<MAX_SIZE + MAX_SIZE / 2; n++)
+        cache.insert(n, n);
+
+    BOOST_CHECK_EQUAL(cache.size(), (size_t)MAX_SIZE);
+    BOOST_CHECK(cache.count(0));
+    BOOST_CHECK(!cache.count(1));
+    BOOST_CHECK(!cache.count(MAX_SIZE / 2));
+    BOOST_CHECK(cache.count(MAX_SIZE / 2 + 1));
+
+    // Replacing a value keeps a single entry
+    cache.insert(0, 42);
+    BOOST_CHECK(cache.get(0, v));
+    BOOST_CHECK_EQUAL(v, 42);
+    BOOST_CHECK_EQUAL(cache.size(), (size_t)MAX_SIZE);
+
+    // Shrinking drops the least recently used
+    cache.max_size(10);
+    BOOST_CHECK_EQUAL(cache.size(), (size_t)10);
+    BOOST_CHECK(cache.count(0));
+
+    // A zero sized cache stores nothing
+    cache.max_size(0);
+    cache.insert(1, 1);
+    BOOST_CHECK(cache.empty());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,108 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "net.h"
+
+#include "hash.h"
+#include "serialize.h"
+#include "version.h"
+
+#include <string>
+#include <vector>
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/socket.h>
+#endif
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(net_tests)
+
+#ifndef WIN32
+// The bytes PushMessage puts on the wire for one message
+template <typename T>
+static std::string Frame(const char* pszCommand, const T& obj)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << obj;
+    CDataStream ssHeader(SER_NETWORK, PROTOCOL_VERSION);
+    ssHeader << CMessageHeader(pszCommand, ss.size());
+    uint256 hash = Hash(ss.begin(), ss.end());
+    memcpy(&ssHeader[CMessageHeader::CHECKSUM_OFFSET], &hash, CMessageHeader::CHECKSUM_SIZE);
+    return ssHeader.str() + ss.str();
+}
+
+BOOST_AUTO_TEST_CASE(socket_send_data_partial)
+{
+    int sv[2];
+    BOOST_REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    // A send buffer much smaller than the messages, so most sends are short
+    int nSendBuffer = 4096;
+    setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &nSendBuffer, sizeof(nSendBuffer));
+    fcntl(sv[0], F_SETFL, O_NONBLOCK);
+    fcntl(sv[1], F_SETFL, O_NONBLOCK);
+
+    std::vector<char> vchBig(300000);
+    for (size_t i = 0; i < vchBig.size(); i++)
+        vchBig[i] = (char)(i * 7);
+    CNetPayloadRef payload = MakeNetPayload(vchBig);
+
+    std::string strExpected, strReceived;
+    char buf[65536];
+    ssize_t nRead;
+    bool fPartial = false;
+    {
+        CNode node(sv[0], CAddress(), "", true);
+
+        // A shared payload between messages with their own data
+        for (int i = 0; i < 60; i++) {
+            if (i % 3 == 0) {
+                node.PushMessage("block", payload);
+                strExpected += Frame("block", vchBig);
+            } else {
+                node.PushMessage("ping", (uint64_t)i);
+                strExpected += Frame("ping", (uint64_t)i);
+            }
+        }
+
+        while (true) {
+            {
+                LOCK(node.cs_vSend);
+                if (node.vSendMsg.empty())
+                    break;
+                SocketSendData(&node);
+
+                // nSendSize covers every queued message, nSendOffset what
+                // already went out of the first one
+                size_t nQueued = 0;
+                for (std::deque<CSendMessage>::const_iterator it = node.vSendMsg.begin(); it != node.vSendMsg.end(); it++)
+                    nQueued += it->size();
+                BOOST_CHECK_EQUAL(node.nSendSize, nQueued);
+                if (node.vSendMsg.empty()) {
+                    BOOST_CHECK_EQUAL(node.nSendOffset, 0U);
+                } else {
+                    BOOST_CHECK(node.nSendOffset < node.vSendMsg.front().size());
+                    if (node.nSendOffset > 0)
+                        fPartial = true;
+                }
+            }
+            // What was sent can be read on the other end right away
+            while ((nRead = recv(sv[1], buf, sizeof(buf), 0)) > 0)
+                strReceived.append(buf, nRead);
+            BOOST_CHECK_EQUAL(node.nSendBytes, strReceived.size());
+        }
+        BOOST_CHECK_EQUAL(node.nSendBytes, strExpected.size());
+    }
+    close(sv[1]);
+
+    BOOST_CHECK(fPartial);
+    BOOST_CHECK_EQUAL(strReceived.size(), strExpected.size());
+    BOOST_CHECK(strReceived == strExpected);
+    // The sent messages let go of the payload
+    BOOST_CHECK(payload.unique());
+}
+#endif
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,291 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "base58.h"
+#include "core.h"
+#include "receiverschedule.h"
+#include "tinyformat.h"
+#include "uint256.h"
+#include "util.h"
+
+#include <climits>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+#include "receiver.h"
+
+/**
+ * Stand-in for the receiver peers: a tiny HTTP server on the loopback
+ * interface serving canned pages. A page can be held back until a number of
+ * requests for it are in at once, or until it is released, so the quorum
+ * download can be exercised offline without depending on timing.
+ */
+class CHttpStandIn
+{
+private:
+    struct CPage
+    {
+        std::string strBody;
+        int nHoldUntilRequests;
+    };
+
+    boost::asio::io_service io;
+    boost::asio::ip::tcp::acceptor acceptor;
+    std::map<std::string, CPage> mapPages;
+    boost::thread threadAccept;
+    boost::thread_group threadsRespond;
+    boost::mutex mutexState;
+    boost::condition_variable condState;
+    std::map<std::string, int> mapRequests;
+    std::map<std::string, int> mapAnswered;
+    bool fStop;
+
+    void Accept()
+    {
+        while (true)
+        {
+            boost::shared_ptr<boost::asio::ip::tcp::socket> socket(new boost::asio::ip::tcp::socket(io));
+            boost::system::error_code ec;
+            acceptor.accept(*socket, ec);
+            boost::unique_lock<boost::mutex> lock(mutexState);
+            if (fStop || ec)
+                return;
+            threadsRespond.create_thread(boost::bind(&CHttpStandIn::Respond, this, socket));
+        }
+    }
+
+    void Respond(boost::shared_ptr<boost::asio::ip::tcp::socket> socket)
+    {
+        boost::system::error_code ec;
+        boost::asio::streambuf request;
+        boost::asio::read_until(*socket, request, "\r\n\r\n", ec);
+        std::istream stream(&request);
+        std::string strMethod, strPath;
+        stream >> strMethod >> strPath;
+
+        std::string strResponse = "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+        std::map<std::string, CPage>::iterator it = mapPages.find(strPath);
+        if (it != mapPages.end())
+        {
+            boost::unique_lock<boost::mutex> lock(mutexState);
+            mapRequests[strPath]++;
+            condState.notify_all();
+            while (!fStop && mapRequests[strPath] < it->second.nHoldUntilRequests)
+                condState.wait(lock);
+            mapAnswered[strPath]++;
+            strResponse = strprintf("HTTP/1.0 200 OK\r\nContent-Length: %u\r\nConnection: close\r\n\r\n", it->second.strBody.size()) + it->second.strBody;
+        }
+        boost::asio::write(*socket, boost::asio::buffer(strResponse), ec);
+    }
+
+public:
+    static const int HOLD_UNTIL_RELEASE = INT_MAX;
+
+    CHttpStandIn() : acceptor(io, boost::asio::ip::tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0)), fStop(false) {}
+
+    ~CHttpStandIn()
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutexState);
+            fStop = true;
+            condState.notify_all();
+        }
+        // Wake up the blocking accept
+        boost::system::error_code ec;
+        boost::asio::ip::tcp::socket socket(io);
+        socket.connect(acceptor.local_endpoint(), ec);
+        threadAccept.join();
+        threadsRespond.join_all();
+    }
+
+    // Serve strBody at strPath, once nHoldUntilRequests requests for it are in
+    void AddPage(const std::string& strPath, const std::string& strBody, int nHoldUntilRequests = 0)
+    {
+        CPage page;
+        page.strBody = strBody;
+        page.nHoldUntilRequests = nHoldUntilRequests;
+        mapPages[strPath] = page;
+    }
+
+    // Answer the held requests for strPath and any that follow
+    void Release(const std::string& strPath)
+    {
+        boost::unique_lock<boost::mutex> lock(mutexState);
+        mapPages[strPath].nHoldUntilRequests = 0;
+        condState.notify_all();
+    }
+
+    int GetAnsweredCount(const std::string& strPath)
+    {
+        boost::unique_lock<boost::mutex> lock(mutexState);
+        return mapAnswered[strPath];
+    }
+
+    void Start()
+    {
+        threadAccept = boost::thread(boost::bind(&CHttpStandIn::Accept, this));
+    }
+
+    std::string GetAddress(const std::string& strPath) const
+    {
+        return strprintf("http://127.0.0.1:%d%s", acceptor.local_endpoint().port(), strPath);
+    }
+};
+
+static const std::string strReceiverPage = "Format,pluribusunum\n_beginaddresses\n1BitcoinEaterAddressDontSendf59kuE\n_endaddresses\n";
+
+BOOST_AUTO_TEST_SUITE(receiver_tests)
+
+static std::string AddressString(unsigned int n)
+{
+    return CBitcoinAddress(CKeyID(uint160(n))).ToString();
+}
+
+BOOST_AUTO_TEST_CASE(receiver_step_parse)
+{
+    std::string strA = AddressString(1), strB = AddressString(2), strC = AddressString(3);
+    std::string strText = "Format,pluribusunum\n"
+        "_beginpeers\nhttp://example.com/receiver.csv\n_endpeers\n"
+        "_beginaddresses\n" + strA + "," + strB + "\n" + strC + ",=,=\n_endaddresses\n"
+        "Coin," + strB + ",=\n";
+    CReceiverStep receiverStep(2, strText);
+    BOOST_CHECK_EQUAL(receiverStep.GetCoinListCount(), 3U);
+
+    // Height 8000 is the first height of step 2 and uses the first list
+    const std::vector<CReceiverAddress>& vFirst = receiverStep.GetAddresses(8000, 4000);
+    BOOST_CHECK_EQUAL(vFirst.size(), 2U);
+    BOOST_CHECK_EQUAL(vFirst[0].strAddress, strA);
+    BOOST_CHECK_EQUAL(vFirst[1].strAddress, strB);
+    BOOST_CHECK(vFirst[0].IsValid());
+    BOOST_CHECK(vFirst[0].scriptPubKey == GetScriptForDestination(CKeyID(uint160(1))));
+
+    // "=" repeats the previous address
+    const std::vector<CReceiverAddress>& vSecond = receiverStep.GetAddresses(8001, 4000);
+    BOOST_CHECK_EQUAL(vSecond.size(), 3U);
+    BOOST_CHECK_EQUAL(vSecond[2].strAddress, strC);
+
+    // The lists repeat modulo their count
+    BOOST_CHECK_EQUAL(receiverStep.GetAddresses(8002, 4000)[1].strAddress, strB);
+    BOOST_CHECK_EQUAL(receiverStep.GetAddresses(8003, 4000)[0].strAddress, strA);
+}
+
+BOOST_AUTO_TEST_CASE(receiver_step_invalid)
+{
+    CReceiverStep receiverEmpty(0, "Format,pluribusunum\n");
+    BOOST_CHECK(receiverEmpty.GetAddresses(5, 4000).empty());
+
+    CReceiverStep receiverStep(0, "_beginaddresses\nnotanaddress\n_endaddresses\n");
+    BOOST_CHECK_EQUAL(receiverStep.GetAddresses(0, 4000).size(), 1U);
+    BOOST_CHECK(!receiverStep.GetAddresses(0, 4000)[0].IsValid());
+    BOOST_CHECK(receiverStep.GetAddresses(0, 4000)[0].scriptPubKey.empty());
+}
+
+BOOST_AUTO_TEST_CASE(receiver_schedule_cache)
+{
+    CReceiverSchedule schedule("receivertest.csv", 10);
+    std::string strDirectory = (GetDataDir() / "receivertest").string();
+    for (int i = 0; i < 5; i++)
+        writeFileTextByDirectory(strDirectory, strprintf("receivertest_%d.csv", i), "Format,pluribusunum\nCoin," + AddressString(i + 1) + "\n");
+
+    uint64_t nHits, nMisses;
+    unsigned int nResident;
+    BOOST_CHECK_EQUAL(schedule.GetStep(5)->nStepIndex, 0);
+    BOOST_CHECK_EQUAL(schedule.GetStep(9)->GetAddresses(9, 10)[0].strAddress, AddressString(1));
+    schedule.GetCacheStats(nHits, nMisses, nResident);
+    BOOST_CHECK_EQUAL(nHits, 1U);
+    BOOST_CHECK_EQUAL(nMisses, 1U);
+
+    // Only the latest step and its neighbours stay resident
+    boost::shared_ptr<const CReceiverStep> pstep = schedule.GetStep(0);
+    for (int nHeight = 10; nHeight < 50; nHeight += 10)
+        BOOST_CHECK_EQUAL(schedule.GetStep(nHeight)->nStepIndex, nHeight / 10);
+    schedule.GetCacheStats(nHits, nMisses, nResident);
+    BOOST_CHECK_EQUAL(nMisses, 5U);
+    BOOST_CHECK_EQUAL(nResident, 2U);
+    BOOST_CHECK_EQUAL(schedule.GetStep(30)->nStepIndex, 3);
+    schedule.GetCacheStats(nHits, nMisses, nResident);
+    BOOST_CHECK_EQUAL(nMisses, 5U);
+
+    // An evicted step is read again, a reference taken earlier stays valid
+    BOOST_CHECK_EQUAL(schedule.GetStep(1)->nStepIndex, 0);
+    schedule.GetCacheStats(nHits, nMisses, nResident);
+    BOOST_CHECK_EQUAL(nMisses, 6U);
+    BOOST_CHECK_EQUAL(pstep->GetAddresses(0, 10)[0].strAddress, AddressString(1));
+
+    // A missing file is not cached
+    BOOST_CHECK_EQUAL(schedule.GetStep(55)->nStepIndex, -1);
+    BOOST_CHECK_EQUAL(schedule.GetStep(55)->nStepIndex, -1);
+    schedule.GetCacheStats(nHits, nMisses, nResident);
+    BOOST_CHECK_EQUAL(nMisses, 8U);
+}
+
+BOOST_AUTO_TEST_CASE(receiver_quorum)
+{
+    CHttpStandIn standIn;
+    standIn.AddPage("/a.csv", strReceiverPage);
+    standIn.AddPage("/b.csv", "Format, pluribusunum\r\n_beginaddresses \n1BitcoinEaterAddressDontSendf59kuE\n\n_endaddresses\n");
+    standIn.AddPage("/c.csv", strReceiverPage);
+    standIn.AddPage("/d.csv", "Format,pluribusunum\n_beginaddresses\n_endaddresses\n");
+    standIn.AddPage("/e.csv", "not a receiver file");
+    standIn.Start();
+
+    std::vector<std::string> vAddresses;
+    vAddresses.push_back(standIn.GetAddress("/a.csv"));
+    vAddresses.push_back(standIn.GetAddress("/b.csv"));
+    vAddresses.push_back(standIn.GetAddress("/missing.csv"));
+    vAddresses.push_back(standIn.GetAddress("/e.csv"));
+    vAddresses.push_back(standIn.GetAddress("/c.csv"));
+
+    // Three of five identical pages, whitespace does not matter
+    std::string strExpected = getTextWithoutWhitespaceByLines(getTextLines(strReceiverPage));
+    BOOST_CHECK_EQUAL(getCommonOutputByAddresses(vAddresses), strExpected);
+
+    // Two of five is not a quorum
+    vAddresses[4] = standIn.GetAddress("/d.csv");
+    BOOST_CHECK_EQUAL(getCommonOutputByAddresses(vAddresses), "");
+
+    // All pages are returned in order, failed downloads are empty
+    std::vector<std::string> vPages = getLocationTexts(vAddresses);
+    BOOST_CHECK_EQUAL(vPages.size(), 5U);
+    BOOST_CHECK_EQUAL(vPages[0], strReceiverPage);
+    BOOST_CHECK_EQUAL(vPages[2], "");
+    BOOST_CHECK_EQUAL(vPages[3], "not a receiver file");
+}
+
+BOOST_AUTO_TEST_CASE(receiver_quorum_early_stop)
+{
+    CHttpStandIn standIn;
+    standIn.AddPage("/fast.csv", strReceiverPage);
+    standIn.AddPage("/held.csv", strReceiverPage, CHttpStandIn::HOLD_UNTIL_RELEASE);
+    // Only answered once both requests are in, so they have to be concurrent
+    standIn.AddPage("/slow.csv", strReceiverPage, 2);
+    standIn.Start();
+
+    std::vector<std::string> vAddresses;
+    vAddresses.push_back(standIn.GetAddress("/held.csv"));
+    for (int i = 0; i < 3; i++)
+        vAddresses.push_back(standIn.GetAddress("/fast.csv"));
+    vAddresses.push_back(standIn.GetAddress("/held.csv"));
+
+    // The quorum of three is in while the held peers have not answered
+    BOOST_CHECK(getCommonOutputByAddresses(vAddresses) != "");
+    BOOST_CHECK_EQUAL(standIn.GetAnsweredCount("/held.csv"), 0);
+    standIn.Release("/held.csv");
+
+    // Fetching every page waits for the slow peers together
+    vAddresses[0] = vAddresses[4] = standIn.GetAddress("/slow.csv");
+    std::vector<std::string> vPages = getLocationTexts(vAddresses);
+    BOOST_CHECK_EQUAL(vPages.size(), 5U);
+    BOOST_CHECK_EQUAL(vPages[0], strReceiverPage);
+    BOOST_CHECK_EQUAL(vPages[4], strReceiverPage);
+    BOOST_CHECK_EQUAL(standIn.GetAnsweredCount("/slow.csv"), 2);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
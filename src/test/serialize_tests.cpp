@@ -158,6 +158,57 @@ BOOST_AUTO_TEST_CASE(insert_delete)
     CSerializeData d;
     ss.GetAndClear(d);
     BOOST_CHECK_EQUAL(ss.size(), 0);
+    BOOST_CHECK_EQUAL(d.size(), 4);
+    BOOST_CHECK_EQUAL(d[3], (char)0xff);
+
+    // ...appending to what is there already, or taking the whole buffer
+    ss.write("\x03\x04", 2);
+    ss.GetAndClear(d);
+    BOOST_CHECK_EQUAL(ss.size(), 0);
+    BOOST_CHECK_EQUAL(d.size(), 6);
+    BOOST_CHECK_EQUAL(d[0], 0);
+    BOOST_CHECK_EQUAL(d[5], 4);
+
+    ss.write("\x05\x06\x07", 3);
+    CSerializeData d2;
+    ss.GetAndClear(d2);
+    BOOST_CHECK_EQUAL(ss.size(), 0);
+    BOOST_CHECK_EQUAL(d2.size(), 3);
+    BOOST_CHECK_EQUAL(d2[2], 7);
+    ss.write("\x08", 1);
+    BOOST_CHECK_EQUAL(ss.size(), 1);
+    BOOST_CHECK_EQUAL(ss[0], 8);
+}
+
+BOOST_AUTO_TEST_CASE(span_stream)
+{
+    CDataStream ss(SER_DISK, 0);
+    std::vector<unsigned char> vch(300, 0x42);
+    std::string str("span");
+    ss << 'c' << VARINT(1234567) << vch << str << (uint64_t)0xffffffffffULL;
+
+    // Reads in place from the buffer of ss, leaving it untouched
+    CSpanStream span(&ss[0], &ss[0] + ss.size(), SER_DISK, 0);
+    BOOST_CHECK_EQUAL(span.size(), ss.size());
+    char c;
+    int n;
+    std::vector<unsigned char> vchRead;
+    std::string strRead;
+    uint64_t nRead;
+    span >> c >> VARINT(n) >> vchRead >> strRead >> nRead;
+    BOOST_CHECK_EQUAL(c, 'c');
+    BOOST_CHECK_EQUAL(n, 1234567);
+    BOOST_CHECK(vchRead == vch);
+    BOOST_CHECK_EQUAL(strRead, str);
+    BOOST_CHECK_EQUAL(nRead, 0xffffffffffULL);
+    BOOST_CHECK(span.empty());
+    BOOST_CHECK_EQUAL(ss.size(), 1 + 3 + 3 + 300 + 1 + 4 + 8);
+
+    // Reading past the end throws
+    CSpanStream spanShort(&ss[0], &ss[0] + 5, SER_DISK, 0);
+    spanShort.ignore(1);
+    BOOST_CHECK_THROW(spanShort >> vchRead, std::ios_base::failure);
+    BOOST_CHECK_THROW(spanShort.ignore(5), std::ios_base::failure);
 }
 
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,135 @@
+// Copyright (c) 2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "script/sigcache.h"
+
+#include "key.h"
+#include "random.h"
+
+#include <boost/bind.hpp>
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+static CPubKey RandomPubKey()
+{
+    unsigned char vch[33];
+    GetRandBytes(vch, sizeof(vch));
+    vch[0] = 2;
+    return CPubKey(vch, vch + sizeof(vch));
+}
+
+static std::vector<unsigned char> RandomSig()
+{
+    std::vector<unsigned char> vchSig(72);
+    GetRandBytes(&vchSig[0], vchSig.size());
+    return vchSig;
+}
+
+struct CSigCacheEntry
+{
+    uint256 hash;
+    std::vector<unsigned char> vchSig;
+    CPubKey pubKey;
+
+    CSigCacheEntry() : hash(GetRandHash()), vchSig(RandomSig()), pubKey(RandomPubKey()) {}
+};
+
+static std::vector<CSigCacheEntry> RandomEntries(int n)
+{
+    std::vector<CSigCacheEntry> vEntries;
+    for (int i = 0; i < n; i++)
+        vEntries.push_back(CSigCacheEntry());
+    return vEntries;
+}
+
+static void LookUp(CSignatureCache* cache, const std::vector<CSigCacheEntry>* vEntries, int nRounds, bool* pfOk)
+{
+    for (int n = 0; n < nRounds; n++)
+        for (unsigned int i = 0; i < vEntries->size(); i++)
+            if (!cache->Get((*vEntries)[i].hash, (*vEntries)[i].vchSig, (*vEntries)[i].pubKey))
+                *pfOk = false;
+}
+
+BOOST_AUTO_TEST_SUITE(sigcache_tests)
+
+BOOST_AUTO_TEST_CASE(sigcache_lookup)
+{
+    CSignatureCache cache(1000);
+    CSigCacheEntry entry;
+    BOOST_CHECK(!cache.Get(entry.hash, entry.vchSig, entry.pubKey));
+    cache.Set(entry.hash, entry.vchSig, entry.pubKey);
+    BOOST_CHECK(cache.Get(entry.hash, entry.vchSig, entry.pubKey));
+
+    // Any other signature, key or hash is a different entry
+    std::vector<unsigned char> vchSig(entry.vchSig);
+    vchSig.back() ^= 1;
+    BOOST_CHECK(!cache.Get(entry.hash, vchSig, entry.pubKey));
+    BOOST_CHECK(!cache.Get(entry.hash, entry.vchSig, RandomPubKey()));
+    BOOST_CHECK(!cache.Get(GetRandHash(), entry.vchSig, entry.pubKey));
+
+    uint64_t nHits, nMisses, nEntries, nMaxEntries;
+    cache.GetStats(nHits, nMisses, nEntries, nMaxEntries);
+    BOOST_CHECK_EQUAL(nHits, 1U);
+    BOOST_CHECK_EQUAL(nMisses, 4U);
+    BOOST_CHECK_EQUAL(nEntries, 1U);
+    BOOST_CHECK_EQUAL(nMaxEntries, 1024U);
+
+    // A zero sized cache stores nothing
+    CSignatureCache disabled(0);
+    disabled.Set(entry.hash, entry.vchSig, entry.pubKey);
+    BOOST_CHECK(!disabled.Get(entry.hash, entry.vchSig, entry.pubKey));
+}
+
+BOOST_AUTO_TEST_CASE(sigcache_bounded)
+{
+    CSignatureCache cache(256);
+    std::vector<CSigCacheEntry> vEntries = RandomEntries(2048);
+    for (unsigned int i = 0; i < vEntries.size(); i++)
+        cache.Set(vEntries[i].hash, vEntries[i].vchSig, vEntries[i].pubKey);
+
+    uint64_t nHits, nMisses, nEntries, nMaxEntries;
+    cache.GetStats(nHits, nMisses, nEntries, nMaxEntries);
+    BOOST_CHECK_EQUAL(nMaxEntries, 256U);
+    BOOST_CHECK(nEntries <= nMaxEntries);
+
+    // What is left are entries that were set
+    int nFound = 0;
+    for (unsigned int i = 0; i < vEntries.size(); i++)
+        if (cache.Get(vEntries[i].hash, vEntries[i].vchSig, vEntries[i].pubKey))
+            nFound++;
+    BOOST_CHECK(nFound > 0 && nFound <= 256);
+
+    // Mostly filled, the two buckets per entry leave few unused
+    BOOST_CHECK(nEntries > 200);
+}
+
+BOOST_AUTO_TEST_CASE(sigcache_concurrent)
+{
+    static const int nThreads = 4;
+    static const int nRounds = 20;
+    CSignatureCache cache(200000);
+    std::vector<CSigCacheEntry> vEntries = RandomEntries(10000), vOthers = RandomEntries(10000);
+    for (unsigned int i = 0; i < vEntries.size(); i++)
+        cache.Set(vEntries[i].hash, vEntries[i].vchSig, vEntries[i].pubKey);
+
+    // Readers of the stored entries, while others are being inserted
+    bool fOk[nThreads];
+    boost::thread_group threads;
+    for (int i = 0; i < nThreads; i++) {
+        fOk[i] = true;
+        threads.create_thread(boost::bind(&LookUp, &cache, &vEntries, nRounds, &fOk[i]));
+    }
+    for (unsigned int i = 0; i < vOthers.size(); i++)
+        cache.Set(vOthers[i].hash, vOthers[i].vchSig, vOthers[i].pubKey);
+    threads.join_all();
+
+    // The cache is large enough for all of them, nothing was evicted
+    for (int i = 0; i < nThreads; i++)
+        BOOST_CHECK(fOk[i]);
+    uint64_t nHits, nMisses, nEntries, nMaxEntries;
+    cache.GetStats(nHits, nMisses, nEntries, nMaxEntries);
+    BOOST_CHECK_EQUAL(nHits, (uint64_t)nThreads * nRounds * vEntries.size());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -5,12 +5,17 @@
 
 #include "txdb.h"
 
+#include "blockfilereader.h"
+#include "checkpoints.h"
+#include "checkqueue.h"
 #include "core.h"
 #include "pow.h"
 #include "uint256.h"
 
+#include <algorithm>
 #include <stdint.h>
 
+#include <boost/bind.hpp>
 #include <boost/thread.hpp>
 
 using namespace std;
@@ -26,18 +31,100 @@ void static BatchWriteHashBestChain(CLevelDBBatch &batch, const uint256 &hash) {
     batch.Write('B', hash);
 }
 
-CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe) {
+// Index rows of stored auxpow blocks only record where the block is, read the
+// auxpow from the block header there.
+static bool ReadAuxPowFromBlockFile(CDiskBlockIndex &diskindex)
+{
+    if (diskindex.nAuxPowFormat != CDiskBlockIndex::AUXPOW_IN_BLOCK_FILE)
+        return true;
+
+    CDiskBlockPos pos(diskindex.nFile, diskindex.nDataPos);
+    CBlockHeader header;
+    try {
+        if (!blockFileReader.Read(pos, header)) {
+            CAutoFile filein(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
+            if (filein.IsNull())
+                return error("%s : OpenBlockFile failed", __func__);
+            filein >> header;
+        }
+    } catch (std::exception &e) {
+        return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+    }
+    if (header.GetHash() != diskindex.CalcBlockHash())
+        return error("%s : block %s is not at its recorded position", __func__, diskindex.CalcBlockHash().ToString());
+    diskindex.auxpow = header.auxpow;
+    return true;
+}
+
+bool CCoinsFlushShard::operator()() {
+    for (size_t i = nBegin; i < nEnd; i++)
+        BatchWriteCoins(*pbatch, (*pvEntries)[i]->first, (*pvEntries)[i]->second.coins);
+    return true;
+}
+
+CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe, CLevelDBProfile::FromArgs("chainstate")), nFlushingUsage(0), hashFlushing(0), fFlushing(false), fFlushFailed(false), fStopFlusher(false), queueFlush(1), nFlushThreads(1) {
+}
+
+CCoinsViewDB::~CCoinsViewDB() {
+    StopFlusher();
+}
+
+void CCoinsViewDB::StartFlusher(int nThreads) {
+    assert(threadFlusher.get_id() == boost::thread::id());
+    nFlushThreads = std::max(1, nThreads);
+    for (int i = 1; i < nFlushThreads; i++)
+        threadsFlushShards.create_thread(boost::bind(&CCheckQueue<CCoinsFlushShard>::Thread, &queueFlush));
+    fStopFlusher = false;
+    threadFlusher = boost::thread(boost::bind(&CCoinsViewDB::ThreadFlush, this));
+}
+
+void CCoinsViewDB::StopFlusher() {
+    if (threadFlusher.get_id() == boost::thread::id())
+        return;
+    {
+        boost::unique_lock<boost::mutex> lock(mutexFlush);
+        fStopFlusher = true;
+        condFlush.notify_all();
+    }
+    // The flusher commits what it still has before it exits
+    threadFlusher.join();
+    threadFlusher = boost::thread();
+    threadsFlushShards.interrupt_all();
+    threadsFlushShards.join_all();
+    nFlushThreads = 1;
 }
 
 bool CCoinsViewDB::GetCoins(const uint256 &txid, CCoins &coins) const {
+    {
+        boost::unique_lock<boost::mutex> lock(mutexFlush);
+        CCoinsMap::const_iterator it = mapFlushing.find(txid);
+        if (it != mapFlushing.end()) {
+            // Pruned entries are erased from the database
+            if (it->second.coins.IsPruned())
+                return false;
+            coins = it->second.coins;
+            return true;
+        }
+    }
     return db.Read(make_pair('c', txid), coins);
 }
 
 bool CCoinsViewDB::HaveCoins(const uint256 &txid) const {
+    {
+        boost::unique_lock<boost::mutex> lock(mutexFlush);
+        CCoinsMap::const_iterator it = mapFlushing.find(txid);
+        if (it != mapFlushing.end())
+            return !it->second.coins.IsPruned();
+    }
     return db.Exists(make_pair('c', txid));
 }
 
 uint256 CCoinsViewDB::GetBestBlock() const {
+    {
+        boost::unique_lock<boost::mutex> lock(mutexFlush);
+        if (hashFlushing != uint256(0))
+            return hashFlushing;
+    }
     uint256 hashBestChain;
     if (!db.Read('B', hashBestChain))
         return uint256(0);
@@ -45,12 +132,21 @@ uint256 CCoinsViewDB::GetBestBlock() const {
 }
 
 bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) {
-    CLevelDBBatch batch;
+    boost::unique_lock<boost::mutex> lock(mutexFlush);
+    while (fFlushing)
+        condFlush.wait(lock);
+
+    // After a failed commit its entries stay in mapFlushing, the new ones
+    // go on top so reads still see the state the caller has
     size_t count = 0;
     size_t changed = 0;
     for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end();) {
         if (it->second.flags & CCoinsCacheEntry::DIRTY) {
-            BatchWriteCoins(batch, it->first, it->second.coins);
+            CCoinsCacheEntry& entry = mapFlushing[it->first];
+            nFlushingUsage -= entry.coins.DynamicMemoryUsage();
+            entry.coins.swap(it->second.coins);
+            entry.flags = CCoinsCacheEntry::DIRTY;
+            nFlushingUsage += entry.coins.DynamicMemoryUsage();
             changed++;
         }
         count++;
@@ -58,20 +154,138 @@ bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) {
         mapCoins.erase(itOld);
     }
     if (hashBlock != uint256(0))
-        BatchWriteHashBestChain(batch, hashBlock);
+        hashFlushing = hashBlock;
+    if (fFlushFailed)
+        return error("CCoinsViewDB::BatchWrite() : an earlier commit to the coin database failed");
+    if (changed == 0 && hashBlock == uint256(0))
+        return true;
+
+    if (threadFlusher.get_id() == boost::thread::id()) {
+        // No flusher, commit right away
+        LogPrint("coindb", "Committing %u changed transactions (out of %u) to coin database...\n", (unsigned int)changed, (unsigned int)count);
+        bool fOk = false;
+        try {
+            fOk = WriteFlushing();
+        } catch (std::exception &e) {
+            LogPrintf("CCoinsViewDB::BatchWrite() : %s\n", e.what());
+        }
+        FinishFlush(fOk);
+        return fOk;
+    }
 
-    LogPrint("coindb", "Committing %u changed transactions (out of %u) to coin database...\n", (unsigned int)changed, (unsigned int)count);
-    return db.WriteBatch(batch);
+    LogPrint("coindb", "Handing %u changed transactions (out of %u) to the coin database flusher...\n", (unsigned int)changed, (unsigned int)count);
+    fFlushing = true;
+    condFlush.notify_all();
+    return true;
+}
+
+bool CCoinsViewDB::Sync() const {
+    boost::unique_lock<boost::mutex> lock(mutexFlush);
+    while (fFlushing)
+        condFlush.wait(lock);
+    return !fFlushFailed;
 }
 
-CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CLevelDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe) {
+size_t CCoinsViewDB::FlushingMemoryUsage() const {
+    boost::unique_lock<boost::mutex> lock(mutexFlush);
+    return mapFlushing.DynamicMemoryUsage() + nFlushingUsage;
+}
+
+// requires mutexFlush
+void CCoinsViewDB::FinishFlush(bool fOk) {
+    if (fOk) {
+        mapFlushing.clear();
+        nFlushingUsage = 0;
+        hashFlushing = 0;
+    } else {
+        // Keep answering reads from the entries, the database lacks them
+        LogPrintf("CCoinsViewDB : commit to coin database failed, the next write reports it\n");
+        fFlushFailed = true;
+    }
+    fFlushing = false;
+    condFlush.notify_all();
+}
+
+void CCoinsViewDB::ThreadFlush() {
+    RenameThread("bitcoin-coinsfl");
+    boost::unique_lock<boost::mutex> lock(mutexFlush);
+    while (true) {
+        while (!fFlushing && !fStopFlusher)
+            condFlush.wait(lock);
+        if (!fFlushing)
+            return;
+
+        // Nobody changes mapFlushing and hashFlushing until fFlushing is reset
+        lock.unlock();
+        bool fOk = false;
+        try {
+            fOk = WriteFlushing();
+        } catch (std::exception &e) {
+            LogPrintf("CCoinsViewDB::ThreadFlush() : %s\n", e.what());
+        }
+        lock.lock();
+        FinishFlush(fOk);
+    }
+}
+
+bool CCoinsViewDB::WriteFlushing() {
+    // Serializing the coins is most of the work, spread it over the flush
+    // threads in shards of at least this many entries
+    static const size_t nMinShard = 4096;
+    int64_t nStart = GetTimeMillis();
+
+    std::vector<const CCoinsMap::value_type*> vEntries;
+    vEntries.reserve(mapFlushing.size());
+    for (CCoinsMap::const_iterator it = mapFlushing.begin(); it != mapFlushing.end(); it++)
+        vEntries.push_back(&*it);
+    size_t nShards = std::min((size_t)nFlushThreads, vEntries.size() / nMinShard + 1);
+    size_t nPerShard = (vEntries.size() + nShards - 1) / nShards;
+    std::vector<CLevelDBBatch> vBatches(nShards);
+    {
+        CCheckQueueControl<CCoinsFlushShard> control(&queueFlush);
+        std::vector<CCoinsFlushShard> vShards;
+        for (size_t i = 0; i < nShards; i++)
+            vShards.push_back(CCoinsFlushShard(&vEntries, std::min(i * nPerShard, vEntries.size()),
+                                               std::min((i + 1) * nPerShard, vEntries.size()), &vBatches[i]));
+        control.Add(vShards);
+        control.Wait();
+    }
+
+    // One batch, so the coins and the best block are committed atomically
+    CLevelDBBatch &batch = vBatches[0];
+    for (size_t i = 1; i < nShards; i++)
+        batch.Append(vBatches[i]);
+    if (hashFlushing != uint256(0))
+        BatchWriteHashBestChain(batch, hashFlushing);
+    int64_t nSerialized = GetTimeMillis();
+
+    bool fOk = db.WriteBatch(batch);
+    LogPrint("coindb", "Committed %u changed transactions to coin database: serialized in %u shards %dms, written %dms\n",
+             (unsigned int)vEntries.size(), (unsigned int)nShards, nSerialized - nStart, GetTimeMillis() - nSerialized);
+    return fOk;
+}
+
+CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CLevelDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe, CLevelDBProfile::FromArgs("blockindex")), auxpowCache(nDefaultAuxPowCache), nAuxPowHits(0), nAuxPowMisses(0), nAuxPowBlockFileReads(0) {
 }
 bool CBlockTreeDB::WriteDiskBlockIndex(const CDiskBlockIndex& diskblockindex)
 {
-    return Write(boost::tuples::make_tuple('b', *diskblockindex.phashBlock, 'a'), diskblockindex);
+    if (!Write(boost::tuples::make_tuple('b', *diskblockindex.phashBlock, 'a'), diskblockindex))
+        return false;
+    // New blocks are the ones peers ask headers for next
+    if (diskblockindex.auxpow) {
+        LOCK(cs_auxpow);
+        auxpowCache.insert(*diskblockindex.phashBlock, diskblockindex.auxpow);
+    }
+    return true;
 }
 bool CBlockTreeDB::ReadDiskBlockIndex(const uint256 &blkid, CDiskBlockIndex &diskblockindex) {
-    return Read(boost::tuples::make_tuple('b', blkid, 'a'), diskblockindex);
+    if (!Read(boost::tuples::make_tuple('b', blkid, 'a'), diskblockindex))
+        return false;
+    if (diskblockindex.nAuxPowFormat == CDiskBlockIndex::AUXPOW_IN_BLOCK_FILE) {
+        LOCK(cs_auxpow);
+        nAuxPowBlockFileReads++;
+    }
+    return ReadAuxPowFromBlockFile(diskblockindex);
 }
 bool CBlockTreeDB::WriteBlockIndex(const CBlockIndex& blockindex)
 {
@@ -107,6 +321,9 @@ bool CBlockTreeDB::ReadLastBlockFile(int &nFile) {
 }
 
 bool CCoinsViewDB::GetStats(CCoinsStats &stats) const {
+    if (!Sync())
+        return false;
+
     /* It seems that there are no "const iterators" for LevelDB.  Since we
        only need read operations on it, use a const-cast to get around
        that restriction.  */
@@ -121,12 +338,12 @@ bool CCoinsViewDB::GetStats(CCoinsStats &stats) const {
         boost::this_thread::interruption_point();
         try {
             leveldb::Slice slKey = pcursor->key();
-            CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
+            CSpanStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
             char chType;
             ssKey >> chType;
             if (chType == 'c') {
                 leveldb::Slice slValue = pcursor->value();
-                CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+                CSpanStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
                 CCoins coins;
                 ssValue >> coins;
                 uint256 txhash;
@@ -182,6 +399,44 @@ bool CBlockTreeDB::ReadFlag(const std::string &name, bool &fValue) {
     return true;
 }
 
+namespace {
+
+/** Proof of work check of an auxpow block index entry, deferred to the
+ *  check queue so the index can keep loading while parent headers are
+ *  parsed and hashed. The auxpow is freed again as soon as it is checked.
+ *  Only rows with the auxpow in them are checked, no block file is read. */
+class CAuxPowIndexCheck
+{
+private:
+    uint256 hashBlock;
+    std::string strValue;
+
+public:
+    CAuxPowIndexCheck() {}
+    CAuxPowIndexCheck(const uint256 &hashBlockIn, const leveldb::Slice &slValue) : hashBlock(hashBlockIn), strValue(slValue.data(), slValue.size()) {}
+
+    bool operator()() {
+        CDiskBlockIndex diskindex;
+        try {
+            CSpanStream ssValue(strValue.data(), strValue.data()+strValue.size(), SER_DISK, CLIENT_VERSION);
+            ssValue >> diskindex;
+        } catch (std::exception &e) {
+            return error("LoadBlockIndex() : deserialize error for %s", hashBlock.ToString());
+        }
+        diskindex.phashBlock = &hashBlock;
+        if (!diskindex.CheckIndex())
+            return error("LoadBlockIndex() : CheckIndex failed: %s", hashBlock.ToString());
+        return true;
+    }
+
+    void swap(CAuxPowIndexCheck &check) {
+        std::swap(hashBlock, check.hashBlock);
+        strValue.swap(check.strValue);
+    }
+};
+
+} // anon namespace
+
 bool CBlockTreeDB::LoadBlockIndexGuts()
 {
     boost::scoped_ptr<leveldb::Iterator> pcursor(NewIterator());
@@ -192,12 +447,31 @@ bool CBlockTreeDB::LoadBlockIndexGuts()
     char cType;
     pcursor->Seek(ssKeySet.str());
 
+    // Only the header fields are read here. Auxpow parent headers at or below
+    // the last checkpoint are trusted, and so are the ones only kept in the
+    // block file, whose header was checked before the block was stored. The
+    // others are checked on the -par threads while loading continues. Pending
+    // checks hold the raw entry, so wait for them now and then to bound memory.
+    static const unsigned int nCheckBatch = 128;
+    static const unsigned int nMaxPending = 16384;
+    int nCheckpointHeight = Checkpoints::GetTotalBlocksEstimate();
+    CCheckQueue<CAuxPowIndexCheck> queue(nCheckBatch);
+    boost::thread_group threads;
+    CThreadGroupJoiner joiner(threads);
+    for (int i = 0; i < nScriptCheckThreads - 1; i++)
+        threads.create_thread(boost::bind(&CCheckQueue<CAuxPowIndexCheck>::Thread, &queue));
+    std::vector<CAuxPowIndexCheck> vChecks;
+    vChecks.reserve(nCheckBatch);
+    unsigned int nPending = 0, nChecked = 0, nTrusted = 0, nRewritten = 0;
+    CLevelDBBatch batch;
+    int64_t nStart = GetTimeMillis();
+
     // Load mapBlockIndex
     while (pcursor->Valid()) {
         boost::this_thread::interruption_point();
         try {
             leveldb::Slice slKey = pcursor->key();
-            CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
+            CSpanStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
             ssKey >> cType;
             if (cType == 'b') {
                 if (slKey.size() < ssKeySet.size()) {
@@ -206,9 +480,9 @@ bool CBlockTreeDB::LoadBlockIndexGuts()
                 ssKey >> hash;
 
                 leveldb::Slice slValue = pcursor->value();
-                CDataStream ssValue_immutable(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+                CSpanStream ssValue_immutable(slValue.data(), slValue.data()+slValue.size(), SER_DISK | SER_BLOCKHEADERONLY, CLIENT_VERSION);
                 CDiskBlockIndex diskindex;
-                ssValue_immutable >> diskindex; // read all immutable data
+                ssValue_immutable >> diskindex; // read the immutable header fields, not the auxpow
 
                 // Construct immutable parts of block index object
                 CBlockIndex* pindexNew = InsertBlockIndex(hash);
@@ -223,19 +497,58 @@ bool CBlockTreeDB::LoadBlockIndexGuts()
                 pindexNew->nNonce         = diskindex.nNonce;
                 pindexNew->nTx            = diskindex.nTx;
 
-                // CheckIndex needs phashBlock to be set
-                diskindex.phashBlock = pindexNew->phashBlock;
-                if (!diskindex.CheckIndex())
-                    return error("LoadBlockIndex() : CheckIndex failed: %s", pindexNew->ToString().c_str());
+                if (!(diskindex.nVersion & BLOCK_VERSION_AUXPOW)) {
+                    if (!CheckProofOfWork(hash, diskindex.nBits))
+                        return error("LoadBlockIndex() : CheckIndex failed: %s", pindexNew->ToString().c_str());
+                } else if (diskindex.nHeight <= nCheckpointHeight || diskindex.nAuxPowFormat == CDiskBlockIndex::AUXPOW_IN_BLOCK_FILE) {
+                    nTrusted++;
+                } else {
+                    vChecks.push_back(CAuxPowIndexCheck(hash, slValue));
+                    if (vChecks.size() == nCheckBatch) {
+                        queue.Add(vChecks);
+                        vChecks.clear();
+                    }
+                    if (++nPending >= nMaxPending) {
+                        if (!queue.Wait())
+                            return false;
+                        nChecked += nPending;
+                        nPending = 0;
+                    }
+                }
+
+                // Keep rows that may need rewriting in the compact encoding
+                std::string strImmutable;
+                if (diskindex.nAuxPowFormat == CDiskBlockIndex::AUXPOW_LEGACY || diskindex.nAuxPowFormat == CDiskBlockIndex::AUXPOW_INLINE)
+                    strImmutable.assign(slValue.data(), slValue.size());
 
                 pcursor->Next(); // now we should be on the 'b' subkey
 
                 assert(pcursor->Valid());
 
                 slValue = pcursor->value();
-                CDataStream ssValue_mutable(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+                CSpanStream ssValue_mutable(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
                 ssValue_mutable >> *pindexNew;      // read all mutable data
 
+                // Upgrade rows from before the compact auxpow encoding, and
+                // drop the inline auxpow of blocks that have been stored since,
+                // once they are below the last checkpoint. The ones above are
+                // checked at every startup and served the most, keep those.
+                bool fAuxPowInBlockFile = (pindexNew->nStatus & BLOCK_HAVE_DATA) && diskindex.nHeight <= nCheckpointHeight;
+                if (diskindex.nAuxPowFormat == CDiskBlockIndex::AUXPOW_LEGACY ||
+                    (diskindex.nAuxPowFormat == CDiskBlockIndex::AUXPOW_INLINE && fAuxPowInBlockFile)) {
+                    CSpanStream ssValue_full(strImmutable.data(), strImmutable.data()+strImmutable.size(), SER_DISK, CLIENT_VERSION);
+                    CDiskBlockIndex diskindexFull;
+                    ssValue_full >> diskindexFull;
+                    if (fAuxPowInBlockFile)
+                        diskindexFull.auxpow.reset();
+                    batch.Write(boost::tuples::make_tuple('b', hash, 'a'), CDiskBlockIndex(pindexNew, diskindexFull.auxpow));
+                    if (++nRewritten % 1000 == 0) {
+                        if (!WriteBatch(batch))
+                            return error("LoadBlockIndex() : failed to rewrite the auxpow of %s", hash.ToString());
+                        batch.Clear();
+                    }
+                }
+
                 pcursor->Next();
             } else {
                 break; // if shutdown requested or finished loading block index
@@ -245,5 +558,102 @@ bool CBlockTreeDB::LoadBlockIndexGuts()
         }
     }
 
+    queue.Add(vChecks);
+    if (!queue.Wait())
+        return false;
+    nChecked += nPending;
+    if (nRewritten > 0) {
+        if (!WriteBatch(batch))
+            return error("LoadBlockIndex() : failed to rewrite auxpow index rows");
+        LogPrintf("LoadBlockIndexGuts(): rewrote %u auxpow index rows in the compact encoding\n", nRewritten);
+    }
+    LogPrintf("LoadBlockIndexGuts(): checked %u auxpow headers on %d threads, trusted %u up to checkpoint height %d, %dms\n",
+              nChecked, std::max(nScriptCheckThreads, 1), nTrusted, nCheckpointHeight, GetTimeMillis() - nStart);
+
     return true;
 }
+
+bool CBlockTreeDB::ReadAuxPow(const uint256 &blkid, boost::shared_ptr<CAuxPow> &auxpow)
+{
+    std::vector<uint256> vBlkid(1, blkid);
+    std::vector<boost::shared_ptr<CAuxPow> > vAuxPow;
+    if (!ReadAuxPows(vBlkid, vAuxPow))
+        return false;
+    auxpow = vAuxPow[0];
+    return true;
+}
+
+bool CBlockTreeDB::ReadAuxPows(const std::vector<uint256> &vBlkid, std::vector<boost::shared_ptr<CAuxPow> > &vAuxPow)
+{
+    vAuxPow.assign(vBlkid.size(), boost::shared_ptr<CAuxPow>());
+
+    // Serialized keys of the cache misses, with their position in vBlkid
+    std::vector<std::pair<std::string, unsigned int> > vMissing;
+    {
+        LOCK(cs_auxpow);
+        for (unsigned int i = 0; i < vBlkid.size(); i++) {
+            if (auxpowCache.get(vBlkid[i], vAuxPow[i])) {
+                nAuxPowHits++;
+                continue;
+            }
+            nAuxPowMisses++;
+            CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+            ssKey << boost::tuples::make_tuple('b', vBlkid[i], 'a');
+            vMissing.push_back(make_pair(ssKey.str(), i));
+        }
+    }
+    if (vMissing.empty())
+        return true;
+
+    // Seek forward in key order, so one iterator walks the table files once
+    sort(vMissing.begin(), vMissing.end());
+    boost::scoped_ptr<leveldb::Iterator> pcursor(NewIterator());
+    bool fAllFound = true;
+    uint64_t nBlockFileReads = 0;
+    for (unsigned int i = 0; i < vMissing.size(); i++) {
+        const std::string &strKey = vMissing[i].first;
+        pcursor->Seek(strKey);
+        if (!pcursor->Valid() || pcursor->key() != leveldb::Slice(strKey)) {
+            fAllFound = false;
+            continue;
+        }
+        try {
+            leveldb::Slice slValue = pcursor->value();
+            CSpanStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+            CDiskBlockIndex diskindex;
+            ssValue >> diskindex;
+            if (diskindex.nAuxPowFormat == CDiskBlockIndex::AUXPOW_IN_BLOCK_FILE)
+                nBlockFileReads++;
+            if (!ReadAuxPowFromBlockFile(diskindex))
+                fAllFound = false;
+            vAuxPow[vMissing[i].second] = diskindex.auxpow;
+        } catch (std::exception &e) {
+            return error("%s() : deserialize error", __PRETTY_FUNCTION__);
+        }
+    }
+
+    LOCK(cs_auxpow);
+    nAuxPowBlockFileReads += nBlockFileReads;
+    for (unsigned int i = 0; i < vMissing.size(); i++) {
+        unsigned int n = vMissing[i].second;
+        if (vAuxPow[n])
+            auxpowCache.insert(vBlkid[n], vAuxPow[n]);
+    }
+    return fAllFound;
+}
+
+void CBlockTreeDB::SetAuxPowCacheSize(unsigned int nEntries)
+{
+    LOCK(cs_auxpow);
+    auxpowCache.max_size(nEntries);
+}
+
+void CBlockTreeDB::GetAuxPowCacheStats(uint64_t &nHits, uint64_t &nMisses, uint64_t &nBlockFileReads, unsigned int &nEntries, unsigned int &nMaxEntries)
+{
+    LOCK(cs_auxpow);
+    nHits = nAuxPowHits;
+    nMisses = nAuxPowMisses;
+    nBlockFileReads = nAuxPowBlockFileReads;
+    nEntries = auxpowCache.size();
+    nMaxEntries = auxpowCache.max_size();
+}
@@ -6,14 +6,23 @@
 #ifndef BITCOIN_TXDB_LEVELDB_H
 #define BITCOIN_TXDB_LEVELDB_H
 
+#include "checkqueue.h"
 #include "leveldbwrapper.h"
+#include "lrucache.h"
 #include "main.h"
+#include "sync.h"
 
 #include <map>
 #include <string>
 #include <utility>
 #include <vector>
 
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
+class CAuxPow;
 class CCoins;
 class uint256;
 
@@ -23,20 +32,91 @@ static const int64_t nDefaultDbCache = 100;
 static const int64_t nMaxDbCache = sizeof(void*) > 4 ? 4096 : 1024;
 // min. -dbcache in (MiB)
 static const int64_t nMinDbCache = 4;
+// -auxpowcache default (entries), two full headers messages
+static const unsigned int nDefaultAuxPowCache = 4000;
+
+/** One shard of the coin database entries being flushed, serialized into its own batch */
+class CCoinsFlushShard
+{
+private:
+    const std::vector<const CCoinsMap::value_type*> *pvEntries;
+    size_t nBegin;
+    size_t nEnd;
+    CLevelDBBatch *pbatch;
+
+public:
+    CCoinsFlushShard() : pvEntries(NULL), nBegin(0), nEnd(0), pbatch(NULL) {}
+    CCoinsFlushShard(const std::vector<const CCoinsMap::value_type*> *pvEntriesIn, size_t nBeginIn, size_t nEndIn, CLevelDBBatch *pbatchIn) :
+        pvEntries(pvEntriesIn), nBegin(nBeginIn), nEnd(nEndIn), pbatch(pbatchIn) {}
+
+    bool operator()();
+
+    void swap(CCoinsFlushShard &shard) {
+        std::swap(pvEntries, shard.pvEntries);
+        std::swap(nBegin, shard.nBegin);
+        std::swap(nEnd, shard.nEnd);
+        std::swap(pbatch, shard.pbatch);
+    }
+};
 
-/** CCoinsView backed by the LevelDB coin database (chainstate/) */
+/** CCoinsView backed by the LevelDB coin database (chainstate/)
+ *
+ *  Once StartFlusher was called, BatchWrite only moves the dirty entries
+ *  aside and returns. The flusher thread serializes them in parallel shards
+ *  and commits them as one LevelDB batch, while reads keep seeing them until
+ *  that is done. One flush is in flight at a time, the next BatchWrite waits
+ *  for it. If the commit fails the entries stay readable, and the next
+ *  BatchWrite reports the failure. Without a flusher BatchWrite commits
+ *  before it returns. */
 class CCoinsViewDB : public CCoinsView
 {
 protected:
     CLevelDBWrapper db;
+
+    mutable boost::mutex mutexFlush;
+    mutable boost::condition_variable condFlush;
+    //! Entries handed to the flusher, not changed while fFlushing
+    CCoinsMap mapFlushing;
+    size_t nFlushingUsage;
+    uint256 hashFlushing;
+    bool fFlushing;
+    bool fFlushFailed;
+    bool fStopFlusher;
+    boost::thread threadFlusher;
+    //! Serialize the shards of a flush, along with the flusher
+    CCheckQueue<CCoinsFlushShard> queueFlush;
+    boost::thread_group threadsFlushShards;
+    int nFlushThreads;
+
+    void ThreadFlush();
+    bool WriteFlushing();
+    void FinishFlush(bool fOk);
+
 public:
     CCoinsViewDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+    ~CCoinsViewDB();
 
     bool GetCoins(const uint256 &txid, CCoins &coins) const;
     bool HaveCoins(const uint256 &txid) const;
     uint256 GetBestBlock() const;
     bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock);
     bool GetStats(CCoinsStats &stats) const;
+
+    const CLevelDBWrapper &GetDB() const { return db; }
+
+    /** Commit in the background from now on, serializing on nThreads
+     *  threads including the flusher. */
+    void StartFlusher(int nThreads);
+    /** Commit what was handed to the flusher and stop its threads. */
+    void StopFlusher();
+
+    /** Wait until the flusher has committed what it was handed. Returns
+     *  false if a commit failed since the database was opened. */
+    bool Sync() const;
+
+    /** Memory held by the entries that are being flushed, which count
+     *  against the coin cache budget until they are committed. */
+    size_t FlushingMemoryUsage() const;
 };
 
 /** Access to the block database (blocks/index/) */
@@ -47,6 +127,13 @@ public:
 private:
     CBlockTreeDB(const CBlockTreeDB&);
     void operator=(const CBlockTreeDB&);
+
+    //! Recently served or written auxpows, so headers are not read back per request
+    CCriticalSection cs_auxpow;
+    lrucache<uint256, boost::shared_ptr<CAuxPow> > auxpowCache;
+    uint64_t nAuxPowHits;
+    uint64_t nAuxPowMisses;
+    uint64_t nAuxPowBlockFileReads;
 public:
 	bool WriteDiskBlockIndex(const CDiskBlockIndex& diskblockindex);
 	bool ReadDiskBlockIndex(const uint256 &blkid, CDiskBlockIndex &diskblockindex);
@@ -62,6 +149,14 @@ public:
     bool WriteFlag(const std::string &name, bool fValue);
     bool ReadFlag(const std::string &name, bool &fValue);
     bool LoadBlockIndexGuts();
+
+    /** Return the auxpow of an auxpow block, from the cache if possible. */
+    bool ReadAuxPow(const uint256 &blkid, boost::shared_ptr<CAuxPow> &auxpow);
+    /** Return the auxpows of many blocks. Blocks missing from the cache are
+     *  read in key order with a single iterator instead of one Get each. */
+    bool ReadAuxPows(const std::vector<uint256> &vBlkid, std::vector<boost::shared_ptr<CAuxPow> > &vAuxPow);
+    void SetAuxPowCacheSize(unsigned int nEntries);
+    void GetAuxPowCacheStats(uint64_t &nHits, uint64_t &nMisses, uint64_t &nBlockFileReads, unsigned int &nEntries, unsigned int &nMaxEntries);
 };
 
 #endif // BITCOIN_TXDB_LEVELDB_H
@@ -6,6 +6,7 @@
 #include "wallet.h"
 
 #include "base58.h"
+#include "blockfilereader.h"
 #include "checkpoints.h"
 #include "coincontrol.h"
 #include "net.h"
@@ -931,6 +932,7 @@ int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
         ShowProgress(_("Rescanning..."), 0); // show rescan progress in GUI as dialog or on splashscreen, if -rescan on startup
         double dProgressStart = Checkpoints::GuessVerificationProgress(pindex, false);
         double dProgressTip = Checkpoints::GuessVerificationProgress(chainActive.Tip(), false);
+        CSequentialBlockReads sequential;
         while (pindex)
         {
             if (pindex->nHeight % 100 == 0 && dProgressTip - dProgressStart > 0.0)